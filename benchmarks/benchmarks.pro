@@ -0,0 +1,29 @@
+#-------------------------------------------------
+#
+# Throughput benchmarks of the QBSON conversions
+#
+#   qmake && make && ./qbson_benchmark
+#   QBSON_BENCHMARK_OUTPUT=run.jsonl ./qbson_benchmark -o run.xml,xml
+#
+#-------------------------------------------------
+
+QT       += testlib
+QT       -= gui
+
+TARGET = qbson_benchmark
+TEMPLATE = app
+
+CONFIG += c++11
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG += link_pkgconfig
+
+PKGCONFIG += libbsoncxx
+
+DEFINES += QT_DEPRECATED_WARNINGS
+DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000
+
+include(../qbson.pri)
+
+SOURCES += \
+        qbson_benchmark.cpp
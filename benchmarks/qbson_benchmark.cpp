@@ -0,0 +1,506 @@
+#include <QtTest>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRandomGenerator>
+
+#include <atomic>
+#include <cstdlib>
+#include <vector>
+
+#include <bsoncxx/document/element.hpp>
+#include <bsoncxx/types/value.hpp>
+
+#include "qbson.h"
+#include "qbson_json.h"
+#include "qbson_utf8.h"
+
+//
+// Allocation counting: with glibc the benchmark interposes malloc, calloc
+// and realloc, which also catches operator new and the Qt containers.
+// Elsewhere allocations are reported as -1 and encoderSteadyState, which
+// requires a warmed up Encoder to encode every corpus without a single
+// allocation, is skipped.
+//
+
+namespace {
+
+std::atomic<unsigned long long> allocations(0);
+
+}
+
+#if defined(__GLIBC__)
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+}
+#define QBSON_COUNT_ALLOCATIONS
+#endif
+
+namespace {
+
+///
+/// \brief The Corpus struct holds one generated document shape in all inputs
+///
+struct Corpus
+{
+    QVector<QVariantMap> docs;
+    QVector<QVariantHash> hashes;
+    QVector<BSON::Document> documents;
+    QVector<QVariantList> lists;
+    std::vector<bsoncxx::document::value> bson;
+    QVector<QByteArray> json;
+    /// encoded BSON bytes of all documents, the base of MB/s
+    qint64 bytes = 0;
+};
+
+const int corpusSize = 64;
+
+QString randomString(QRandomGenerator &rng, int size, bool unicode)
+{
+    static const QString alphabet =
+            QStringLiteral("abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789");
+    static const QString extra =
+            QString::fromUtf8("\xc3\xa4\xc3\xb6\xc3\xbc\xc3\x9f\xd0\xb6\xe4\xb8\xad\xe6\x96\x87");
+
+    QString res(size, Qt::Uninitialized);
+    for (int i = 0; i < size; ++i) {
+        if (unicode && rng.bounded(8) == 0)
+            res[i] = extra.at(int(rng.bounded(extra.size())));
+        else
+            res[i] = alphabet.at(int(rng.bounded(alphabet.size())));
+    }
+    return res;
+}
+
+BSONoid randomOid(QRandomGenerator &rng)
+{
+    quint32 bytes[3];
+    rng.fillRange(bytes);
+    return BSONoid::fromBytes(bytes);
+}
+
+QVariant scalar(QRandomGenerator &rng, int i)
+{
+    switch (i % 4) {
+    case 0: return int(rng.bounded(1 << 30));
+    case 1: return rng.generateDouble() * 1e6;
+    case 2: return randomString(rng, 8 + int(rng.bounded(24)), false);
+    default: return bool(rng.bounded(2));
+    }
+}
+
+/// 256 mixed scalar fields
+QVariantMap flatDocument(QRandomGenerator &rng)
+{
+    QVariantMap res;
+    for (int i = 0; i < 256; ++i)
+        res.insert(QString("field_%1").arg(i), scalar(rng, i));
+    return res;
+}
+
+/// 32 levels of documents with a few scalars each
+QVariantMap deepDocument(QRandomGenerator &rng, int depth = 32)
+{
+    QVariantMap res;
+    for (int i = 0; i < 4; ++i)
+        res.insert(QString("value_%1").arg(i), scalar(rng, i));
+    if (depth > 0)
+        res.insert("child", deepDocument(rng, depth - 1));
+    return res;
+}
+
+/// arrays of numbers, strings and small documents
+QVariantMap arrayDocument(QRandomGenerator &rng)
+{
+    QVariantList ints, doubles, strings, docs;
+    for (int i = 0; i < 256; ++i) {
+        ints << int(rng.bounded(100000));
+        doubles << rng.generateDouble();
+        strings << randomString(rng, 12, false);
+    }
+    for (int i = 0; i < 32; ++i) {
+        QVariantMap item;
+        item.insert("id", i);
+        item.insert("price", rng.generateDouble() * 100);
+        item.insert("name", randomString(rng, 16, false));
+        docs << item;
+    }
+
+    QVariantMap res;
+    res.insert("ints", ints);
+    res.insert("doubles", doubles);
+    res.insert("strings", strings);
+    res.insert("items", docs);
+    return res;
+}
+
+/// long strings, one in eight characters outside ASCII
+QVariantMap stringDocument(QRandomGenerator &rng)
+{
+    QVariantMap res;
+    for (int i = 0; i < 16; ++i) {
+        res.insert(QString("text_%1").arg(i),
+                   randomString(rng, 256 + int(rng.bounded(2048)), i % 2));
+    }
+    return res;
+}
+
+/// binary blobs from 1 to 64 KiB
+QVariantMap binaryDocument(QRandomGenerator &rng)
+{
+    QVariantMap res;
+    for (int i = 0; i < 8; ++i) {
+        QByteArray blob(1024 << (i % 7), Qt::Uninitialized);
+        rng.fillRange((quint32*) blob.data(), blob.size() / 4);
+        res.insert(QString("blob_%1").arg(i), blob);
+    }
+    return res;
+}
+
+/// ObjectIds and dates, as in references and audit fields
+QVariantMap oidDateDocument(QRandomGenerator &rng)
+{
+    QVariantMap res;
+    res.insert("_id", QVariant::fromValue(randomOid(rng)));
+    for (int i = 0; i < 64; ++i) {
+        res.insert(QString("ref_%1").arg(i), QVariant::fromValue(randomOid(rng)));
+        res.insert(QString("at_%1").arg(i), QDateTime::fromMSecsSinceEpoch(
+                       1500000000000LL + qint64(rng.bounded(1 << 30)) * 1000,
+                       Qt::UTC));
+    }
+    return res;
+}
+
+Corpus makeCorpus(QVariantMap (*generate)(QRandomGenerator &), quint32 seed)
+{
+    QRandomGenerator rng(seed);
+    Corpus res;
+    for (int i = 0; i < corpusSize; ++i) {
+        const QVariantMap doc = generate(rng);
+        res.docs << doc;
+        res.hashes << BSON::Document::fromMap(doc).toHash();
+        res.lists << doc.values();
+        res.bson.push_back(BSON::toBson(doc));
+        res.documents << BSON::fromBsonDocument(res.bson.back().view());
+        res.bytes += qint64(res.bson.back().view().length());
+        res.json << BSON::toExtendedJson(res.bson.back().view());
+    }
+    return res;
+}
+
+QVariantMap deepDocumentDefault(QRandomGenerator &rng)
+{
+    return deepDocument(rng);
+}
+
+}
+
+class QBSONBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+
+    void toBson_data() { corpusRows(); }
+    void toBson();
+    void toBsonEncoder_data() { corpusRows(); }
+    void toBsonEncoder();
+    void toBsonArray_data() { corpusRows(); }
+    void toBsonArray();
+    void fromBson_data() { corpusRows(); }
+    void fromBson();
+    void fromBsonValue_data() { corpusRows(); }
+    void fromBsonValue();
+    void fromBsonDocument_data() { corpusRows(); }
+    void fromBsonDocument();
+    void fromBsonHash_data() { corpusRows(); }
+    void fromBsonHash();
+    void toBsonDocument_data() { corpusRows(); }
+    void toBsonDocument();
+    void lookupMap_data() { corpusRows(); }
+    void lookupMap();
+    void lookupHash_data() { corpusRows(); }
+    void lookupHash();
+    void lookupDocument_data() { corpusRows(); }
+    void lookupDocument();
+    void toExtendedJson_data() { corpusRows(); }
+    void toExtendedJson();
+    void fromExtendedJson_data() { corpusRows(); }
+    void fromExtendedJson();
+
+    void encoderSteadyState_data() { corpusRows(); }
+    void encoderSteadyState();
+
+private:
+    void corpusRows();
+
+    ///
+    /// \brief measure runs \a pass over the corpus under QBENCHMARK
+    ///
+    /// One warm-up pass and one extra pass outside of QBENCHMARK count
+    /// the allocations of a steady state pass. The
+    /// derived rates are printed and, with QBSON_BENCHMARK_OUTPUT set,
+    /// appended to that file as one JSON object per line. QTest's own
+    /// loggers (-o file,xml or -csv) record the timings.
+    ///
+    template <typename Pass>
+    void measure(Pass pass);
+
+    QHash<QString, Corpus> m_corpora;
+    quint64 m_sink = 0;
+};
+
+void QBSONBenchmark::initTestCase()
+{
+    BSON::init();
+
+    m_corpora.insert("flat", makeCorpus(&flatDocument, 1));
+    m_corpora.insert("deep", makeCorpus(&deepDocumentDefault, 2));
+    m_corpora.insert("array", makeCorpus(&arrayDocument, 3));
+    m_corpora.insert("string", makeCorpus(&stringDocument, 4));
+    m_corpora.insert("binary", makeCorpus(&binaryDocument, 5));
+    m_corpora.insert("oiddate", makeCorpus(&oidDateDocument, 6));
+
+    static const char *const levels[] = {"scalar", "sse2", "avx2"};
+    qInfo("UTF-8 kernels: %s", levels[int(BSON::utf8SimdLevel())]);
+}
+
+void QBSONBenchmark::corpusRows()
+{
+    QTest::addColumn<QString>("corpus");
+
+    for (const char *name : {"flat", "deep", "array", "string", "binary", "oiddate"})
+        QTest::newRow(name) << QString(name);
+}
+
+template <typename Pass>
+void QBSONBenchmark::measure(Pass pass)
+{
+    QFETCH(QString, corpus);
+    const Corpus &c = m_corpora.find(corpus).value();
+
+    pass(c);
+    const unsigned long long before = allocations.load(std::memory_order_relaxed);
+    pass(c);
+    const unsigned long long allocated =
+            allocations.load(std::memory_order_relaxed) - before;
+
+    qint64 passes = 0;
+    QElapsedTimer timer;
+    timer.start();
+    QBENCHMARK {
+        pass(c);
+        ++passes;
+    }
+    const double seconds = double(qMax<qint64>(1, timer.nsecsElapsed())) / 1e9;
+
+    const double docsPerSecond = double(passes) * c.docs.size() / seconds;
+    const double mbPerSecond = double(passes) * double(c.bytes) / seconds / 1e6;
+#ifdef QBSON_COUNT_ALLOCATIONS
+    const double allocationsPerDoc = double(allocated) / c.docs.size();
+#else
+    Q_UNUSED(allocated)
+    const double allocationsPerDoc = -1;
+#endif
+
+    qInfo("%s/%s: %.0f docs/s, %.1f MB/s, %.1f allocations/doc",
+          QTest::currentTestFunction(), qPrintable(corpus),
+          docsPerSecond, mbPerSecond, allocationsPerDoc);
+
+    const QByteArray output = qgetenv("QBSON_BENCHMARK_OUTPUT");
+    if (output.isEmpty())
+        return;
+
+    QJsonObject result;
+    result.insert("benchmark", QTest::currentTestFunction());
+    result.insert("corpus", corpus);
+    result.insert("docs", c.docs.size());
+    result.insert("bytes", double(c.bytes));
+    result.insert("docsPerSecond", docsPerSecond);
+    result.insert("mbPerSecond", mbPerSecond);
+    result.insert("allocationsPerDoc", allocationsPerDoc);
+
+    QFile file(QString::fromLocal8Bit(output));
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append))
+        QFAIL(qPrintable(file.errorString()));
+    file.write(QJsonDocument(result).toJson(QJsonDocument::Compact));
+    file.write("\n");
+}
+
+void QBSONBenchmark::toBson()
+{
+    measure([this](const Corpus &c) {
+        for (const QVariantMap &doc : c.docs)
+            m_sink += BSON::toBson(doc).view().length();
+    });
+}
+
+void QBSONBenchmark::toBsonEncoder()
+{
+    BSON::Encoder encoder;
+    measure([this, &encoder](const Corpus &c) {
+        for (const QVariantMap &doc : c.docs)
+            m_sink += encoder.encode(doc).length();
+    });
+}
+
+void QBSONBenchmark::toBsonArray()
+{
+    measure([this](const Corpus &c) {
+        for (const QVariantList &lst : c.lists)
+            m_sink += BSON::toBsonArray(lst).view().length();
+    });
+}
+
+void QBSONBenchmark::fromBson()
+{
+    measure([this](const Corpus &c) {
+        for (const bsoncxx::document::value &doc : c.bson)
+            m_sink += quint64(BSON::fromBson(doc.view()).size());
+    });
+}
+
+void QBSONBenchmark::fromBsonValue()
+{
+    measure([this](const Corpus &c) {
+        for (const bsoncxx::document::value &doc : c.bson) {
+            for (const bsoncxx::document::element &e : doc.view())
+                m_sink += quint64(BSON::fromBsonValue(e.get_value()).userType());
+        }
+    });
+}
+
+void QBSONBenchmark::fromBsonDocument()
+{
+    measure([this](const Corpus &c) {
+        for (const bsoncxx::document::value &doc : c.bson)
+            m_sink += quint64(BSON::fromBsonDocument(doc.view()).size());
+    });
+}
+
+void QBSONBenchmark::fromBsonHash()
+{
+    measure([this](const Corpus &c) {
+        for (const bsoncxx::document::value &doc : c.bson) {
+            const BSONDocumentView view(doc.view());
+            QVariantHash hash;
+            hash.reserve(view.count());
+            for (auto it = view.begin(); it != view.end(); ++it)
+                hash.insert(it.key(), it.value());
+            m_sink += quint64(hash.size());
+        }
+    });
+}
+
+void QBSONBenchmark::toBsonDocument()
+{
+    measure([this](const Corpus &c) {
+        for (const BSON::Document &doc : c.documents)
+            m_sink += BSON::toBson(doc).view().length();
+    });
+}
+
+void QBSONBenchmark::lookupMap()
+{
+    measure([this](const Corpus &c) {
+        for (const QVariantMap &doc : c.docs) {
+            for (auto it = doc.cbegin(); it != doc.cend(); ++it)
+                m_sink += quint64(doc.value(it.key()).userType());
+        }
+    });
+}
+
+void QBSONBenchmark::lookupHash()
+{
+    measure([this](const Corpus &c) {
+        for (const QVariantHash &doc : c.hashes) {
+            for (auto it = doc.cbegin(); it != doc.cend(); ++it)
+                m_sink += quint64(doc.value(it.key()).userType());
+        }
+    });
+}
+
+void QBSONBenchmark::lookupDocument()
+{
+    measure([this](const Corpus &c) {
+        for (const BSON::Document &doc : c.documents) {
+            for (const BSON::Document::Field &field : doc)
+                m_sink += quint64(doc.value(field.key).userType());
+        }
+    });
+}
+
+void QBSONBenchmark::toExtendedJson()
+{
+    BSON::Writer out;
+    measure([this, &out](const Corpus &c) {
+        for (const bsoncxx::document::value &doc : c.bson) {
+            out.clear();
+            BSON::toExtendedJson(doc.view(), out);
+            m_sink += out.size();
+        }
+    });
+}
+
+void QBSONBenchmark::fromExtendedJson()
+{
+    BSON::Writer out;
+    measure([this, &out](const Corpus &c) {
+        for (const QByteArray &json : c.json) {
+            out.clear();
+            BSON::fromExtendedJson(json.constData(), size_t(json.size()), out);
+            m_sink += out.size();
+        }
+    });
+}
+
+void QBSONBenchmark::encoderSteadyState()
+{
+#ifdef QBSON_COUNT_ALLOCATIONS
+    QFETCH(QString, corpus);
+    const Corpus &c = m_corpora.find(corpus).value();
+
+    // the first pass grows the buffer and sets up the per-thread state
+    BSON::Encoder encoder;
+    for (const QVariantMap &doc : c.docs)
+        m_sink += encoder.encode(doc).length();
+
+    const unsigned long long before = allocations.load(std::memory_order_relaxed);
+    for (const QVariantMap &doc : c.docs)
+        m_sink += encoder.encode(doc).length();
+    const unsigned long long allocated =
+            allocations.load(std::memory_order_relaxed) - before;
+
+    QCOMPARE(allocated, 0ULL);
+#else
+    QSKIP("allocations are only counted with glibc");
+#endif
+}
+
+QTEST_GUILESS_MAIN(QBSONBenchmark)
+
+#include "qbson_benchmark.moc"
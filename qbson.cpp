@@ -1,9 +1,21 @@
 #include <QDebug>
 #include "qbson.h"
+#include "qbson_reader.h"
+#include "qbson_writer.h"
+#include "qbson_p.h"
 //#include "QMongoDriver.h"
 
 #include <QUuid>
+#include <QBuffer>
+#include <QMutex>
+#include <QSet>
+#include <QThread>
+#include <QVector>
+#include <QPair>
+#include <QtEndian>
 #include <QDataStream>
+#include <QRect>
+#include <QVersionNumber>
 
 #include <bsoncxx/builder/basic/array.hpp>
 #include <bsoncxx/builder/basic/document.hpp>
@@ -19,6 +31,127 @@
 namespace BSON {
 namespace _private {
 
+QAtomicInt keyCacheCapacity(0);
+
+///
+/// \brief The KeyCache class interns document keys for the current thread
+///
+/// Decoding maps raw key bytes to an implicitly shared QString, encoding
+/// maps a QString to its shared UTF-8 bytes. A table that reaches the
+/// capacity is dropped and refilled. Counters are only written by the
+/// owning thread, with a plain load and store, and summed up by
+/// keyCacheStats() under the registry lock.
+///
+class KeyCache
+{
+public:
+    KeyCache();
+    ~KeyCache();
+
+    static KeyCache &local() {
+        static thread_local KeyCache cache;
+        return cache;
+    }
+
+    QString decode(const char *key, size_t size) {
+        const int capacity = keyCacheCapacity.loadAcquire();
+        if (!capacity) {
+            if (!m_decode.isEmpty())
+                m_decode.clear();
+            return stringFromUtf8(key, size);
+        }
+
+        auto it = m_decode.constFind(QByteArray::fromRawData(key, int(size)));
+        if (it != m_decode.constEnd()) {
+            add(decodeHits);
+            return it.value();
+        }
+
+        add(decodeMisses);
+        if (m_decode.size() >= capacity)
+            m_decode.clear();
+
+        const QString res = stringFromUtf8(key, size);
+        m_decode.insert(QByteArray(key, int(size)), res);
+        return res;
+    }
+
+    ///
+    /// \brief encode writes a placeholder element type and \a key
+    /// \return offset of the element type, Writer::npos if \a key
+    /// contains U+0000
+    ///
+    size_t encode(Writer &w, const QString &key) {
+        const int capacity = keyCacheCapacity.loadAcquire();
+        if (!capacity) {
+            if (!m_encode.isEmpty())
+                m_encode.clear();
+            return w.beginElementUtf16((const uint16_t*) key.constData(),
+                                       size_t(key.size()));
+        }
+
+        auto it = m_encode.constFind(key);
+        if (it != m_encode.constEnd()) {
+            add(encodeHits);
+            return w.beginElement(it.value().constData(),
+                                  size_t(it.value().size()));
+        }
+
+        add(encodeMisses);
+        if (m_encode.size() >= capacity)
+            m_encode.clear();
+
+        const QByteArray name = key.toUtf8();
+        if (name.contains('\0'))
+            return Writer::npos;
+        m_encode.insert(key, name);
+        return w.beginElement(name.constData(), size_t(name.size()));
+    }
+
+    QAtomicInteger<quint64> decodeHits;
+    QAtomicInteger<quint64> decodeMisses;
+    QAtomicInteger<quint64> encodeHits;
+    QAtomicInteger<quint64> encodeMisses;
+
+private:
+    static void add(QAtomicInteger<quint64> &counter) {
+        counter.storeRelease(counter.loadAcquire() + 1);
+    }
+
+    QHash<QByteArray, QString> m_decode;
+    QHash<QString, QByteArray> m_encode;
+};
+
+struct KeyCacheRegistry {
+    QMutex mutex;
+    QSet<KeyCache*> caches;
+    KeyCacheStats retired;
+
+    static KeyCacheRegistry &instance() {
+        static KeyCacheRegistry registry;
+        return registry;
+    }
+};
+
+KeyCache::KeyCache()
+    : decodeHits(0), decodeMisses(0), encodeHits(0), encodeMisses(0)
+{
+    KeyCacheRegistry &registry = KeyCacheRegistry::instance();
+    QMutexLocker locker(&registry.mutex);
+    registry.caches.insert(this);
+}
+
+KeyCache::~KeyCache()
+{
+    KeyCacheRegistry &registry = KeyCacheRegistry::instance();
+    QMutexLocker locker(&registry.mutex);
+    registry.caches.remove(this);
+    registry.retired.decodeHits += decodeHits.loadAcquire();
+    registry.retired.decodeMisses += decodeMisses.loadAcquire();
+    registry.retired.encodeHits += encodeHits.loadAcquire();
+    registry.retired.encodeMisses += encodeMisses.loadAcquire();
+}
+
 template <typename T>
 const T& refVariantValue(const QVariant & variant, bool &ok) {
     static T def;
@@ -31,403 +164,905 @@ const T& refVariantValue(const QVariant & variant, bool &ok) {
     return def;
 }
 
-bsoncxx::types::value toCustomBSONBinary(const QVariant &v, QList<QByteArray> & data_lst) {
-    using namespace bsoncxx::types;
-    using bsoncxx::binary_sub_type;
-    b_binary bin;
-    bin.sub_type = binary_sub_type::k_user;
+///
+/// \brief appendString writes \a str as BSON string without a UTF-8 copy
+///
+inline void appendString(Writer &w, const QString &str) {
+    w.appendStringUtf16((const uint16_t*) str.constData(), size_t(str.size()));
+}
 
-    {
-        QByteArray data;
+bool appendDocument(Writer &w, const QVariantMap &obj, Error &err) {
+    const size_t start = w.beginDocument();
+
+    KeyCache &keys = KeyCache::local();
+
+    auto it = obj.cbegin();
+    while(it != obj.cend()) {
+        const size_t typePos = keys.encode(w, it.key());
+        if (typePos == Writer::npos) {
+            setError(err, Error::InvalidKey, 0);
+            err.prependPath(it.key());
+            return false;
+        }
+        if (!appendValue(w, typePos, it.value(), err)) {
+            err.prependPath(it.key());
+            return false;
+        }
+        QBSON_STATS_TYPE(Encode, w.data()[typePos]);
+        ++it;
+    }
+
+    w.endDocument(start);
+    return true;
+}
+
+bool appendDocument(Writer &w, const Document &doc, Error &err) {
+    const size_t start = w.beginDocument();
+
+    KeyCache &keys = KeyCache::local();
+
+    for (const Document::Field &field : doc) {
+        const size_t typePos = keys.encode(w, field.key);
+        if (typePos == Writer::npos) {
+            setError(err, Error::InvalidKey, 0);
+            err.prependPath(field.key);
+            return false;
+        }
+        if (!appendValue(w, typePos, field.value, err)) {
+            err.prependPath(field.key);
+            return false;
+        }
+        QBSON_STATS_TYPE(Encode, w.data()[typePos]);
+    }
+
+    w.endDocument(start);
+    return true;
+}
 
-        {
-            QDataStream stream(&data, QIODevice::WriteOnly);
-            stream.setVersion(QDataStream::Qt_5_6);
-            stream << v;
+bool appendArray(Writer &w, const QVariantList &lst, Error &err) {
+    const size_t start = w.beginDocument();
+
+    uint32_t index = 0;
+    for (auto iter = lst.constBegin();
+         iter != lst.constEnd();
+         ++iter, ++index) {
+        const size_t typePos = w.beginIndexElement(index);
+        if (!appendValue(w, typePos, *iter, err)) {
+            err.prependPath(QString::number(index));
+            return false;
         }
+        QBSON_STATS_TYPE(Encode, w.data()[typePos]);
+    }
+
+    w.endDocument(start);
+    return true;
+}
+
+void appendArray(Writer &w, const QStringList &lst) {
+    const size_t start = w.beginDocument();
+
+    uint32_t index = 0;
+    for (auto iter = lst.constBegin();
+         iter != lst.constEnd();
+         ++iter, ++index) {
+        w.appendIndexKey(bsoncxx::type::k_utf8, index);
+        appendString(w, *iter);
+        QBSON_STATS_TYPE(Encode, bsoncxx::type::k_utf8);
+    }
+
+    w.endDocument(start);
+}
+
+///
+/// \brief The StreamScratch struct is a reusable QDataStream target
+///
+/// Kept per thread so the fallback encoding does not allocate a buffer
+/// and a QBuffer for every value.
+///
+struct StreamScratch {
+    QByteArray data;
+    QBuffer buffer;
+
+    StreamScratch() : buffer(&data) {
+        buffer.open(QIODevice::WriteOnly);
+    }
+
+    static StreamScratch &local() {
+        static thread_local StreamScratch scratch;
+        return scratch;
+    }
+};
+
+void appendCustomBinary(Writer &w, size_t typePos, const QVariant &v) {
+    QBSON_STATS_FALLBACK(DataStream, v.userType());
 
-        data_lst << data;
+    StreamScratch &scratch = StreamScratch::local();
+    scratch.buffer.seek(0);
+
+    {
+        QDataStream stream(&scratch.buffer);
+        stream.setVersion(QDataStream::Qt_5_6);
+        stream << v;
     }
 
-    const QByteArray & data = data_lst.last();
+    w.setElementType(typePos, bsoncxx::type::k_binary);
+    w.appendBinary(bsoncxx::binary_sub_type::k_user,
+                   scratch.data.constData(), size_t(scratch.buffer.pos()));
+}
+
+///
+/// \brief appendTaggedBinary writes \a v in the compact TaggedBinary encoding
+///
+void appendTaggedBinary(Writer &w, size_t typePos, const QVariant &v,
+                        std::uint8_t tag) {
+    w.setElementType(typePos, bsoncxx::type::k_binary);
+    const size_t start = w.size();
+    w.appendInt32(0);
+    w.appendByte(std::uint8_t(bsoncxx::binary_sub_type::k_user));
+    w.appendByte(TaggedBinary::Marker);
+    w.appendByte(TaggedBinary::Version);
+    w.appendByte(tag);
+
+    switch (tag) {
+    case TaggedBinary::Date:
+        w.appendInt64(((const QDate*) v.constData())->toJulianDay());
+        break;
+    case TaggedBinary::Time: {
+        const QTime &time = *(const QTime*) v.constData();
+        w.appendInt32(time.isValid() ? time.msecsSinceStartOfDay() : -1);
+    } break;
+    case TaggedBinary::Point: {
+        const QPoint &point = *(const QPoint*) v.constData();
+        w.appendInt32(point.x());
+        w.appendInt32(point.y());
+    } break;
+    case TaggedBinary::Size: {
+        const QSize &size = *(const QSize*) v.constData();
+        w.appendInt32(size.width());
+        w.appendInt32(size.height());
+    } break;
+    case TaggedBinary::Rect: {
+        const QRect &rect = *(const QRect*) v.constData();
+        w.appendInt32(rect.left());
+        w.appendInt32(rect.top());
+        w.appendInt32(rect.right());
+        w.appendInt32(rect.bottom());
+    } break;
+    case TaggedBinary::VersionNumber: {
+        const QVersionNumber &version = *(const QVersionNumber*) v.constData();
+        for (int i = 0; i < version.segmentCount(); ++i)
+            w.appendInt32(version.segmentAt(i));
+    } break;
+    }
 
-    bin.size = data.size();
-    bin.bytes = (uint8_t*) data.constData();
+    w.patchInt32(start, int32_t(w.size() - start - 5));
+}
 
-    return value(bin);
+///
+/// \brief decodeTaggedBinary reads the compact encoding, \a data starts
+/// at the marker
+/// \return false on unknown version or tag and on a payload of wrong size
+///
+bool decodeTaggedBinary(const uint8_t *data, size_t size, QVariant &res) {
+    if (size < 3 || data[1] != TaggedBinary::Version)
+        return false;
+
+    const uint8_t *p = data + 3;
+    const size_t n = size - 3;
+
+    switch (data[2]) {
+    case TaggedBinary::Date:
+        if (n != 8)
+            return false;
+        res = QDate::fromJulianDay(qFromLittleEndian<qint64>(p));
+        return true;
+    case TaggedBinary::Time: {
+        if (n != 4)
+            return false;
+        const qint32 msecs = qFromLittleEndian<qint32>(p);
+        res = msecs < 0 ? QTime() : QTime::fromMSecsSinceStartOfDay(msecs);
+        return true;
+    }
+    case TaggedBinary::Point:
+        if (n != 8)
+            return false;
+        res = QPoint(qFromLittleEndian<qint32>(p),
+                     qFromLittleEndian<qint32>(p + 4));
+        return true;
+    case TaggedBinary::Size:
+        if (n != 8)
+            return false;
+        res = QSize(qFromLittleEndian<qint32>(p),
+                    qFromLittleEndian<qint32>(p + 4));
+        return true;
+    case TaggedBinary::Rect:
+        if (n != 16)
+            return false;
+        res = QRect(QPoint(qFromLittleEndian<qint32>(p),
+                           qFromLittleEndian<qint32>(p + 4)),
+                    QPoint(qFromLittleEndian<qint32>(p + 8),
+                           qFromLittleEndian<qint32>(p + 12)));
+        return true;
+    case TaggedBinary::VersionNumber: {
+        if (n % 4)
+            return false;
+        QVector<int> segments(int(n / 4));
+        for (int i = 0; i < segments.size(); ++i)
+            segments[i] = qFromLittleEndian<qint32>(p + 4 * i);
+        res = QVariant::fromValue(QVersionNumber(std::move(segments)));
+        return true;
+    }
+    default:
+        return false;
+    }
 }
 
-QVariant fromCustomBSONBinary(const bsoncxx::types::b_binary & binary) {
+QVariant fromCustomBSONBinary(const char *data, int size) {
     QVariant res;
-    QByteArray data((const char*) binary.bytes, binary.size);
+    const QByteArray blob = QByteArray::fromRawData(data, size);
     {
-        QDataStream stream(data);
+        QDataStream stream(blob);
         stream.setVersion(QDataStream::Qt_5_6);
         stream >> res;
     }
     return res;
 }
 
-bsoncxx::types::value toBsonValue(const QVariant &v,
-                                  QList<QByteArray> & data_lst,
-                                  QList<bsoncxx::document::value> & b_docs,
-                                  QList<bsoncxx::array::value> & b_arrays) {
-    using namespace bsoncxx;
-    using namespace bsoncxx::types;
+bool appendValue(Writer &w, size_t typePos, const QVariant &v, Error &err) {
+    using bsoncxx::type;
     using bsoncxx::binary_sub_type;
-    using namespace std::chrono;
 
-    int type = v.type();
+    int vtype = v.type();
 
-    switch(type) {
+    switch(vtype) {
     case QVariant::Int:
-        return value(b_int32{v.toInt()});
+        w.setElementType(typePos, type::k_int32);
+        w.appendInt32(v.toInt());
+        return true;
     case QVariant::String: {
         bool f = true;
         const QString & data = refVariantValue<QString>(v, f);
         if (!f)
-            throw BSONexception(QString("Error in %1")
-                                .arg(v.typeName()));
-        {
-            QByteArray utf8 = data.toUtf8();
-            data_lst << utf8;
-        }
-        const QByteArray & utf8 = data_lst.last();
-        return value(b_utf8{
-                         stdx::string_view(utf8.constData(), utf8.size())});
+            return setError(err, Error::UnsupportedValue, v.userType());
+
+        w.setElementType(typePos, type::k_utf8);
+        appendString(w, data);
+        return true;
     } break;
     case QVariant::StringList: {
         bool f = true;
         const QStringList & sl = refVariantValue<QStringList>(v, f);
         if (!f)
-            throw BSONexception(QString("Error in %1")
-                                .arg(v.typeName()));
-
-        auto array_builder = bsoncxx::builder::basic::array{};
-
-        for (auto iter = sl.constBegin();
-             iter != sl.constEnd();
-             ++iter) {
-            array_builder.append(toBsonValue(*iter,
-                                             data_lst,
-                                             b_docs,
-                                             b_arrays));
-        }
-
-        b_arrays << bsoncxx::array::value(array_builder.view());
+            return setError(err, Error::UnsupportedValue, v.userType());
 
-        return value(b_array{b_arrays.last().view()});
+        w.setElementType(typePos, type::k_array);
+        appendArray(w, sl);
+        return true;
     } break;
     case QVariant::LongLong:
-        return value(b_int64{v.toLongLong()});
+        w.setElementType(typePos, type::k_int64);
+        w.appendInt64(v.toLongLong());
+        return true;
     case QVariant::UInt:
-        return value(b_int64{v.toUInt()});
+        w.setElementType(typePos, type::k_int64);
+        w.appendInt64(v.toUInt());
+        return true;
     case QVariant::Map: {
         bool f = true;
         const QVariantMap & obj = refVariantValue<QVariantMap>(v, f);
         if (!f)
-            throw BSONexception(QString("Error in %1")
-                                .arg(v.typeName()));
-
-        using bsoncxx::builder::basic::kvp;
-        auto doc = builder::basic::document{};
-
-        auto it = obj.cbegin();
-        while(it != obj.cend()) {
-            const std::string name = it.key().toStdString();
-            bool ok = true;
-            doc.append(kvp(name, toBsonValue(it.value(),
-                                             data_lst,
-                                             b_docs,
-                                             b_arrays)));
-            Q_ASSERT(ok);
-            ++it;
-        }
-        b_docs << bsoncxx::document::value(doc.view());
+            return setError(err, Error::UnsupportedValue, v.userType());
 
-        return value(b_document{b_docs.last().view()});
+        w.setElementType(typePos, type::k_document);
+        return appendDocument(w, obj, err);
     } break;
     case QVariant::List: {
         bool f = true;
-        const QVariantList list = refVariantValue<QVariantList>(v, f);
+        const QVariantList & list = refVariantValue<QVariantList>(v, f);
         if (!f)
-            throw BSONexception(QString("Error in %1")
-                                .arg(v.typeName()));
-
-        auto array_builder = bsoncxx::builder::basic::array{};
-
-        for (auto iter = list.constBegin();
-             iter != list.constEnd();
-             ++iter) {
-            array_builder.append(toBsonValue(*iter,
-                                             data_lst,
-                                             b_docs,
-                                             b_arrays));
-        }
+            return setError(err, Error::UnsupportedValue, v.userType());
 
-        b_arrays << bsoncxx::array::value(array_builder.view());
-
-        return value(b_array{b_arrays.last().view()});
+        w.setElementType(typePos, type::k_array);
+        return appendArray(w, list, err);
     } break;
     case QVariant::Double:
-        return value(b_double{v.toDouble()});
+        w.setElementType(typePos, type::k_double);
+        w.appendDouble(v.toDouble());
+        return true;
     case QVariant::Bool:
-        return value(b_bool{v.toBool()});
-    case QVariant::Time: return toCustomBSONBinary(v, data_lst);
-    case QVariant::Date: return toCustomBSONBinary(v, data_lst);
+        w.setElementType(typePos, type::k_bool);
+        w.appendByte(v.toBool() ? 1 : 0);
+        return true;
     case QVariant::DateTime: {
         bool f = true;
         const QDateTime & data = refVariantValue<QDateTime>(v, f);
         if (!f)
-            throw BSONexception(QString("Error in %1")
-                                .arg(v.typeName()));
+            return setError(err, Error::UnsupportedValue, v.userType());
 
-        milliseconds secs(data.toMSecsSinceEpoch());
-        return value(b_date(secs));
+        w.setElementType(typePos, type::k_date);
+        w.appendInt64(data.toMSecsSinceEpoch());
+        return true;
     } break;
     case QVariant::Invalid:
-        return value(b_null());
+        w.setElementType(typePos, type::k_null);
+        return true;
     case QVariant::ByteArray: {
         bool f = true;
         const QByteArray & binary = refVariantValue<QByteArray>(v, f);
         if (!f)
-            throw BSONexception(QString("Error in %1")
-                                .arg(v.typeName()));
-
-        b_binary bin;
-        bin.sub_type = binary_sub_type::k_binary;
+            return setError(err, Error::UnsupportedValue, v.userType());
 
-        bin.size = binary.size();
-        bin.bytes = (uint8_t*) binary.constData();
-
-        return value(bin);
+        w.setElementType(typePos, type::k_binary);
+        w.appendBinary(binary_sub_type::k_binary,
+                       binary.constData(), binary.size());
+        return true;
     } break;
     case QVariant::Uuid: {
         bool f = true;
         const QUuid & uuid = refVariantValue<QUuid>(v, f);
         if (!f)
-            throw BSONexception(QString("Error in %1")
-                                .arg(v.typeName()));
+            return setError(err, Error::UnsupportedValue, v.userType());
 
-        QByteArray blob = uuid.toRfc4122();
+        uchar blob[16];
+        qToBigEndian(uuid.data1, blob);
+        qToBigEndian(uuid.data2, blob + 4);
+        qToBigEndian(uuid.data3, blob + 6);
+        memcpy(blob + 8, uuid.data4, 8);
 
-        b_binary bin;
-        bin.sub_type = binary_sub_type::k_uuid;
+        w.setElementType(typePos, type::k_binary);
+        w.appendBinary(binary_sub_type::k_uuid, blob, sizeof(blob));
+        return true;
+    } break;
+    default:
+        break;
+    }
 
-        bin.size = blob.size();
-        bin.bytes = (uint8_t*) blob.constData();
+    const Converter &c = converterFor(v);
 
-        return value(bin);
-    } break;
-    case QVariant::UserType: {
-
-        if (v.userType() == qMetaTypeId<BSONbinary>()) {
-            bool f = true;
-            const BSONbinary & binary = refVariantValue<BSONbinary>(v, f);
-            if (!f)
-                throw BSONexception(QString("Error in %1")
-                                    .arg(v.typeName()));
-
-            b_binary bin;
-
-            switch (binary.type) {
-            case BSONbinary::Unknown :
-                bin.sub_type = binary_sub_type::k_binary;
-                break;
-            case BSONbinary::Function :
-                bin.sub_type = binary_sub_type::k_function;
-                break;
-            case BSONbinary::MD5 :
-                bin.sub_type = binary_sub_type::k_md5;
-                break;
-//            case BSONbinary::User :
-//                bin.sub_type = binary_sub_type::k_user;
-            }
+    switch (c.kind) {
+    case Converter::Binary: {
+        bool f = true;
+        const BSONbinary & binary = refVariantValue<BSONbinary>(v, f);
+        if (!f)
+            return setError(err, Error::UnsupportedValue, v.userType());
+
+        binary_sub_type subType = binary_sub_type::k_binary;
+
+        switch (binary.type) {
+        case BSONbinary::Unknown :
+            subType = binary_sub_type::k_binary;
+            break;
+        case BSONbinary::Function :
+            subType = binary_sub_type::k_function;
+            break;
+        case BSONbinary::MD5 :
+            subType = binary_sub_type::k_md5;
+            break;
+//        case BSONbinary::User :
+//            subType = binary_sub_type::k_user;
+        }
+
+        w.setElementType(typePos, type::k_binary);
+        w.appendBinary(subType,
+                       binary.data.constData(), binary.data.size());
+        return true;
+    }
+    case Converter::Code: {
+        bool f = true;
+        const BSONcode & binary = refVariantValue<BSONcode>(v, f);
+        if (!f)
+            return setError(err, Error::UnsupportedValue, v.userType());
+
+        w.setElementType(typePos, type::k_code);
+        appendString(w, binary.code);
+        return true;
+    }
+    case Converter::CodeWScope: {
+        bool f = true;
+        auto & binary = refVariantValue<BSONcodeWscope>(v, f);
+        if (!f)
+            return setError(err, Error::UnsupportedValue, v.userType());
+
+        w.setElementType(typePos, type::k_codewscope);
+        const size_t start = w.beginDocument();
+        appendString(w, binary.code);
+        if (!appendDocument(w, binary.scope, err))
+            return false;
+        w.patchInt32(start, int32_t(w.size() - start));
+        return true;
+    }
+    case Converter::MaxKey:
+        w.setElementType(typePos, type::k_maxkey);
+        return true;
+    case Converter::MinKey:
+        w.setElementType(typePos, type::k_minkey);
+        return true;
+    case Converter::Oid: {
+        bool f = true;
+        const BSONoid & binary = refVariantValue<BSONoid>(v, f);
+        if (!f)
+            return setError(err, Error::UnsupportedValue, v.userType());
+        if (binary.isNull())
+            return setError(err, Error::InvalidValue, v.userType());
+
+        w.setElementType(typePos, type::k_oid);
+        w.appendBytes(binary.data(), 12);
+        return true;
+    }
+    case Converter::Regexp: {
+        bool f = true;
+        const BSONregexp & binary = refVariantValue<BSONregexp>(v, f);
+        if (!f)
+            return setError(err, Error::UnsupportedValue, v.userType());
+
+        w.setElementType(typePos, type::k_regex);
+        w.appendUtf16((const uint16_t*) binary.regexp.constData(),
+                      size_t(binary.regexp.size()));
+        w.appendByte(0);
+        w.appendUtf16((const uint16_t*) binary.options.constData(),
+                      size_t(binary.options.size()));
+        w.appendByte(0);
+        return true;
+    }
+    case Converter::Custom: {
+        w.setElementType(typePos, type::k_binary);
+        const size_t start = w.size();
+        w.appendInt32(0);
+        w.appendByte(c.subType);
+        c.encodeThunk(c.encode, v.constData(), w);
+        w.patchInt32(start, int32_t(w.size() - start - 5));
+        return true;
+    }
+    case Converter::ToMap:
+        QBSON_STATS_FALLBACK(CanConvert, v.userType());
+        return appendValue(w, typePos, v.toMap(), err);
+    case Converter::ToList:
+        QBSON_STATS_FALLBACK(CanConvert, v.userType());
+        return appendValue(w, typePos, v.toList(), err);
+    case Converter::ToLongLong:
+        QBSON_STATS_FALLBACK(CanConvert, v.userType());
+        return appendValue(w, typePos, v.toLongLong(), err);
+    case Converter::ToInt:
+        QBSON_STATS_FALLBACK(CanConvert, v.userType());
+        return appendValue(w, typePos, v.toInt(), err);
+    case Converter::ToString:
+        QBSON_STATS_FALLBACK(CanConvert, v.userType());
+        return appendValue(w, typePos, v.toString(), err);
+    case Converter::DataStream:
+        appendCustomBinary(w, typePos, v);
+        return true;
+    case Converter::Tagged:
+        appendTaggedBinary(w, typePos, v, c.subType);
+        return true;
+    case Converter::OrderedDocument:
+        w.setElementType(typePos, type::k_document);
+        return appendDocument(w, *(const Document*) v.constData(), err);
+    case Converter::Unresolved:
+    case Converter::Unsupported:
+        break;
+    }
+
+    return setError(err, Error::UnsupportedValue, v.userType());
+}
+
+void appendValue(Writer &w, size_t typePos, const QVariant &v) {
+    Error err;
+    if (!appendValue(w, typePos, v, err))
+        throw BSONexception(err.toString());
+}
+
+bool decodeDocument(const uint8_t *data, size_t size,
+                    QVariantMap &res, Error &err);
+bool decodeArray(const uint8_t *data, size_t size,
+                 QVariantList &res, Error &err);
+
+template <typename Map>
+bool decodeDocumentAs(const uint8_t *data, size_t size, Map &res, Error &err);
+template <typename Map>
+bool decodeArrayAs(const uint8_t *data, size_t size, QVariantList &res, Error &err);
 
-            bin.size = binary.data.size();
-            bin.bytes = (uint8_t*) binary.data.constData();
+inline void insertField(QVariantMap &res, const QString &key, const QVariant &value) {
+    res.insert(key, value);
+}
+
+inline void insertField(Document &res, const QString &key, const QVariant &value) {
+    res.append(key, value);
+}
+
+bool decodeBinary(bsoncxx::binary_sub_type subType,
+                  const char *data, int size, QVariant &res, Error &err) {
+    using bsoncxx::binary_sub_type;
 
-            return value(bin);
+    switch (subType) {
+    case binary_sub_type::k_uuid :
+        res = QUuid::fromRfc4122(QByteArray::fromRawData(data, size));
+        return true;
+    case binary_sub_type::k_binary :
+        res = QByteArray(data, size);
+        return true;
+    case binary_sub_type::k_function : {
+        BSONbinary binary;
+        binary.type = BSONbinary::Function;
+        binary.data = QByteArray(data, size);
+        res = QVariant::fromValue(binary);
+        return true;
+    }
+    case binary_sub_type::k_md5 : {
+        BSONbinary binary;
+        binary.type = BSONbinary::MD5;
+        binary.data = QByteArray(data, size);
+        res = QVariant::fromValue(binary);
+        return true;
+    }
+    case binary_sub_type::k_user :
+        if (size > 0 && uint8_t(data[0]) == TaggedBinary::Marker) {
+            if (!decodeTaggedBinary((const uint8_t*) data, size_t(size), res))
+                return setError(err, Error::MalformedBinary, int(subType));
+            return true;
+        }
+        res = fromCustomBSONBinary(data, size);
+        return true;
+    default:
+        if (const Converter *c = converterForSubType(std::uint8_t(subType))) {
+            if (!c->decodeThunk(c->decode, (const uint8_t*) data, size_t(size), res))
+                return setError(err, Error::InvalidValue, c->metaType);
+            return true;
         }
-        if (v.userType() == qMetaTypeId<BSONcode>()) {
-            bool f = true;
-            const BSONcode & binary = refVariantValue<BSONcode>(v, f);
-            if (!f)
-                throw BSONexception(QString("Error in %1")
-                                    .arg(v.typeName()));
-
-            return value{b_code{binary.code.toStdString()}};
+        break;
+    }
+
+    return setError(err, Error::UnknownBinarySubType, int(subType));
+}
+
+BSONoid decodeOid(const uint8_t *data) {
+    return BSONoid::fromBytes(data);
+}
+
+///
+/// \brief decodeValueAs decodes embedded documents into \a Map, QVariantMap
+/// or Document
+///
+template <typename Map>
+bool decodeValueAs(const Element &e, QVariant &res, Error &err) {
+    using bsoncxx::type;
+
+    switch (e.type) {
+    case type::k_double: res = e.dbl(); return true;
+    case type::k_utf8:
+        res = stringFromUtf8(e.string(), e.stringSize());
+        return true;
+    case type::k_undefined: res = QVariant(); return true;
+    case type::k_oid: res = QVariant::fromValue(decodeOid(e.value)); return true;
+    case type::k_bool: res = e.boolean(); return true;
+    case type::k_date: res = QDateTime::fromMSecsSinceEpoch(e.int64()); return true;
+    case type::k_binary:
+        return decodeBinary(e.binarySubType(),
+                            (const char*) e.binaryData(),
+                            int(e.binarySize()), res, err);
+    case type::k_null: res = QVariant(); return true;
+    case type::k_regex: {
+        BSONregexp re;
+        re.regexp = QString::fromUtf8(e.regexPattern());
+        re.options = QString::fromUtf8(e.regexOptions());
+        res = QVariant::fromValue(re);
+        return true;
+    } break;
+    case type::k_code: {
+        BSONcode code;
+        code.code = stringFromUtf8(e.string(), e.stringSize());
+        res = QVariant::fromValue(code);
+        return true;
+    } break;
+    case type::k_codewscope: {
+        BSONcodeWscope code;
+        const size_t codeSize = size_t(loadInt32(e.value + 4));
+        code.code = stringFromUtf8((const char*) e.value + 8, codeSize - 1);
+        if (!decodeDocument(e.value + 8 + codeSize,
+                            e.valueSize - 8 - codeSize, code.scope, err))
+            return false;
+        res = QVariant::fromValue(code);
+        return true;
+    } break;
+    case type::k_array: {
+        QVariantList list;
+        if (!decodeArrayAs<Map>(e.value, e.valueSize, list, err))
+            return false;
+        res = list;
+        return true;
+    }
+    case type::k_document: {
+        Map map;
+        if (!decodeDocumentAs(e.value, e.valueSize, map, err))
+            return false;
+        res = QVariant::fromValue(map);
+        return true;
+    }
+    case type::k_int32: res = QVariant(e.int32()); return true;
+    case type::k_int64: res = QVariant((qint64) e.int64()); return true;
+    default:
+        break;
+    }
+
+    return setError(err, Error::UnknownType, int(e.type));
+}
+
+bool decodeValue(const Element &e, QVariant &res, Error &err) {
+    return decodeValueAs<QVariantMap>(e, res, err);
+}
+
+QVariant decodeValue(const Element &e) {
+    QVariant res;
+    Error err;
+    if (!decodeValue(e, res, err))
+        throw BSONexception(err.toString());
+    return res;
+}
+
+template <typename Map>
+bool decodeDocumentAs(const uint8_t *data, size_t size, Map &res, Error &err) {
+    ElementReader reader(data, size);
+    Element e;
+    QVariant value;
+    while (reader.next(e)) {
+        if (!decodeValueAs<Map>(e, value, err)) {
+            err.prependPath(stringFromUtf8(e.key, e.keySize));
+            return false;
         }
-        if (v.userType() == qMetaTypeId<BSONcodeWscope>()) {
-            bool f = true;
-            auto & binary = refVariantValue<BSONcodeWscope>(v, f);
-            if (!f)
-                throw BSONexception(QString("Error in %1")
-                                    .arg(v.typeName()));
-
-            return value(b_codewscope{binary.code.toStdString(), toBson(binary.scope)});
+        QBSON_STATS_TYPE(Decode, e.type);
+        insertField(res, KeyCache::local().decode(e.key, e.keySize), value);
+    }
+
+    if (reader.hasError())
+        return setError(err, Error::MalformedDocument, 0);
+
+    return true;
+}
+
+bool decodeDocument(const uint8_t *data, size_t size,
+                    QVariantMap &res, Error &err) {
+    return decodeDocumentAs(data, size, res, err);
+}
+
+bool decodeArray(const uint8_t *data, size_t size,
+                 QVariantList &res, Error &err) {
+    return decodeArrayAs<QVariantMap>(data, size, res, err);
+}
+
+template <typename Map>
+bool decodeArrayAs(const uint8_t *data, size_t size, QVariantList &res, Error &err) {
+    ElementReader reader(data, size);
+    Element e;
+    QVariant value;
+    while (reader.next(e)) {
+        if (!decodeValueAs<Map>(e, value, err)) {
+            err.prependPath(stringFromUtf8(e.key, e.keySize));
+            return false;
         }
-        if (v.userType() == qMetaTypeId<BSONmaxkey>()) {
-            return value(b_maxkey{});
+        QBSON_STATS_TYPE(Decode, e.type);
+        res << value;
+    }
+
+    if (reader.hasError())
+        return setError(err, Error::MalformedArray, 0);
+
+    return true;
+}
+
+///
+/// \brief The Projection struct is a trie of the requested dotted paths
+///
+/// Node 0 is the root. A node marked \a all is the end of a path and its
+/// whole subtree is decoded, otherwise only its children are followed.
+///
+struct Projection {
+    struct Node {
+        bool all = false;
+        QVector<QPair<QByteArray, int> > children;
+    };
+
+    QVector<Node> nodes;
+
+    explicit Projection(const QStringList &paths) : nodes(1) {
+        for (const QString &path : paths) {
+            const QByteArray utf8 = path.toUtf8();
+            int node = 0;
+            int start = 0;
+            while (start <= utf8.size()) {
+                int end = utf8.indexOf('.', start);
+                if (end < 0)
+                    end = utf8.size();
+                node = child(node, utf8.mid(start, end - start));
+                start = end + 1;
+            }
+            nodes[node].all = true;
         }
-        if (v.userType() == qMetaTypeId<BSONminkey>()) {
-            return value(b_minkey{});
+    }
+
+    int child(int node, const QByteArray &name) {
+        const int found = find(node, name.constData(), size_t(name.size()));
+        if (found >= 0)
+            return found;
+        nodes.append(Node());
+        const int res = nodes.size() - 1;
+        nodes[node].children.append(qMakePair(name, res));
+        return res;
+    }
+
+    int find(int node, const char *key, size_t keySize) const {
+        for (const QPair<QByteArray, int> &entry : nodes.at(node).children) {
+            if (size_t(entry.first.size()) == keySize &&
+                    memcmp(entry.first.constData(), key, keySize) == 0)
+                return entry.second;
         }
-        if (v.userType() == qMetaTypeId<BSONoid>()) {
-            bool f = true;
-            const BSONoid & binary = refVariantValue<BSONoid>(v, f);
-            if (!f)
-                throw BSONexception(QString("Error in %1")
-                                    .arg(v.typeName()));
-
-            return value(b_oid{oid(binary.toHex().toStdString())});
+        return -1;
+    }
+};
+
+bool decodeProjected(const Element &e, const Projection &p, int node,
+                     QVariant &res, Error &err);
+
+bool decodeProjectedDocument(const uint8_t *data, size_t size,
+                             const Projection &p, int node,
+                             QVariantMap &res, Error &err) {
+    ElementReader reader(data, size);
+    Element e;
+    QVariant value;
+    while (reader.next(e)) {
+        const int child = p.find(node, e.key, e.keySize);
+        if (child < 0)
+            continue;
+
+        value = QVariant();
+        if (!decodeProjected(e, p, child, value, err)) {
+            err.prependPath(stringFromUtf8(e.key, e.keySize));
+            return false;
         }
-        if (v.userType() == qMetaTypeId<BSONregexp>()) {
-            bool f = true;
-            const BSONregexp & binary = refVariantValue<BSONregexp>(v, f);
-            if (!f)
-                throw BSONexception(QString("Error in %1")
-                                    .arg(v.typeName()));
-
-            return value(b_regex{binary.regexp.toStdString(), binary.regexp.toStdString()});
+        if (value.isValid() || p.nodes.at(child).all)
+            res.insert(KeyCache::local().decode(e.key, e.keySize), value);
+    }
+
+    if (reader.hasError())
+        return setError(err, Error::MalformedDocument, 0);
+
+    return true;
+}
+
+bool decodeProjectedArray(const uint8_t *data, size_t size,
+                          const Projection &p, int node,
+                          QVariantList &res, Error &err) {
+    ElementReader reader(data, size);
+    Element e;
+    QVariant value;
+    while (reader.next(e)) {
+        const int child = p.find(node, e.key, e.keySize);
+        if (child < 0)
+            continue;
+
+        value = QVariant();
+        if (!decodeProjected(e, p, child, value, err)) {
+            err.prependPath(stringFromUtf8(e.key, e.keySize));
+            return false;
         }
+        if (value.isValid() || p.nodes.at(child).all)
+            res << value;
+    }
 
-    } break;
-    default:
-        if (v.canConvert(QVariant::Map))
-            return toBsonValue(v.toMap(), data_lst,
-                               b_docs, b_arrays);
-        if (v.canConvert(QVariant::List))
-            return toBsonValue(v.toList(), data_lst,
-                               b_docs, b_arrays);
-        if (v.canConvert(QVariant::LongLong))
-            return toBsonValue(v.toLongLong(), data_lst,
-                               b_docs, b_arrays);
-        if (v.canConvert(QVariant::Int))
-            return toBsonValue(v.toInt(), data_lst,
-                               b_docs, b_arrays);
-        if (v.canConvert(QVariant::String))
-            return toBsonValue(v.toString(), data_lst,
-                               b_docs, b_arrays);
+    if (reader.hasError())
+        return setError(err, Error::MalformedArray, 0);
+
+    return true;
+}
 
-        return toCustomBSONBinary(v, data_lst);
+///
+/// \brief decodeProjected decodes the part of \a e selected by \a node
+///
+/// \a res stays invalid if no requested path exists below \a e.
+///
+bool decodeProjected(const Element &e, const Projection &p, int node,
+                     QVariant &res, Error &err) {
+    if (p.nodes.at(node).all)
+        return decodeValue(e, res, err);
+
+    if (e.type == bsoncxx::type::k_document) {
+        QVariantMap map;
+        if (!decodeProjectedDocument(e.value, e.valueSize, p, node, map, err))
+            return false;
+        if (!map.isEmpty())
+            res = map;
+        return true;
+    }
 
-        throw BSONexception(QString("Error in unknown type %1")
-                            .arg(v.typeName()));
+    if (e.type == bsoncxx::type::k_array) {
+        QVariantList list;
+        if (!decodeProjectedArray(e.value, e.valueSize, p, node, list, err))
+            return false;
+        if (!list.isEmpty())
+            res = list;
+        return true;
     }
 
-    throw BSONexception(QString("Error in unknown type %1")
-                        .arg(v.typeName()));
+    return true;
 }
 
-QVariant fromBsonValue(const bsoncxx::types::value & value) {
+bool fromBsonValue(const bsoncxx::types::value & value,
+                   QVariant &res, Error &err) {
     using namespace bsoncxx;
     using namespace bsoncxx::types;
     using bsoncxx::type;
-    using bsoncxx::binary_sub_type;
 
     switch (value.type()) {
-    case type::k_double: return value.get_double().value;
+    case type::k_double: res = value.get_double().value; return true;
     case type::k_utf8: {
         const stdx::string_view & view = value.get_utf8().value;
-        QByteArray data(view.data(), view.size());
-        return QString::fromUtf8(data);
-    } break;
-    case type::k_undefined: return QVariant();
-    case type::k_oid: {
-        BSONoid id;
-        const bsoncxx::oid & oid = value.get_oid().value;
-        id.data = QByteArray::fromHex( QString::fromStdString(oid.to_string()).toLatin1() );
-        id.time = QDateTime::fromSecsSinceEpoch((qint64) oid.get_time_t());
-        return QVariant::fromValue(id);
-    } break;
-    case type::k_bool: return value.get_bool().value;
-    case type::k_date: {
-        QDateTime res;
-        res.setMSecsSinceEpoch(value.get_date().value.count());
-        return res;
+        res = stringFromUtf8(view.data(), view.size());
+        return true;
     } break;
+    case type::k_undefined: res = QVariant(); return true;
+    case type::k_oid:
+        res = QVariant::fromValue(
+                    decodeOid((const uint8_t*) value.get_oid().value.bytes()));
+        return true;
+    case type::k_bool: res = value.get_bool().value; return true;
+    case type::k_date:
+        res = QDateTime::fromMSecsSinceEpoch(value.get_date().value.count());
+        return true;
     case type::k_binary: {
         const b_binary & binary = value.get_binary();
-
-        switch (binary.sub_type) {
-        case binary_sub_type::k_uuid : {
-            QByteArray ba((const char*) binary.bytes, binary.size);
-            return QUuid(ba);
-        }
-        case binary_sub_type::k_binary : {
-            return QByteArray((const char*) binary.bytes, binary.size);
-        }
-        case binary_sub_type::k_function : {
-            BSONbinary data;
-            data.type = BSONbinary::Function;
-            data.data = QByteArray((const char*) binary.bytes, binary.size);
-            return QVariant::fromValue(data);
-        }
-        case binary_sub_type::k_md5 : {
-            BSONbinary data;
-            data.type = BSONbinary::MD5;
-            data.data = QByteArray((const char*) binary.bytes, binary.size);
-            return QVariant::fromValue(data);
-        }
-        case binary_sub_type::k_user :
-            return fromCustomBSONBinary(binary);
-        default:
-            break;
-        }
+        return decodeBinary(binary.sub_type,
+                            (const char*) binary.bytes, int(binary.size),
+                            res, err);
     } break;
-    case type::k_null: return QVariant();
+    case type::k_null: res = QVariant(); return true;
     case type::k_regex: {
         BSONregexp re;
-        re.regexp = QString::fromStdString(value.get_regex().regex.to_string());
-        re.options = QString::fromStdString(value.get_regex().options.to_string());
-        return QVariant::fromValue(re);
+        const stdx::string_view & regex = value.get_regex().regex;
+        const stdx::string_view & options = value.get_regex().options;
+        re.regexp = QString::fromUtf8(regex.data(), int(regex.size()));
+        re.options = QString::fromUtf8(options.data(), int(options.size()));
+        res = QVariant::fromValue(re);
+        return true;
     } break;
     case type::k_code: {
         BSONcode code;
-        code.code = QString::fromStdString(value.get_code().code.to_string());
-        return QVariant::fromValue(code);
+        const stdx::string_view & view = value.get_code().code;
+        code.code = stringFromUtf8(view.data(), view.size());
+        res = QVariant::fromValue(code);
+        return true;
     } break;
     case type::k_array: {
-        QVariantList res;
-
-        const b_array & array = value.get_array();
-        for (auto iter = array.value.cbegin();
-             iter != array.value.cend();
-             ++iter) {
-            res << fromBsonValue((*iter).get_value());
-        }
-
-        return res;
+        const array::view & array = value.get_array().value;
+        QVariantList list;
+        if (!decodeArray(array.data(), array.length(), list, err))
+            return false;
+        res = list;
+        return true;
     } break;
     case type::k_document: {
-
-        QVariantMap res;
-
-        const b_document & doc = value.get_document();
-
-        for (auto iter = doc.value.cbegin();
-             iter != doc.value.cend();
-             ++iter) {
-            const bsoncxx::document::element & element = (*iter);
-            res.insert(
-                        QString::fromStdString(element.key().to_string()),
-                        fromBsonValue(element.get_value()));
-        }
-        return res;
+        const document::view & doc = value.get_document().value;
+        QVariantMap map;
+        if (!decodeDocument(doc.data(), doc.length(), map, err))
+            return false;
+        res = map;
+        return true;
     } break;
     case type::k_int32:
-        return QVariant(value.get_int32().value);
+        res = QVariant(value.get_int32().value);
+        return true;
     case type::k_int64:
-        return QVariant((qint64) value.get_int64().value);
+        res = QVariant((qint64) value.get_int64().value);
+        return true;
     default:
-        throw BSONexception(QString("Error in unknown type %1")
-                            .arg((int) value.type()));
+        break;
     }
-    throw BSONexception(QString("Error in unknown type %1")
-                        .arg((int) value.type()));
+    return setError(err, Error::UnknownType, int(value.type()));
 }
 
+///
+/// \brief initTypes registers the BSON metatypes exactly once
+///
+/// Safe to call from any number of threads: the first caller registers,
+/// concurrent callers yield until registration is published.
+///
 void initTypes() {
     static QAtomicInt inited = 0;
 
@@ -469,101 +1104,302 @@ void initTypes() {
         QMetaType::registerDebugStreamOperator<BSONminkey>();
         qRegisterMetaTypeStreamOperators<BSONminkey>();
 
-        inited = 2;
-    } else while (inited == 1);
-}
-}
+        qRegisterMetaType<Document>("BSON::Document");
+        QMetaType::registerEqualsComparator<Document>();
+        QMetaType::registerDebugStreamOperator<Document>();
 
-bsoncxx::document::value toBson(const QVariantMap & obj, bool &ok)
-noexcept
-{
-    using namespace bsoncxx;
-    try {
-        return toBson(obj);
-    } catch (BSONexception & e) {
-        Q_UNUSED(e)
-        ok = false;
-        return document::value(builder::basic::document{});
-    } catch (...) {
-        ok = false;
-        qDebug() << "BSON::fromBson unknown exception";
-        return document::value(builder::basic::document{});
+        initConverters();
+
+        inited.storeRelease(2);
+    } else while (inited.loadAcquire() == 1) {
+        QThread::yieldCurrentThread();
     }
 }
+}
 
-bsoncxx::document::value toBson(const QVariantMap & obj)
+void Error::prependPath(const QString &key)
 {
-    using namespace bsoncxx;
-    using bsoncxx::builder::basic::kvp;
-    using namespace _private;
-    auto doc = builder::basic::document{};
-
-    initTypes();
-
-    QList<QByteArray> data_lst;
-    QList<bsoncxx::document::value> b_docs;
-    QList<bsoncxx::array::value> b_arrays;
-
-    QVariantMap::const_iterator it = obj.begin();
-    while(it != obj.end()) {
-        const std::string name = it.key().toStdString();
-        doc.append(kvp(name, toBsonValue(it.value(), data_lst,
-                                         b_docs, b_arrays)));
-        ++it;
-    }
-    return document::value(doc.view());
+    if (path.isEmpty())
+        path = key;
+    else
+        path = key + QLatin1Char('.') + path;
 }
 
-bsoncxx::array::value toBsonArray(const QVariantList &lst, bool &ok)
+QString Error::toString() const
+{
+    QString res;
+    switch (code) {
+    case NoError:
+        return QString();
+    case UnsupportedValue:
+        res = QString("Error in unsupported type %1")
+                .arg(QMetaType::typeName(type));
+        break;
+    case InvalidValue:
+        res = QString("Error in invalid %1").arg(QMetaType::typeName(type));
+        break;
+    case UnknownType:
+        res = QString("Error in unknown type %1").arg(type);
+        break;
+    case UnknownBinarySubType:
+        res = QString("Error in unknown binary subtype %1").arg(type);
+        break;
+    case MalformedDocument:
+        res = QStringLiteral("BSON::fromBson malformed document");
+        break;
+    case MalformedArray:
+        res = QStringLiteral("BSON::fromBson malformed array");
+        break;
+    case MalformedBinary:
+        res = QString("Error in malformed binary subtype %1").arg(type);
+        break;
+    case PathConflict:
+        res = QString("Error in path conflicting with type %1").arg(type);
+        break;
+    case InvalidKey:
+        res = QStringLiteral("Error in key with zero character");
+        break;
+    case UnknownException:
+        res = QStringLiteral("BSON unknown exception");
+        break;
+    }
+
+    if (!path.isEmpty())
+        res += QString(" at %1").arg(path);
+    return res;
+}
+
+bsoncxx::document::value toBson(const QVariantMap & obj, bool &ok)
+noexcept
+{
+    Error error;
+    bsoncxx::document::value res = toBson(obj, error);
+    if (error.isError())
+        ok = false;
+    return res;
+}
+
+bsoncxx::document::value toBson(const QVariantMap & obj)
+{
+    Error error;
+    bsoncxx::document::value res = toBson(obj, error);
+    if (error.isError())
+        throw BSONexception(error.toString());
+    return res;
+}
+
+bsoncxx::document::value toBson(const QVariantMap &obj, Error &error)
 noexcept
 {
     using namespace bsoncxx;
+
     try {
-        return toBsonArray(lst);
-    } catch (BSONexception & e) {
-        Q_UNUSED(e)
-        ok = false;
-        return array::value(builder::basic::array{});
+        Writer writer;
+        if (toBson(obj, writer, error)) {
+            const size_t length = writer.size();
+            return document::value(writer.release(), length, &Writer::freeBuffer);
+        }
     } catch (...) {
-        ok = false;
-        qDebug() << "BSON::fromBson unknown exception";
-        return array::value(builder::basic::array{});
+        _private::setError(error, Error::UnknownException, 0);
     }
+    return _private::emptyDocumentValue();
 }
 
-bsoncxx::array::value toBsonArray(const QVariantList &lst)
-noexcept(false)
+void toBson(const QVariantMap &obj, Writer &writer)
+{
+    Error error;
+    if (!toBson(obj, writer, error))
+        throw BSONexception(error.toString());
+}
+
+bool toBson(const QVariantMap &obj, Writer &writer, Error &error)
+noexcept
 {
-    using namespace bsoncxx;
-    using bsoncxx::builder::basic::kvp;
     using namespace _private;
-    auto array = builder::basic::array{};
 
     initTypes();
+    error.clear();
+    QBSON_STATS_TIMER(timer);
 
-    QList<QByteArray> data_lst;
-    QList<bsoncxx::document::value> b_docs;
-    QList<bsoncxx::array::value> b_arrays;
+    const size_t start = writer.size();
+    try {
+        if (appendDocument(writer, obj, error)) {
+            QBSON_STATS_DOCUMENT(Encode, writer.size() - start);
+            QBSON_STATS_LATENCY(timer, Encode);
+            return true;
+        }
+    } catch (...) {
+        setError(error, Error::UnknownException, 0);
+    }
+    QBSON_STATS_ERROR(Encode);
+    writer.truncate(start);
+    return false;
+}
 
-    auto it = lst.begin();
-    while(it != lst.end()) {
-        array.append(toBsonValue(*it, data_lst,
-                                 b_docs, b_arrays));
-        ++it;
+bsoncxx::document::value toBson(const Document &doc)
+{
+    Error error;
+    bsoncxx::document::value res = toBson(doc, error);
+    if (error.isError())
+        throw BSONexception(error.toString());
+    return res;
+}
+
+bsoncxx::document::value toBson(const Document &doc, Error &error)
+noexcept
+{
+    using namespace bsoncxx;
+
+    try {
+        Writer writer;
+        if (toBson(doc, writer, error)) {
+            const size_t length = writer.size();
+            return document::value(writer.release(), length, &Writer::freeBuffer);
+        }
+    } catch (...) {
+        _private::setError(error, Error::UnknownException, 0);
     }
-    return array::value(array.view());
+    return _private::emptyDocumentValue();
 }
 
-QVariantMap fromBson(const bsoncxx::document::value &bson, bool &ok)
+void toBson(const Document &doc, Writer &writer)
+{
+    Error error;
+    if (!toBson(doc, writer, error))
+        throw BSONexception(error.toString());
+}
+
+bool toBson(const Document &doc, Writer &writer, Error &error)
 noexcept
 {
+    using namespace _private;
+
+    initTypes();
+    error.clear();
+    QBSON_STATS_TIMER(timer);
+
+    const size_t start = writer.size();
+    try {
+        if (appendDocument(writer, doc, error)) {
+            QBSON_STATS_DOCUMENT(Encode, writer.size() - start);
+            QBSON_STATS_LATENCY(timer, Encode);
+            return true;
+        }
+    } catch (...) {
+        setError(error, Error::UnknownException, 0);
+    }
+    QBSON_STATS_ERROR(Encode);
+    writer.truncate(start);
+    return false;
+}
+
+void toBsonArray(const QVariantList &lst, Writer &writer)
+{
+    Error error;
+    if (!toBsonArray(lst, writer, error))
+        throw BSONexception(error.toString());
+}
+
+bool toBsonArray(const QVariantList &lst, Writer &writer, Error &error)
+noexcept
+{
+    using namespace _private;
+
+    initTypes();
+    error.clear();
+    QBSON_STATS_TIMER(timer);
+
+    const size_t start = writer.size();
     try {
-        return fromBson(bson.view());
-    } catch (BSONexception & e) {
-        qDebug() << "from BSON error" << e.data();
+        if (appendArray(writer, lst, error)) {
+            QBSON_STATS_DOCUMENT(Encode, writer.size() - start);
+            QBSON_STATS_LATENCY(timer, Encode);
+            return true;
+        }
+    } catch (...) {
+        setError(error, Error::UnknownException, 0);
+    }
+    QBSON_STATS_ERROR(Encode);
+    writer.truncate(start);
+    return false;
+}
+
+bsoncxx::document::view Encoder::encode(const QVariantMap &obj)
+{
+    m_writer.clear();
+    toBson(obj, m_writer);
+    return bsoncxx::document::view(m_writer.data(), m_writer.size());
+}
+
+bsoncxx::array::view Encoder::encodeArray(const QVariantList &lst)
+{
+    m_writer.clear();
+    toBsonArray(lst, m_writer);
+    return bsoncxx::array::view(m_writer.data(), m_writer.size());
+}
+
+size_t Encoder::append(const QVariantMap &obj)
+{
+    const size_t start = m_writer.size();
+    toBson(obj, m_writer);
+    return start;
+}
+
+bsoncxx::document::view Encoder::encode(const Document &doc)
+{
+    m_writer.clear();
+    toBson(doc, m_writer);
+    return bsoncxx::document::view(m_writer.data(), m_writer.size());
+}
+
+size_t Encoder::append(const Document &doc)
+{
+    const size_t start = m_writer.size();
+    toBson(doc, m_writer);
+    return start;
+}
+
+bsoncxx::array::value toBsonArray(const QVariantList &lst, bool &ok)
+noexcept
+{
+    Error error;
+    bsoncxx::array::value res = toBsonArray(lst, error);
+    if (error.isError())
         ok = false;
-        return QVariantMap();
+    return res;
+}
+
+bsoncxx::array::value toBsonArray(const QVariantList &lst)
+noexcept(false)
+{
+    Error error;
+    bsoncxx::array::value res = toBsonArray(lst, error);
+    if (error.isError())
+        throw BSONexception(error.toString());
+    return res;
+}
+
+bsoncxx::array::value toBsonArray(const QVariantList &lst, Error &error)
+noexcept
+{
+    using namespace bsoncxx;
+
+    try {
+        Writer writer;
+        if (toBsonArray(lst, writer, error)) {
+            const size_t length = writer.size();
+            return array::value(writer.release(), length, &Writer::freeBuffer);
+        }
+    } catch (...) {
+        _private::setError(error, Error::UnknownException, 0);
     }
+    return _private::emptyArrayValue();
+}
+
+QVariantMap fromBson(const bsoncxx::document::value &bson, bool &ok)
+noexcept
+{
+    return fromBson(bson.view(), ok);
 }
 
 QVariantMap fromBson(const bsoncxx::document::value &bson)
@@ -574,59 +1410,192 @@ QVariantMap fromBson(const bsoncxx::document::value &bson)
 QVariantMap fromBson(const bsoncxx::document::view & bson, bool &ok)
 noexcept
 {
-    try {
-        return fromBson(bson);
-    } catch (BSONexception &e) {
-        qDebug() << "from BSON error" << e.data();
-        ok = false;
-        return QVariantMap();
-    }
+    return fromBson(bson.data(), bson.length(), ok);
 }
 
 QVariantMap fromBson(const bsoncxx::document::view &bson)
 {
-    QVariantMap obj;
+    return fromBson(bson.data(), bson.length());
+}
 
-    for (auto iter = bson.cbegin();
-         iter != bson.cend();
-         ++iter) {
+QVariantMap fromBson(const bsoncxx::document::view &bson, Error &error)
+noexcept
+{
+    return fromBson(bson.data(), bson.length(), error);
+}
 
-        const bsoncxx::document::element & elem = (*iter);
+QVariantMap fromBson(const uint8_t *data, size_t length, bool &ok)
+noexcept
+{
+    Error error;
+    QVariantMap res = fromBson(data, length, error);
+    if (error.isError())
+        ok = false;
+    return res;
+}
+
+QVariantMap fromBson(const uint8_t *data, size_t length)
+{
+    Error error;
+    QVariantMap res = fromBson(data, length, error);
+    if (error.isError())
+        throw BSONexception(error.toString());
+    return res;
+}
 
-        try {
-            const QString key = QString::fromStdString(elem.key().to_string());
-            const QVariant value =
-                    _private::fromBsonValue(elem.get_value());
-            obj.insert(key, value);
-        } catch (bsoncxx::exception & e) {
-            throw BSONexception(QString::fromStdString(e.code().message()));
-        } catch (...) {
-            throw BSONexception("BSON::fromBson unknown exception");
+QVariantMap fromBson(const uint8_t *data, size_t length, Error &error)
+noexcept
+{
+    using namespace _private;
+
+    initTypes();
+    error.clear();
+    QBSON_STATS_TIMER(timer);
+
+    QVariantMap res;
+    try {
+        if (decodeDocument(data, length, res, error)) {
+            QBSON_STATS_DOCUMENT(Decode, documentSize(data, length));
+            QBSON_STATS_LATENCY(timer, Decode);
+            return res;
         }
+    } catch (...) {
+        setError(error, Error::UnknownException, 0);
     }
+    QBSON_STATS_ERROR(Decode);
+    return QVariantMap();
+}
 
-    return obj;
+Document fromBsonDocument(const uint8_t *data, size_t length)
+{
+    Error error;
+    Document res = fromBsonDocument(data, length, error);
+    if (error.isError())
+        throw BSONexception(error.toString());
+    return res;
 }
 
-QVariant fromBsonValue(const bsoncxx::types::value &value, bool & ok)
+Document fromBsonDocument(const uint8_t *data, size_t length, Error &error)
 noexcept
 {
-    ok = true;
+    using namespace _private;
+
+    initTypes();
+    error.clear();
+    QBSON_STATS_TIMER(timer);
+
+    Document res;
     try {
-        return _private::fromBsonValue(value);
-    } catch (BSONexception &) {
-        ok = false;
-        return QVariant();
+        if (decodeDocumentAs(data, length, res, error)) {
+            QBSON_STATS_DOCUMENT(Decode, documentSize(data, length));
+            QBSON_STATS_LATENCY(timer, Decode);
+            return res;
+        }
     } catch (...) {
-        qDebug() << "BSON::fromBsonValue unknown exception";
+        setError(error, Error::UnknownException, 0);
+    }
+    QBSON_STATS_ERROR(Decode);
+    return Document();
+}
+
+Document fromBsonDocument(const bsoncxx::document::view &bson)
+{
+    return fromBsonDocument(bson.data(), bson.length());
+}
+
+Document fromBsonDocument(const bsoncxx::document::view &bson, Error &error)
+noexcept
+{
+    return fromBsonDocument(bson.data(), bson.length(), error);
+}
+
+QVariantMap fromBson(const bsoncxx::document::view &bson,
+                     const QStringList &projection, bool &ok)
+noexcept
+{
+    Error error;
+    QVariantMap res = fromBson(bson, projection, error);
+    if (error.isError())
         ok = false;
-        return QVariant();
+    return res;
+}
+
+QVariantMap fromBson(const bsoncxx::document::view &bson,
+                     const QStringList &projection)
+{
+    Error error;
+    QVariantMap res = fromBson(bson, projection, error);
+    if (error.isError())
+        throw BSONexception(error.toString());
+    return res;
+}
+
+QVariantMap fromBson(const bsoncxx::document::view &bson,
+                     const QStringList &projection, Error &error)
+noexcept
+{
+    using namespace _private;
+
+    initTypes();
+    error.clear();
+
+    QBSON_STATS_TIMER(timer);
+
+    QVariantMap res;
+    try {
+        const Projection p(projection);
+        if (decodeProjectedDocument(bson.data(), bson.length(), p, 0,
+                                    res, error)) {
+            QBSON_STATS_DOCUMENT(Decode, bson.length());
+            QBSON_STATS_LATENCY(timer, Decode);
+            return res;
+        }
+    } catch (...) {
+        setError(error, Error::UnknownException, 0);
     }
+    QBSON_STATS_ERROR(Decode);
+    return QVariantMap();
+}
+
+QVariant fromBsonValue(const bsoncxx::types::value &value, bool & ok)
+noexcept
+{
+    ok = true;
+    Error error;
+    QVariant res = fromBsonValue(value, error);
+    if (error.isError())
+        ok = false;
+    return res;
 }
 
 QVariant fromBsonValue(const bsoncxx::types::value &value)
 {
-    return _private::fromBsonValue(value);
+    Error error;
+    QVariant res = fromBsonValue(value, error);
+    if (error.isError())
+        throw BSONexception(error.toString());
+    return res;
+}
+
+QVariant fromBsonValue(const bsoncxx::types::value &value, Error &error)
+noexcept
+{
+    using namespace _private;
+
+    initTypes();
+    error.clear();
+
+    QVariant res;
+    try {
+        if (_private::fromBsonValue(value, res, error)) {
+            QBSON_STATS_TYPE(Decode, value.type());
+            return res;
+        }
+    } catch (...) {
+        setError(error, Error::UnknownException, 0);
+    }
+    QBSON_STATS_ERROR(Decode);
+    return QVariant();
 }
 
 void init()
@@ -634,6 +1603,47 @@ void init()
     _private::initTypes();
 }
 
+void setKeyCacheCapacity(int capacity)
+{
+    _private::keyCacheCapacity.storeRelease(qMax(0, capacity));
+}
+
+int keyCacheCapacity()
+{
+    return _private::keyCacheCapacity.loadAcquire();
+}
+
+KeyCacheStats keyCacheStats()
+{
+    using namespace _private;
+    KeyCacheRegistry &registry = KeyCacheRegistry::instance();
+    QMutexLocker locker(&registry.mutex);
+
+    KeyCacheStats res = registry.retired;
+    for (KeyCache *cache : registry.caches) {
+        res.decodeHits += cache->decodeHits.loadAcquire();
+        res.decodeMisses += cache->decodeMisses.loadAcquire();
+        res.encodeHits += cache->encodeHits.loadAcquire();
+        res.encodeMisses += cache->encodeMisses.loadAcquire();
+    }
+    return res;
+}
+
+void resetKeyCacheStats()
+{
+    using namespace _private;
+    KeyCacheRegistry &registry = KeyCacheRegistry::instance();
+    QMutexLocker locker(&registry.mutex);
+
+    registry.retired = KeyCacheStats();
+    for (KeyCache *cache : registry.caches) {
+        cache->decodeHits.fetchAndStoreRelaxed(0);
+        cache->decodeMisses.fetchAndStoreRelaxed(0);
+        cache->encodeHits.fetchAndStoreRelaxed(0);
+        cache->encodeMisses.fetchAndStoreRelaxed(0);
+    }
+}
+
 QVariant id(const QString &id)
 {
     return QVariant::fromValue(BSONoid(id));
@@ -641,6 +1651,194 @@ QVariant id(const QString &id)
 
 }
 
+BSONDocumentView::const_iterator::const_iterator(const uint8_t *data,
+                                                 size_t length)
+    : m_reader(data, length), m_element(), m_end(length == 0)
+{
+    ++(*this);
+}
+
+QString BSONDocumentView::const_iterator::key() const
+{
+    return BSON::stringFromUtf8(m_element.key, m_element.keySize);
+}
+
+QVariant BSONDocumentView::const_iterator::value() const
+{
+    BSON::_private::initTypes();
+    return BSON::_private::decodeValue(m_element);
+}
+
+BSONDocumentView BSONDocumentView::const_iterator::view() const
+{
+    if (m_element.type != bsoncxx::type::k_document &&
+            m_element.type != bsoncxx::type::k_array)
+        return BSONDocumentView();
+
+    return BSONDocumentView(m_element.value, m_element.valueSize);
+}
+
+BSONDocumentView::const_iterator &BSONDocumentView::const_iterator::operator++()
+{
+    if (!m_end && !m_reader.next(m_element)) {
+        m_end = true;
+        if (m_reader.hasError())
+            throw BSONexception("BSONDocumentView malformed document");
+    }
+    return *this;
+}
+
+bool BSONDocumentView::const_iterator::operator==(const const_iterator &other) const
+{
+    if (m_end || other.m_end)
+        return m_end == other.m_end;
+
+    return m_element.key == other.m_element.key;
+}
+
+BSONDocumentView::BSONDocumentView(const uint8_t *data, size_t length)
+    : m_data(data), m_length(BSON::documentSize(data, length))
+{
+}
+
+BSONDocumentView::BSONDocumentView(const bsoncxx::document::view &view)
+    : BSONDocumentView(view.data(), view.length())
+{
+}
+
+bsoncxx::document::view BSONDocumentView::bsonView() const
+{
+    if (!m_length)
+        return bsoncxx::document::view();
+
+    return bsoncxx::document::view(m_data, m_length);
+}
+
+void BSONDocumentView::setIndexing(bool enabled)
+{
+    if (!enabled)
+        m_index.reset();
+    else if (m_index.isNull())
+        m_index = QSharedPointer<Index>::create();
+}
+
+bool BSONDocumentView::find(const char *key, size_t keySize,
+                            BSON::Element &e) const
+{
+    if (!m_length)
+        return false;
+
+    BSON::ElementReader reader(m_data, m_length);
+
+    if (m_index) {
+        if (!m_index->built) {
+            size_t offset = reader.offset();
+            while (reader.next(e)) {
+                const QByteArray name =
+                        QByteArray::fromRawData(e.key, int(e.keySize));
+                if (!m_index->offsets.contains(name))
+                    m_index->offsets.insert(name, offset);
+                offset = reader.offset();
+            }
+            if (reader.hasError())
+                throw BSONexception("BSONDocumentView malformed document");
+            m_index->built = true;
+        }
+
+        auto it = m_index->offsets.constFind(
+                    QByteArray::fromRawData(key, int(keySize)));
+        if (it == m_index->offsets.constEnd())
+            return false;
+
+        reader.seek(it.value());
+        return reader.next(e);
+    }
+
+    while (reader.next(e)) {
+        if (e.keyEquals(key, keySize))
+            return true;
+    }
+
+    if (reader.hasError())
+        throw BSONexception("BSONDocumentView malformed document");
+
+    return false;
+}
+
+bool BSONDocumentView::contains(const QString &key) const
+{
+    const QByteArray name = key.toUtf8();
+    BSON::Element e;
+    return find(name.constData(), size_t(name.size()), e);
+}
+
+bool BSONDocumentView::contains(const char *key) const
+{
+    BSON::Element e;
+    return find(key, strlen(key), e);
+}
+
+QVariant BSONDocumentView::value(const QString &key,
+                                 const QVariant &defaultValue) const
+{
+    const QByteArray name = key.toUtf8();
+    return value(name.constData(), defaultValue);
+}
+
+QVariant BSONDocumentView::value(const char *key,
+                                 const QVariant &defaultValue) const
+{
+    BSON::Element e;
+    if (!find(key, strlen(key), e))
+        return defaultValue;
+
+    BSON::_private::initTypes();
+    return BSON::_private::decodeValue(e);
+}
+
+BSONDocumentView BSONDocumentView::view(const QString &key) const
+{
+    const QByteArray name = key.toUtf8();
+    return view(name.constData());
+}
+
+BSONDocumentView BSONDocumentView::view(const char *key) const
+{
+    BSON::Element e;
+    if (!find(key, strlen(key), e))
+        return BSONDocumentView();
+
+    if (e.type != bsoncxx::type::k_document &&
+            e.type != bsoncxx::type::k_array)
+        return BSONDocumentView();
+
+    return BSONDocumentView(e.value, e.valueSize);
+}
+
+int BSONDocumentView::count() const
+{
+    int res = 0;
+    for (auto it = begin(); it != end(); ++it)
+        ++res;
+    return res;
+}
+
+QStringList BSONDocumentView::keys() const
+{
+    QStringList res;
+    for (auto it = begin(); it != end(); ++it)
+        res << it.key();
+    return res;
+}
+
+QVariantMap BSONDocumentView::toMap() const
+{
+    if (!m_length)
+        return QVariantMap();
+
+    return BSON::fromBson(m_data, m_length);
+}
+
 bool operator==(const BSONbinary &rhs, const BSONbinary &lhs) {
     return lhs.type == rhs.type &&
             lhs.data == rhs.data;
@@ -688,28 +1886,29 @@ QDataStream &operator>>(QDataStream &in, BSONbinary &value)
     return in;
 }
 
-bool operator==(const BSONoid &lhs, const BSONoid &rhs) {
-    return lhs.data == rhs.data;
-}
-
 QDebug operator<<(QDebug debug, const BSONoid &c)
 {
     QDebugStateSaver saver(debug);
     Q_UNUSED(saver)
-    debug.nospace() << "BSONoid(" << c.toHex() << ", " << c.time.toString(Qt::ISODate) << ")";
+    debug.nospace() << "BSONoid(" << c.toHex() << ", " << c.time().toString(Qt::ISODate) << ")";
     return debug;
 }
 
 QDataStream &operator<<(QDataStream &out, const BSONoid &value)
 {
-    out << value.data << value.time;
+    // same layout as the former QByteArray and QDateTime members
+    out << value.toByteArray() << value.time();
     return out;
 }
 
 QDataStream &operator>>(QDataStream &in, BSONoid &value)
 {
-    in >> value.data;
-    in >> value.time;
+    QByteArray data;
+    QDateTime time;
+    in >> data;
+    in >> time;
+    value = data.size() == 12 ? BSONoid::fromBytes(data.constData())
+                              : BSONoid();
     return in;
 }
 
@@ -4,11 +4,25 @@
 #include <QtDebug>
 #include <QVariant>
 #include <QDateTime>
+#include <QtEndian>
 #include <QException>
+#include <QHash>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QVector>
+
+#include <vector>
 
 #include <bsoncxx/document/value.hpp>
 #include <bsoncxx/array/value.hpp>
 
+#include "qbson_document.h"
+#include "qbson_reader.h"
+#include "qbson_utf8.h"
+#include "qbson_writer.h"
+
+class QThreadPool;
+
 class BSONexception : public QException {
 
 public:
@@ -25,6 +39,60 @@ private:
 
 namespace BSON {
 
+///
+/// \brief The Error struct describes why a conversion failed
+///
+/// The conversion core reports failures through this struct instead of
+/// throwing, so a rejected document costs no more than an accepted one.
+/// The message is only formatted by toString(). The throwing overloads
+/// raise BSONexception(error.toString()), the bool ok overloads drop it.
+///
+struct Error
+{
+    enum Code {
+        NoError = 0,
+        /// QVariant that can not be encoded, type is its user type
+        UnsupportedValue,
+        /// value like a null BSONoid or a binary payload rejected by a
+        /// registered converter, type is its user type
+        InvalidValue,
+        /// unknown BSON element type, type is the type byte
+        UnknownType,
+        /// unknown BSON binary subtype, type is the subtype byte
+        UnknownBinarySubType,
+        MalformedDocument,
+        MalformedArray,
+        /// binary payload that does not decode, type is the subtype byte
+        MalformedBinary,
+        /// dotted path crossing a value that is no document or array, or
+        /// incrementing a non-number, type is the BSON type byte found
+        PathConflict,
+        /// document key containing U+0000, which ends a BSON key early
+        InvalidKey,
+        /// exception thrown by Qt or the allocator
+        UnknownException
+    };
+
+    Code code = NoError;
+    /// type of the failing value, see Code
+    int type = 0;
+    /// dotted path of the failing field, e.g. "items.3.price", empty for the top level
+    QString path;
+
+    bool isError() const { return code != NoError; }
+    void clear() { code = NoError; type = 0; path.clear(); }
+
+    ///
+    /// \brief prependPath adds the name of an enclosing field to path
+    ///
+    void prependPath(const QString &key);
+
+    ///
+    /// \brief toString formats the error like the messages of BSONexception
+    ///
+    QString toString() const;
+};
+
 ///
 /// \brief toBson
 /// \param obj
@@ -35,6 +103,39 @@ namespace BSON {
 bsoncxx::document::value toBson(const QVariantMap &obj, bool &ok) noexcept;
 bsoncxx::document::value toBson(const QVariantMap &obj) noexcept(false);
 
+///
+/// \brief toBson
+/// \param error receives the reason on not success
+/// \return BSON document, empty on not success
+///
+bsoncxx::document::value toBson(const QVariantMap &obj, Error &error) noexcept;
+
+///
+/// \brief toBson appends the encoded document to \a writer
+/// \throw BSONexception on unsupported value, \a writer is left unchanged
+///
+void toBson(const QVariantMap &obj, Writer &writer) noexcept(false);
+
+///
+/// \brief toBson appends the encoded document to \a writer
+/// \param error receives the reason on not success, \a writer is left unchanged
+/// \return false on not success
+///
+bool toBson(const QVariantMap &obj, Writer &writer, Error &error) noexcept;
+
+///
+/// \brief toBson encodes \a doc with its fields in their order
+///
+/// Nested Document values keep their order as well, QVariantMap values
+/// are written sorted by key.
+///
+/// \throw BSONexception on unsupported value without Error argument
+///
+bsoncxx::document::value toBson(const Document &doc) noexcept(false);
+bsoncxx::document::value toBson(const Document &doc, Error &error) noexcept;
+void toBson(const Document &doc, Writer &writer) noexcept(false);
+bool toBson(const Document &doc, Writer &writer, Error &error) noexcept;
+
 ///
 /// \brief toBsonArray
 /// \param lst
@@ -44,6 +145,58 @@ bsoncxx::document::value toBson(const QVariantMap &obj) noexcept(false);
 ///
 bsoncxx::array::value toBsonArray(const QVariantList &lst, bool &ok) noexcept;
 bsoncxx::array::value toBsonArray(const QVariantList &lst) noexcept(false);
+bsoncxx::array::value toBsonArray(const QVariantList &lst, Error &error) noexcept;
+
+///
+/// \brief toBsonArray appends the encoded array to \a writer
+/// \throw BSONexception on unsupported value, \a writer is left unchanged
+///
+void toBsonArray(const QVariantList &lst, Writer &writer) noexcept(false);
+bool toBsonArray(const QVariantList &lst, Writer &writer, Error &error) noexcept;
+
+///
+/// \brief The Encoder class is a reusable encoding context for hot loops
+///
+/// The encoder keeps its output buffer between calls, reset() drops the
+/// content but keeps the capacity. Once the buffer has grown to the
+/// largest document, encoding the standard types does not allocate: keys
+/// and strings are transcoded from UTF-16 straight into the buffer and
+/// the QDataStream fallback reuses a per thread scratch buffer. Values
+/// that go through the canConvert chain still allocate their converted
+/// temporary.
+///
+class Encoder
+{
+public:
+    explicit Encoder(size_t capacity = 0) { m_writer.reserve(capacity); }
+
+    ///
+    /// \brief encode resets the encoder and encodes \a obj
+    /// \throw BSONexception on unsupported value
+    /// \return view valid until the next call or reset()
+    ///
+    bsoncxx::document::view encode(const QVariantMap &obj) noexcept(false);
+    bsoncxx::array::view encodeArray(const QVariantList &lst) noexcept(false);
+
+    ///
+    /// \brief append encodes \a obj behind the documents already buffered
+    /// \throw BSONexception on unsupported value, the buffer is left unchanged
+    /// \return offset of the document in writer()
+    ///
+    size_t append(const QVariantMap &obj) noexcept(false);
+
+    bsoncxx::document::view encode(const Document &doc) noexcept(false);
+    size_t append(const Document &doc) noexcept(false);
+
+    void reset() { m_writer.clear(); }
+
+    Writer &writer() { return m_writer; }
+    const Writer &writer() const { return m_writer; }
+    size_t capacity() const { return m_writer.capacity(); }
+
+private:
+    Writer m_writer;
+};
 
 ///
 /// \brief fromBson
@@ -57,6 +210,61 @@ QVariantMap fromBson(const bsoncxx::document::value &bson) noexcept(false);
 QVariantMap fromBson(const bsoncxx::document::view &bson, bool &ok) noexcept;
 QVariantMap fromBson(const bsoncxx::document::view &bson) noexcept(false);
 
+///
+/// \brief fromBson
+/// \param error receives the reason and field path on not success
+/// \return QVariantMap value, empty on not success
+///
+QVariantMap fromBson(const bsoncxx::document::view &bson, Error &error) noexcept;
+
+///
+/// \brief fromBson decodes a raw BSON document straight from the wire format
+/// \param data document bytes, starting with the int32 length prefix
+/// \param length bytes readable at data, the document is bounds checked
+/// \param ok indicator false on not success, not success will not change
+/// \throw BSONexception on malformed document without bool ok argument
+/// \return QVariantMap value
+///
+QVariantMap fromBson(const uint8_t *data, size_t length, bool &ok) noexcept;
+QVariantMap fromBson(const uint8_t *data, size_t length) noexcept(false);
+QVariantMap fromBson(const uint8_t *data, size_t length, Error &error) noexcept;
+
+///
+/// \brief fromBsonDocument decodes into a Document in wire order
+///
+/// Embedded documents become Document values, also inside arrays. The
+/// scope of a BSONcodeWscope stays a QVariantMap.
+///
+/// \param data document bytes, starting with the int32 length prefix
+/// \param length bytes readable at data, the document is bounds checked
+/// \throw BSONexception on malformed document without Error argument
+///
+Document fromBsonDocument(const uint8_t *data, size_t length) noexcept(false);
+Document fromBsonDocument(const uint8_t *data, size_t length, Error &error) noexcept;
+Document fromBsonDocument(const bsoncxx::document::view &bson) noexcept(false);
+Document fromBsonDocument(const bsoncxx::document::view &bson, Error &error) noexcept;
+
+///
+/// \brief fromBson decodes only the fields on the requested dotted paths
+///
+/// Subdocuments and arrays no path passes through are skipped by their
+/// length prefix without being decoded. Array elements are selected by
+/// index ("items.0.price"), the decoded list keeps only the selected
+/// elements in their original order.
+///
+/// \param bson
+/// \param projection dotted paths like "a.b.c", a path selects its whole subtree
+/// \param ok indicator false on not success, not success will not change
+/// \throw BSONexception on malformed document without bool ok argument
+/// \return pruned QVariantMap value
+///
+QVariantMap fromBson(const bsoncxx::document::view &bson,
+                     const QStringList &projection, bool &ok) noexcept;
+QVariantMap fromBson(const bsoncxx::document::view &bson,
+                     const QStringList &projection) noexcept(false);
+QVariantMap fromBson(const bsoncxx::document::view &bson,
+                     const QStringList &projection, Error &error) noexcept;
+
 ///
 /// \brief fromBsonValue
 /// \param value
@@ -66,13 +274,345 @@ QVariantMap fromBson(const bsoncxx::document::view &bson) noexcept(false);
 ///
 QVariant fromBsonValue(const bsoncxx::types::value & value, bool &ok) noexcept;
 QVariant fromBsonValue(const bsoncxx::types::value & value) noexcept(false);
+QVariant fromBsonValue(const bsoncxx::types::value & value, Error &error) noexcept;
 
 QVariant id(const QString & id);
 
+///
+/// \brief init registers the BSON metatypes, called implicitly by conversions
+///
+/// All conversion functions are reentrant: they keep their state on the
+/// stack or in thread-local storage and may run concurrently on different
+/// inputs. init() is safe to race, the key cache counters are atomic.
+///
 void init();
 
+///
+/// \brief The BatchOptions struct configures the parallel batch conversions
+///
+struct BatchOptions
+{
+    /// worker threads including the caller, 0 uses maxThreadCount() of the pool
+    int threads = 0;
+    /// documents per work item, 0 picks about four items per thread
+    int chunkSize = 0;
+    /// pool to run on, nullptr uses QThreadPool::globalInstance()
+    QThreadPool *pool = nullptr;
+    /// toBsonBatch: larger encoded documents are reported as errors
+    int maxDocumentSize = 16 * 1024 * 1024;
+    /// toBsonBatch: byte limit of one output buffer, larger documents are
+    /// reported as errors
+    int maxBatchSize = 48 * 1024 * 1024;
+};
+
+///
+/// \brief The EncodedBatch struct holds encoded documents back to back
+///
+struct EncodedBatch
+{
+    /// concatenated documents
+    QByteArray data;
+    /// start of each document in data
+    QVector<int> offsets;
+    /// position of each document in the input of toBsonBatch
+    QVector<int> indexes;
+
+    ///
+    /// \brief views of the documents, valid as long as data is not modified
+    ///
+    std::vector<bsoncxx::document::view> views() const;
+};
+
+///
+/// \brief fromBsonBatch decodes documents in parallel on a thread pool
+///
+/// The calling thread takes part in the work. A malformed document does not
+/// fail the batch, it decodes to an empty map and reports its error.
+///
+/// \param docs
+/// \param options
+/// \param errors if not nullptr receives one entry per document, null on success
+/// \return decoded documents in input order
+///
+QVector<QVariantMap> fromBsonBatch(const std::vector<bsoncxx::document::view> &docs,
+                                   const BatchOptions &options = BatchOptions(),
+                                   QVector<QString> *errors = nullptr);
+
+///
+/// \brief toBsonBatch encodes documents in parallel into size limited buffers
+///
+/// Documents are encoded on a thread pool and concatenated in input order
+/// into buffers of at most options.maxBatchSize bytes, ready to be handed
+/// to the driver as views. A document that fails to encode or exceeds
+/// options.maxDocumentSize or options.maxBatchSize is left out and reports
+/// its error. Documents
+/// lost to an exception in a worker, e.g. out of memory, are left out and
+/// report Error::UnknownException.
+///
+/// \param docs
+/// \param options
+/// \param errors if not nullptr receives one entry per document, null on success
+/// \return batches in input order
+///
+QVector<EncodedBatch> toBsonBatch(const QVector<QVariantMap> &docs,
+                                  const BatchOptions &options = BatchOptions(),
+                                  QVector<QString> *errors = nullptr);
+
+///
+/// \brief The KeyCacheStats struct counts key interning lookups
+///
+struct KeyCacheStats
+{
+    quint64 decodeHits = 0;
+    quint64 decodeMisses = 0;
+    quint64 encodeHits = 0;
+    quint64 encodeMisses = 0;
+};
+
+///
+/// \brief setKeyCacheCapacity enables interning of document keys
+///
+/// With interning enabled every thread keeps a table of up to \a capacity
+/// keys per direction. Decoding reuses one implicitly shared QString per
+/// distinct key and encoding reuses its UTF-8 bytes. A full table is
+/// dropped and refilled.
+///
+/// \param capacity keys per thread and direction, 0 (default) disables interning
+///
+void setKeyCacheCapacity(int capacity);
+int keyCacheCapacity();
+
+///
+/// \brief keyCacheStats sums the lookup counters of all threads
+///
+KeyCacheStats keyCacheStats();
+void resetKeyCacheStats();
+
+///
+/// \brief The Stats struct sums the conversion counters of all threads
+///
+/// Counting is compiled in with DEFINES += QBSON_STATS. Without it the
+/// counters compile to nothing and stats() returns enabled false. The
+/// QVariant conversions of this header are counted, each thread writes
+/// its own counters.
+///
+struct Stats
+{
+    bool enabled = false;
+    quint64 documentsEncoded = 0;
+    quint64 documentsDecoded = 0;
+    quint64 bytesEncoded = 0;
+    quint64 bytesDecoded = 0;
+    quint64 encodeErrors = 0;
+    quint64 decodeErrors = 0;
+    /// elements per BSON type byte
+    QMap<int, quint64> typesEncoded;
+    QMap<int, quint64> typesDecoded;
+    /// values per metatype name written through the QDataStream fallback
+    QMap<QByteArray, quint64> dataStreamFallbacks;
+    /// values per metatype name converted by the canConvert chain
+    QMap<QByteArray, quint64> canConvertFallbacks;
+    /// documents per latency bucket, bucket i counts [2^i, 2^(i+1)) ns,
+    /// only filled after setStatsLatency(true)
+    QVector<quint64> encodeLatency;
+    QVector<quint64> decodeLatency;
+};
+
+///
+/// \brief stats sums the counters of all threads since the last resetStats()
+///
+Stats stats();
+void resetStats();
+
+///
+/// \brief setStatsLatency enables the latency histograms, off by default
+///
+/// Timing costs two clock reads per document.
+///
+void setStatsLatency(bool enabled);
+
+namespace _private {
+
+typedef void (*AnyFunction)();
+typedef void (*EncodeThunk)(AnyFunction encode, const void *value, Writer &out);
+typedef bool (*DecodeThunk)(AnyFunction decode, const std::uint8_t *data,
+                            size_t size, QVariant &res);
+
+bool registerConverter(int metaType, bsoncxx::binary_sub_type subType,
+                       AnyFunction encode, EncodeThunk encodeThunk,
+                       AnyFunction decode, DecodeThunk decodeThunk);
+
+template <typename T>
+void encodeThunk(AnyFunction encode, const void *value, Writer &out) {
+    ((void (*)(const T &, Writer &)) encode)(*(const T*) value, out);
+}
+
+template <typename T>
+bool decodeThunk(AnyFunction decode, const std::uint8_t *data,
+                 size_t size, QVariant &res) {
+    T value;
+    if (!((bool (*)(const std::uint8_t *, size_t, T &)) decode)(data, size, value))
+        return false;
+    res = QVariant::fromValue(value);
+    return true;
 }
 
+}
+
+///
+/// \brief registerConverter encodes values of type T as binary of \a subType
+///
+/// \a encode appends the payload bytes of a value to \a out, the binary
+/// length and subtype are written around it. \a decode rebuilds the value
+/// from the payload of a binary of \a subType and returns false on a
+/// malformed payload, which is reported as Error::InvalidValue.
+///
+/// Lookup is one index into a table by metatype id. Registration copies
+/// the table, register at startup. A later registration of the same type
+/// replaces the converter. Types with a native BSON mapping (QString,
+/// int, QVariantMap, ...) and the BSON metatypes can not be overridden.
+///
+/// \param subType user defined subtype 0x81 to 0xff, unique per type,
+/// 0x80 is kept by the QDataStream fallback
+/// \return false if the type or \a subType can not be registered
+///
+template <typename T>
+bool registerConverter(void (*encode)(const T &value, Writer &out),
+                       bool (*decode)(const std::uint8_t *data, size_t size, T &value),
+                       bsoncxx::binary_sub_type subType) {
+    return _private::registerConverter(qRegisterMetaType<T>(), subType,
+                                       (_private::AnyFunction) encode,
+                                       &_private::encodeThunk<T>,
+                                       (_private::AnyFunction) decode,
+                                       &_private::decodeThunk<T>);
+}
+
+///
+/// \brief stringFromUtf8 decodes BSON string bytes straight into QString storage
+///
+/// Ill-formed sequences become U+FFFD.
+///
+inline QString stringFromUtf8(const char *data, size_t size) {
+    QString res(int(size), Qt::Uninitialized);
+    res.resize(int(utf8ToUtf16(data, size, (std::uint16_t*) res.data())));
+    return res;
+}
+
+}
+
+///
+/// \brief The BSONDocumentView class gives read-only access to a raw BSON
+/// document and decodes a field only when it is accessed
+///
+/// The view does not own the bytes, they must outlive it and its copies.
+/// With indexing enabled the first lookup scans the document once and
+/// memoizes a key to offset index that later lookups reuse; copies of
+/// the view share that index. A view is not safe for concurrent lookups
+/// while its index is being built.
+///
+class BSONDocumentView
+{
+public:
+    class const_iterator
+    {
+    public:
+        const_iterator() : m_reader(nullptr, 0), m_element(), m_end(true) {}
+
+        QString key() const;
+        QVariant value() const;
+        bsoncxx::type type() const { return m_element.type; }
+        const BSON::Element &element() const { return m_element; }
+
+        ///
+        /// \brief view of an embedded document or array element
+        /// \return invalid view for other element types
+        ///
+        BSONDocumentView view() const;
+
+        const_iterator &operator++();
+        bool operator==(const const_iterator &other) const;
+        bool operator!=(const const_iterator &other) const {
+            return !(*this == other);
+        }
+
+    private:
+        friend class BSONDocumentView;
+        const_iterator(const uint8_t *data, size_t length);
+
+        BSON::ElementReader m_reader;
+        BSON::Element m_element;
+        bool m_end;
+    };
+
+    BSONDocumentView() : m_data(nullptr), m_length(0) {}
+    BSONDocumentView(const uint8_t *data, size_t length);
+    BSONDocumentView(const bsoncxx::document::view &view);
+
+    ///
+    /// \brief isValid
+    /// \return true if the document framing is valid, elements are checked on access
+    ///
+    bool isValid() const { return m_length != 0; }
+    const uint8_t *data() const { return m_data; }
+    size_t length() const { return m_length; }
+    bsoncxx::document::view bsonView() const;
+
+    ///
+    /// \brief setIndexing enables memoizing a key to offset index on first lookup
+    ///
+    void setIndexing(bool enabled);
+    bool isIndexing() const { return !m_index.isNull(); }
+
+    bool contains(const QString &key) const;
+    bool contains(const char *key) const;
+
+    ///
+    /// \brief value decodes a single field
+    /// \throw BSONexception on malformed or unsupported field
+    /// \return decoded value, \a defaultValue if the key is missing
+    ///
+    QVariant value(const QString &key, const QVariant &defaultValue = QVariant()) const;
+    QVariant value(const char *key, const QVariant &defaultValue = QVariant()) const;
+
+    ///
+    /// \brief view of an embedded document or array field without decoding it
+    /// \return invalid view if the key is missing or not a document or array
+    ///
+    BSONDocumentView view(const QString &key) const;
+    BSONDocumentView view(const char *key) const;
+
+    ///
+    /// \brief element looks up the raw element of \a key
+    /// \return false if the key is missing
+    ///
+    bool element(const char *key, size_t keySize, BSON::Element &e) const {
+        return find(key, keySize, e);
+    }
+
+    int count() const;
+    QStringList keys() const;
+
+    ///
+    /// \brief toMap decodes all fields, same as BSON::fromBson
+    ///
+    QVariantMap toMap() const;
+
+    const_iterator begin() const { return const_iterator(m_data, m_length); }
+    const_iterator end() const { return const_iterator(); }
+
+private:
+    struct Index {
+        bool built = false;
+        QHash<QByteArray, size_t> offsets;
+    };
+
+    bool find(const char *key, size_t keySize, BSON::Element &e) const;
+
+    const uint8_t *m_data;
+    size_t m_length;
+    QSharedPointer<Index> m_index;
+};
+
 struct BSONbinary
 {
     enum Type {
@@ -90,31 +630,108 @@ QDebug operator<<(QDebug debug, const BSONbinary &c);
 QDataStream &operator<<(QDataStream &out, const BSONbinary &value);
 QDataStream &operator>>(QDataStream &in, BSONbinary &value);
 
+///
+/// \brief The BSONoid struct holds a 12 byte ObjectId inline
+///
+/// Raw bytes are copied to and from BSON as is, hex is only produced on
+/// request and the timestamp is computed from the first four bytes when
+/// asked for. The all-zero id is the null id, it is not encodable.
+///
 struct BSONoid
 {
-    QByteArray data;
-    QDateTime time;
+    BSONoid() { memset(m_bytes, 0, sizeof(m_bytes)); }
+
+    BSONoid(const QString &hex) {
+        parseHex(hex.constData(), hex.size());
+    }
 
-    BSONoid() {}
+    BSONoid(const QByteArray &hex) {
+        parseHex(hex.constData(), hex.size());
+    }
+
+    ///
+    /// \brief fromBytes
+    /// \param bytes 12 raw ObjectId bytes
+    ///
+    static BSONoid fromBytes(const void *bytes) {
+        BSONoid res;
+        memcpy(res.m_bytes, bytes, sizeof(res.m_bytes));
+        return res;
+    }
 
-    BSONoid(QString hex) {
-        data = QByteArray::fromHex(hex.toLatin1());
+    const uchar *data() const { return m_bytes; }
+    QByteArray toByteArray() const {
+        return QByteArray((const char*) m_bytes, sizeof(m_bytes));
     }
 
-    BSONoid(QByteArray hex) {
-        data = QByteArray::fromHex(hex);
+    bool isNull() const {
+        static const uchar null[12] = {};
+        return memcmp(m_bytes, null, sizeof(m_bytes)) == 0;
     }
 
+    ///
+    /// \brief timestamp
+    /// \return creation time in seconds since epoch, stored in the first four bytes
+    ///
+    quint32 timestamp() const { return qFromBigEndian<quint32>(m_bytes); }
+    QDateTime time() const { return QDateTime::fromSecsSinceEpoch(timestamp()); }
+
     QString toHex() const {
-        return data.toHex();
+        static const char digits[] = "0123456789abcdef";
+        QString res(24, Qt::Uninitialized);
+        QChar *dst = res.data();
+        for (int i = 0; i < 12; ++i) {
+            dst[2 * i] = QLatin1Char(digits[m_bytes[i] >> 4]);
+            dst[2 * i + 1] = QLatin1Char(digits[m_bytes[i] & 0xF]);
+        }
+        return res;
     }
 
     QString toString() const {
         return toHex();
     }
+
+private:
+    static int hexDigit(ushort c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+    static ushort unicode(QChar c) { return c.unicode(); }
+    static ushort unicode(char c) { return uchar(c); }
+
+    template <typename Char>
+    void parseHex(const Char *hex, int size) {
+        memset(m_bytes, 0, sizeof(m_bytes));
+        if (size != 24)
+            return;
+        for (int i = 0; i < 12; ++i) {
+            const int hi = hexDigit(unicode(hex[2 * i]));
+            const int lo = hexDigit(unicode(hex[2 * i + 1]));
+            if (hi < 0 || lo < 0) {
+                memset(m_bytes, 0, sizeof(m_bytes));
+                return;
+            }
+            m_bytes[i] = uchar(hi << 4 | lo);
+        }
+    }
+
+    uchar m_bytes[12];
 };
 Q_DECLARE_METATYPE(BSONoid)
-inline bool operator==(const BSONoid& lhs, const BSONoid& rhs);
+inline bool operator==(const BSONoid& lhs, const BSONoid& rhs) {
+    return memcmp(lhs.data(), rhs.data(), 12) == 0;
+}
+inline bool operator!=(const BSONoid& lhs, const BSONoid& rhs) {
+    return !(lhs == rhs);
+}
+inline bool operator<(const BSONoid& lhs, const BSONoid& rhs) {
+    return memcmp(lhs.data(), rhs.data(), 12) < 0;
+}
+inline uint qHash(const BSONoid &key, uint seed = 0) noexcept {
+    return qHashBits(key.data(), 12, seed);
+}
 QDebug operator<<(QDebug debug, const BSONoid &c);
 QDataStream &operator<<(QDataStream &out, const BSONoid &value);
 QDataStream &operator>>(QDataStream &in, BSONoid &value);
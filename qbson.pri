@@ -0,0 +1,33 @@
+# Sources of the QBSON library, shared by QBSON.pro and the benchmarks
+# which compile them in directly.
+
+INCLUDEPATH += $$PWD
+
+SOURCES += \
+        $$PWD/qbson.cpp \
+        $$PWD/qbson_batch.cpp \
+        $$PWD/qbson_converter.cpp \
+        $$PWD/qbson_diff.cpp \
+        $$PWD/qbson_document.cpp \
+        $$PWD/qbson_extjson.cpp \
+        $$PWD/qbson_file.cpp \
+        $$PWD/qbson_json.cpp \
+        $$PWD/qbson_meta.cpp \
+        $$PWD/qbson_patcher.cpp \
+        $$PWD/qbson_stats.cpp \
+        $$PWD/qbson_utf8.cpp
+
+HEADERS += \
+        $$PWD/qbson.h \
+        $$PWD/qbson_diff.h \
+        $$PWD/qbson_document.h \
+        $$PWD/qbson_file.h \
+        $$PWD/qbson_global.h \
+        $$PWD/qbson_json.h \
+        $$PWD/qbson_meta.h \
+        $$PWD/qbson_p.h \
+        $$PWD/qbson_patcher.h \
+        $$PWD/qbson_reader.h \
+        $$PWD/qbson_struct.h \
+        $$PWD/qbson_utf8.h \
+        $$PWD/qbson_writer.h
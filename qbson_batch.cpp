@@ -0,0 +1,258 @@
+#include "qbson.h"
+#include "qbson_p.h"
+#include "qbson_writer.h"
+
+#include <QRunnable>
+#include <QMutex>
+#include <QSemaphore>
+#include <QThreadPool>
+
+#include <functional>
+#include <memory>
+
+namespace BSON {
+namespace _private {
+
+class BatchWorker : public QRunnable
+{
+public:
+    BatchWorker(const std::function<void()> &work, QSemaphore &done)
+        : m_work(work), m_done(done) {}
+
+    void run() override {
+        m_work();
+        m_done.release();
+    }
+
+private:
+    std::function<void()> m_work;
+    QSemaphore &m_done;
+};
+
+///
+/// \brief parallelFor runs \a body over [0, count) in chunks on the pool
+///
+/// The calling thread works on chunks as well, so the call completes even
+/// if the pool has no free thread. Workers that cannot start immediately
+/// are not queued. \a body must not throw.
+///
+void parallelFor(int count, const BatchOptions &options,
+                 const std::function<void(int, int)> &body) {
+    if (count <= 0)
+        return;
+
+    QThreadPool *pool = options.pool ? options.pool
+                                     : QThreadPool::globalInstance();
+
+    int threads = options.threads > 0 ? options.threads
+                                      : qMax(1, pool->maxThreadCount());
+
+    const int chunkSize = options.chunkSize > 0
+            ? options.chunkSize
+            : qMax(1, count / (threads * 4));
+    const int chunks = (count + chunkSize - 1) / chunkSize;
+
+    threads = qMin(threads, chunks);
+
+    QAtomicInt next(0);
+    const std::function<void()> work = [&]() {
+        int chunk;
+        while ((chunk = next.fetchAndAddRelaxed(1)) < chunks) {
+            const int begin = chunk * chunkSize;
+            body(begin, qMin(count, begin + chunkSize));
+        }
+    };
+
+    QSemaphore done;
+    int started = 0;
+    for (int i = 1; i < threads; ++i) {
+        BatchWorker *worker = new BatchWorker(work, done);
+        if (!pool->tryStart(worker)) {
+            delete worker;
+            break;
+        }
+        ++started;
+    }
+
+    work();
+
+    done.acquire(started);
+}
+
+}
+
+QVector<QVariantMap> fromBsonBatch(const std::vector<bsoncxx::document::view> &docs,
+                                   const BatchOptions &options,
+                                   QVector<QString> *errors)
+{
+    init();
+
+    const int count = int(docs.size());
+
+    QVector<QVariantMap> res(count);
+    QVariantMap *out = res.data();
+
+    QString *errs = nullptr;
+    if (errors) {
+        *errors = QVector<QString>(count);
+        errs = errors->data();
+    }
+
+    _private::parallelFor(count, options, [&](int begin, int end) {
+        Error error;
+        for (int i = begin; i < end; ++i) {
+            out[i] = fromBson(docs[size_t(i)], error);
+            if (error.isError() && errs)
+                errs[i] = error.toString();
+        }
+    });
+
+    return res;
+}
+
+QVector<EncodedBatch> toBsonBatch(const QVector<QVariantMap> &docs,
+                                  const BatchOptions &options,
+                                  QVector<QString> *errors)
+{
+    init();
+
+    const int count = docs.size();
+
+    QString *errs = nullptr;
+    if (errors) {
+        *errors = QVector<QString>(count);
+        errs = errors->data();
+    }
+
+    // encode chunks into their own contiguous writers
+    std::vector<std::unique_ptr<Writer> > writers;
+    QMutex writersMutex;
+
+    std::vector<const Writer*> source(size_t(count), nullptr);
+    std::vector<size_t> offsets(size_t(count), 0);
+    std::vector<int> sizes(size_t(count), 0);
+    // documents lost to an exception in a worker, reported after the join
+    std::vector<char> failed(size_t(count), 0);
+    // a document must also fit into a batch of its own
+    const int maxSize = qMin(options.maxDocumentSize, options.maxBatchSize);
+
+    _private::parallelFor(count, options, [&](int begin, int end) {
+        try {
+            std::unique_ptr<Writer> writer(new Writer);
+
+            Error error;
+            for (int i = begin; i < end; ++i) {
+                const size_t start = writer->size();
+                if (!toBson(docs.at(i), *writer, error)) {
+                    if (errs)
+                        errs[i] = error.toString();
+                    continue;
+                }
+
+                const size_t size = writer->size() - start;
+                if (size > size_t(maxSize)) {
+                    writer->truncate(start);
+                    if (errs)
+                        errs[i] = QString("BSON::toBsonBatch document size %1 exceeds %2")
+                                .arg(size).arg(maxSize);
+                    continue;
+                }
+
+                source[size_t(i)] = writer.get();
+                offsets[size_t(i)] = start;
+                sizes[size_t(i)] = int(size);
+            }
+
+            QMutexLocker locker(&writersMutex);
+            writers.push_back(std::move(writer));
+        } catch (...) {
+            // the writer of the chunk is gone with everything encoded into it
+            for (int i = begin; i < end; ++i) {
+                source[size_t(i)] = nullptr;
+                failed[size_t(i)] = 1;
+            }
+        }
+    });
+
+    // cut batches at the byte limit, then copy every document once
+    QVector<EncodedBatch> res;
+    qint64 batchSize = 0;
+    for (int i = 0; i < count; ++i) {
+        if (!source[size_t(i)])
+            continue;
+
+        if (res.isEmpty() ||
+                batchSize + sizes[size_t(i)] > options.maxBatchSize) {
+            res.append(EncodedBatch());
+            batchSize = 0;
+        }
+
+        EncodedBatch &batch = res.last();
+        batch.offsets << int(batchSize);
+        batch.indexes << i;
+        batchSize += sizes[size_t(i)];
+    }
+
+    EncodedBatch *batches = res.data();
+    BatchOptions copyOptions = options;
+    copyOptions.chunkSize = 1;
+
+    std::vector<char> batchFailed(size_t(res.size()), 0);
+
+    _private::parallelFor(res.size(), copyOptions, [&](int begin, int end) {
+        for (int b = begin; b < end; ++b) {
+            EncodedBatch &batch = batches[b];
+            const int last = batch.indexes.last();
+            try {
+                batch.data.resize(batch.offsets.last() + sizes[size_t(last)]);
+            } catch (...) {
+                batchFailed[size_t(b)] = 1;
+                continue;
+            }
+
+            char *dst = batch.data.data();
+            for (int d = 0; d < batch.indexes.size(); ++d) {
+                const size_t i = size_t(batch.indexes.at(d));
+                memcpy(dst + batch.offsets.at(d),
+                       source[i]->data() + offsets[i], size_t(sizes[i]));
+            }
+        }
+    });
+
+    for (int b = res.size() - 1; b >= 0; --b) {
+        if (!batchFailed[size_t(b)])
+            continue;
+        for (int i : res.at(b).indexes)
+            failed[size_t(i)] = 1;
+        res.remove(b);
+    }
+
+    if (errs) {
+        Error error;
+        _private::setError(error, Error::UnknownException, 0);
+        for (int i = 0; i < count; ++i) {
+            if (failed[size_t(i)] && errs[i].isNull())
+                errs[i] = error.toString();
+        }
+    }
+
+    return res;
+}
+
+std::vector<bsoncxx::document::view> EncodedBatch::views() const
+{
+    std::vector<bsoncxx::document::view> res;
+    res.reserve(size_t(offsets.size()));
+
+    const uint8_t *base = (const uint8_t*) data.constData();
+    for (int d = 0; d < offsets.size(); ++d) {
+        const int end = d + 1 < offsets.size() ? offsets.at(d + 1)
+                                               : data.size();
+        res.push_back(bsoncxx::document::view(base + offsets.at(d),
+                                              size_t(end - offsets.at(d))));
+    }
+
+    return res;
+}
+
+}
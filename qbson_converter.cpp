@@ -0,0 +1,241 @@
+#include "qbson.h"
+#include "qbson_p.h"
+
+#include <QAtomicPointer>
+#include <QMutex>
+#include <QVersionNumber>
+
+#include <memory>
+
+namespace BSON {
+namespace _private {
+
+namespace {
+
+///
+/// \brief The ConverterTable struct maps metatype ids to their encoding
+///
+/// A published table is never modified, registration publishes a copy.
+/// Readers take no lock.
+///
+struct ConverterTable {
+    /// indexed by metatype id, Unresolved for types not in the table
+    QVector<Converter> byType;
+    /// metatype of the user subtype 0x80 + i, 0 if none
+    int bySubType[128] = {};
+};
+
+///
+/// \brief The ConverterRegistry struct serializes registrations
+///
+/// Every published table is kept until exit, a reader may still hold an
+/// older one.
+///
+struct ConverterRegistry {
+    QMutex mutex;
+    std::vector<std::unique_ptr<const ConverterTable>> tables;
+
+    static ConverterRegistry &instance() {
+        static ConverterRegistry registry;
+        return registry;
+    }
+};
+
+QAtomicPointer<const ConverterTable> converterTable;
+
+///
+/// canConvert outcome of the Qt types below QMetaType::User, resolved on
+/// first use. It depends on the type only, not on the value.
+///
+QAtomicInt resolvedKinds[QMetaType::User];
+
+Converter kindOnly(Converter::Kind kind) {
+    Converter res;
+    res.kind = kind;
+    return res;
+}
+
+const Converter fallbackConverters[] = {
+    kindOnly(Converter::Unresolved),
+    kindOnly(Converter::Unsupported),
+    kindOnly(Converter::Binary),
+    kindOnly(Converter::Code),
+    kindOnly(Converter::CodeWScope),
+    kindOnly(Converter::MaxKey),
+    kindOnly(Converter::MinKey),
+    kindOnly(Converter::Oid),
+    kindOnly(Converter::Regexp),
+    kindOnly(Converter::Custom),
+    kindOnly(Converter::ToMap),
+    kindOnly(Converter::ToList),
+    kindOnly(Converter::ToLongLong),
+    kindOnly(Converter::ToInt),
+    kindOnly(Converter::ToString),
+    kindOnly(Converter::DataStream),
+    kindOnly(Converter::Tagged),
+    kindOnly(Converter::OrderedDocument)
+};
+
+///
+/// \brief resolveKind runs the canConvert chain once for the type of \a v
+///
+Converter::Kind resolveKind(const QVariant &v) {
+    if (v.canConvert(QVariant::Map))
+        return Converter::ToMap;
+    if (v.canConvert(QVariant::List))
+        return Converter::ToList;
+    if (v.canConvert(QVariant::LongLong))
+        return Converter::ToLongLong;
+    if (v.canConvert(QVariant::Int))
+        return Converter::ToInt;
+    if (v.canConvert(QVariant::String))
+        return Converter::ToString;
+    return Converter::DataStream;
+}
+
+///
+/// \brief isNative tells the types appendValue maps before the table lookup
+///
+bool isNative(int metaType) {
+    switch (metaType) {
+    case QMetaType::UnknownType:
+    case QMetaType::Int:
+    case QMetaType::QString:
+    case QMetaType::QStringList:
+    case QMetaType::LongLong:
+    case QMetaType::UInt:
+    case QMetaType::QVariantMap:
+    case QMetaType::QVariantList:
+    case QMetaType::Double:
+    case QMetaType::Bool:
+    case QMetaType::QDateTime:
+    case QMetaType::QByteArray:
+    case QMetaType::QUuid:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// caller holds the registry mutex
+void publish(ConverterRegistry &registry, ConverterTable *table) {
+    registry.tables.emplace_back(table);
+    converterTable.storeRelease(table);
+}
+
+void setKind(ConverterTable &table, int metaType, Converter::Kind kind) {
+    if (table.byType.size() <= metaType)
+        table.byType.resize(metaType + 1);
+    table.byType[metaType].kind = kind;
+    table.byType[metaType].metaType = metaType;
+}
+
+void setTagged(ConverterTable &table, int metaType, TaggedBinary::Tag tag) {
+    setKind(table, metaType, Converter::Tagged);
+    table.byType[metaType].subType = tag;
+}
+
+}
+
+void initConverters() {
+    ConverterRegistry &registry = ConverterRegistry::instance();
+    QMutexLocker locker(&registry.mutex);
+
+    ConverterTable *table = new ConverterTable;
+    setKind(*table, qMetaTypeId<BSONbinary>(), Converter::Binary);
+    setKind(*table, qMetaTypeId<BSONcode>(), Converter::Code);
+    setKind(*table, qMetaTypeId<BSONcodeWscope>(), Converter::CodeWScope);
+    setKind(*table, qMetaTypeId<BSONmaxkey>(), Converter::MaxKey);
+    setKind(*table, qMetaTypeId<BSONminkey>(), Converter::MinKey);
+    setKind(*table, qMetaTypeId<BSONoid>(), Converter::Oid);
+    setKind(*table, qMetaTypeId<BSONregexp>(), Converter::Regexp);
+    setKind(*table, qMetaTypeId<Document>(), Converter::OrderedDocument);
+    setTagged(*table, QMetaType::QDate, TaggedBinary::Date);
+    setTagged(*table, QMetaType::QTime, TaggedBinary::Time);
+    setTagged(*table, QMetaType::QPoint, TaggedBinary::Point);
+    setTagged(*table, QMetaType::QSize, TaggedBinary::Size);
+    setTagged(*table, QMetaType::QRect, TaggedBinary::Rect);
+    setTagged(*table, qMetaTypeId<QVersionNumber>(), TaggedBinary::VersionNumber);
+
+    publish(registry, table);
+}
+
+const Converter &converterFor(const QVariant &v) {
+    const int metaType = v.userType();
+
+    const ConverterTable *table = converterTable.loadAcquire();
+    if (table && metaType < table->byType.size()) {
+        const Converter &c = table->byType.at(metaType);
+        if (c.kind != Converter::Unresolved)
+            return c;
+    }
+
+    if (metaType <= QMetaType::UnknownType || metaType >= QMetaType::User)
+        return fallbackConverters[Converter::Unsupported];
+
+    int kind = resolvedKinds[metaType].loadAcquire();
+    if (kind == Converter::Unresolved) {
+        kind = resolveKind(v);
+        resolvedKinds[metaType].storeRelease(kind);
+    }
+    return fallbackConverters[kind];
+}
+
+const Converter *converterForSubType(std::uint8_t subType) {
+    if (subType <= 0x80)
+        return nullptr;
+
+    const ConverterTable *table = converterTable.loadAcquire();
+    if (!table)
+        return nullptr;
+
+    const int metaType = table->bySubType[subType - 0x80];
+    return metaType ? &table->byType.at(metaType) : nullptr;
+}
+
+bool registerConverter(int metaType, bsoncxx::binary_sub_type subType,
+                       AnyFunction encode, EncodeThunk encodeThunk,
+                       AnyFunction decode, DecodeThunk decodeThunk)
+{
+    initTypes();
+
+    const int sub = int(subType);
+    if (metaType <= QMetaType::UnknownType || isNative(metaType)
+            || sub <= 0x80 || sub > 0xff || !encode || !decode)
+        return false;
+
+    ConverterRegistry &registry = ConverterRegistry::instance();
+    QMutexLocker locker(&registry.mutex);
+
+    const ConverterTable *current = converterTable.loadAcquire();
+    if (metaType < current->byType.size()) {
+        const Converter::Kind kind = current->byType.at(metaType).kind;
+        if (kind != Converter::Unresolved && kind != Converter::Custom
+                && kind != Converter::Tagged)
+            return false;
+    }
+
+    const int owner = current->bySubType[sub - 0x80];
+    if (owner && owner != metaType)
+        return false;
+
+    ConverterTable *table = new ConverterTable(*current);
+    if (metaType < table->byType.size()
+            && table->byType.at(metaType).kind == Converter::Custom)
+        table->bySubType[table->byType.at(metaType).subType - 0x80] = 0;
+    setKind(*table, metaType, Converter::Custom);
+
+    Converter &c = table->byType[metaType];
+    c.subType = std::uint8_t(sub);
+    c.encode = encode;
+    c.encodeThunk = encodeThunk;
+    c.decode = decode;
+    c.decodeThunk = decodeThunk;
+    table->bySubType[sub - 0x80] = metaType;
+
+    publish(registry, table);
+    return true;
+}
+
+}
+}
@@ -0,0 +1,236 @@
+#include "qbson_diff.h"
+#include "qbson_p.h"
+
+#include <QByteArray>
+#include <QVarLengthArray>
+
+namespace BSON {
+
+namespace {
+
+///
+/// \brief The DiffScratch struct collects the $set and $unset entries
+///
+/// Kept per thread, a diff of documents of known shapes does not allocate
+/// once the buffers have grown.
+///
+struct DiffScratch {
+    Writer sets;
+    Writer unsets;
+    int setCount = 0;
+    int unsetCount = 0;
+    /// dotted path of the field being compared
+    QByteArray path;
+
+    static DiffScratch &local() {
+        static thread_local DiffScratch scratch;
+        return scratch;
+    }
+
+    void clear() {
+        sets.clear();
+        unsets.clear();
+        setCount = 0;
+        unsetCount = 0;
+        path.clear();
+    }
+
+    /// \return length of the path before the push, for pop()
+    int push(const Element &e) {
+        const int mark = path.size();
+        if (mark)
+            path += '.';
+        path.append(e.key, int(e.keySize));
+        return mark;
+    }
+
+    void pop(int mark) { path.truncate(mark); }
+
+    void set(const Element &e) {
+        sets.appendKey(e.type, path.constData(), size_t(path.size()));
+        sets.appendBytes(e.value, e.valueSize);
+        ++setCount;
+    }
+
+    void unset() {
+        unsets.appendKey(bsoncxx::type::k_utf8, path.constData(), size_t(path.size()));
+        unsets.appendString("", 0);
+        ++unsetCount;
+    }
+};
+
+int countElements(const uint8_t *data, size_t size) {
+    ElementReader reader(data, size);
+    Element e;
+    int res = 0;
+    while (reader.next(e))
+        ++res;
+    return res;
+}
+
+bool sameValue(const Element &a, const Element &b) {
+    return a.type == b.type && a.valueSize == b.valueSize
+            && std::memcmp(a.value, b.value, a.valueSize) == 0;
+}
+
+bool diffDocument(DiffScratch &scratch, const uint8_t *from, size_t fromSize,
+                  const uint8_t *to, size_t toSize, bool isArray, Error &error) {
+    using namespace _private;
+    using bsoncxx::type;
+
+    const Error::Code malformed = isArray ? Error::MalformedArray
+                                          : Error::MalformedDocument;
+
+    QVarLengthArray<Element, 32> fromElements;
+    QVarLengthArray<bool, 32> matched;
+    {
+        ElementReader reader(from, fromSize);
+        Element e;
+        while (reader.next(e)) {
+            fromElements.append(e);
+            matched.append(false);
+        }
+        if (reader.hasError())
+            return setError(error, malformed, 0);
+    }
+
+    ElementReader reader(to, toSize);
+    Element e;
+    int index = 0;
+    while (reader.next(e)) {
+        // fields usually keep their position, try it first
+        int found = -1;
+        if (index < fromElements.size() && !matched[index]
+                && fromElements[index].keyEquals(e.key, e.keySize)) {
+            found = index;
+        } else {
+            for (int i = 0; i < fromElements.size(); ++i) {
+                if (!matched[i] && fromElements[i].keyEquals(e.key, e.keySize)) {
+                    found = i;
+                    break;
+                }
+            }
+        }
+        ++index;
+
+        if (found >= 0) {
+            matched[found] = true;
+            const Element &f = fromElements[found];
+            if (sameValue(f, e))
+                continue;
+
+            const int mark = scratch.push(e);
+            bool descend = false;
+            if (f.type == e.type && e.type == type::k_document)
+                descend = true;
+            else if (f.type == e.type && e.type == type::k_array)
+                descend = countElements(e.value, e.valueSize)
+                        >= countElements(f.value, f.valueSize);
+
+            if (descend) {
+                if (!diffDocument(scratch, f.value, f.valueSize, e.value, e.valueSize,
+                                  e.type == type::k_array, error)) {
+                    error.prependPath(QString::fromUtf8(e.key, int(e.keySize)));
+                    return false;
+                }
+            } else {
+                scratch.set(e);
+            }
+            scratch.pop(mark);
+        } else {
+            const int mark = scratch.push(e);
+            scratch.set(e);
+            scratch.pop(mark);
+        }
+    }
+    if (reader.hasError())
+        return setError(error, malformed, 0);
+
+    for (int i = 0; i < fromElements.size(); ++i) {
+        if (matched[i])
+            continue;
+        const int mark = scratch.push(fromElements[i]);
+        scratch.unset();
+        scratch.pop(mark);
+    }
+
+    return true;
+}
+
+}
+
+bool diff(const uint8_t *from, size_t fromLength,
+          const uint8_t *to, size_t toLength,
+          Writer &out, Error &error)
+noexcept
+{
+    using namespace _private;
+
+    error.clear();
+
+    const size_t start = out.size();
+    try {
+        DiffScratch &scratch = DiffScratch::local();
+        scratch.clear();
+
+        const size_t fromSize = documentSize(from, fromLength);
+        const size_t toSize = documentSize(to, toLength);
+        const bool same = fromSize && fromSize == toSize
+                && std::memcmp(from, to, fromSize) == 0;
+
+        if (same || diffDocument(scratch, from, fromLength, to, toLength, false, error)) {
+            const size_t doc = out.beginDocument();
+            if (scratch.setCount) {
+                const size_t set = out.beginElement("$set", 4);
+                out.setElementType(set, bsoncxx::type::k_document);
+                const size_t body = out.beginDocument();
+                out.appendBytes(scratch.sets.data(), scratch.sets.size());
+                out.endDocument(body);
+            }
+            if (scratch.unsetCount) {
+                const size_t unset = out.beginElement("$unset", 6);
+                out.setElementType(unset, bsoncxx::type::k_document);
+                const size_t body = out.beginDocument();
+                out.appendBytes(scratch.unsets.data(), scratch.unsets.size());
+                out.endDocument(body);
+            }
+            out.endDocument(doc);
+            return true;
+        }
+    } catch (...) {
+        setError(error, Error::UnknownException, 0);
+    }
+    out.truncate(start);
+    return false;
+}
+
+bsoncxx::document::value diff(const bsoncxx::document::view &from,
+                              const bsoncxx::document::view &to)
+{
+    Error error;
+    bsoncxx::document::value res = diff(from, to, error);
+    if (error.isError())
+        throw BSONexception(error.toString());
+    return res;
+}
+
+bsoncxx::document::value diff(const bsoncxx::document::view &from,
+                              const bsoncxx::document::view &to,
+                              Error &error)
+noexcept
+{
+    using namespace bsoncxx;
+
+    try {
+        Writer writer;
+        if (diff(from.data(), from.length(), to.data(), to.length(), writer, error)) {
+            const size_t length = writer.size();
+            return document::value(writer.release(), length, &Writer::freeBuffer);
+        }
+    } catch (...) {
+        _private::setError(error, Error::UnknownException, 0);
+    }
+    return _private::emptyDocumentValue();
+}
+
+}
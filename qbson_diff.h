@@ -0,0 +1,46 @@
+#ifndef QBSON_DIFF_H
+#define QBSON_DIFF_H
+
+#include <bsoncxx/document/value.hpp>
+#include <bsoncxx/document/view.hpp>
+
+#include "qbson.h"
+
+namespace BSON {
+
+///
+/// \brief diff computes the update document that turns \a from into \a to
+///
+/// Both documents are compared on their raw bytes, nothing is decoded.
+/// Fields with equal type and bytes are skipped, embedded documents of
+/// equal length are skipped by one byte compare before descending.
+/// Changed values are copied as they are, an int32 stays an int32.
+///
+/// The result is {"$set": {"a.b": ...}, "$unset": {"c": ""}} with dotted
+/// paths, each part only if not empty, {} if the documents are equal.
+/// Arrays are descended like documents unless \a to has fewer elements
+/// than \a from, then the whole array is set, since $unset leaves null in
+/// an array.
+///
+/// \param out receives the update document, appended behind its content
+/// \param error receives the reason on malformed input, \a out is left unchanged
+/// \return false on not success
+///
+bool diff(const uint8_t *from, size_t fromLength,
+          const uint8_t *to, size_t toLength,
+          Writer &out, Error &error) noexcept;
+
+///
+/// \brief diff
+/// \throw BSONexception on malformed document without Error argument
+/// \return update document, empty on not success
+///
+bsoncxx::document::value diff(const bsoncxx::document::view &from,
+                              const bsoncxx::document::view &to) noexcept(false);
+bsoncxx::document::value diff(const bsoncxx::document::view &from,
+                              const bsoncxx::document::view &to,
+                              Error &error) noexcept;
+
+}
+
+#endif // QBSON_DIFF_H
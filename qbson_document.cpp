@@ -0,0 +1,149 @@
+#include "qbson_document.h"
+
+#include <algorithm>
+
+namespace BSON {
+
+void Document::clear()
+{
+    m_fields.clear();
+    m_index.clear();
+}
+
+int Document::indexOf(const QString &key) const
+{
+    if (!m_index.isEmpty())
+        return m_index.value(key, -1);
+
+    for (int i = 0; i < m_fields.size(); ++i) {
+        if (m_fields.at(i).key == key)
+            return i;
+    }
+    return -1;
+}
+
+QVariant Document::value(const QString &key, const QVariant &defaultValue) const
+{
+    const int i = indexOf(key);
+    return i >= 0 ? m_fields.at(i).value : defaultValue;
+}
+
+QStringList Document::keys() const
+{
+    QStringList res;
+    res.reserve(m_fields.size());
+    for (const Field &field : m_fields)
+        res << field.key;
+    return res;
+}
+
+void Document::append(const QString &key, const QVariant &value)
+{
+    m_fields.append(Field{key, value});
+
+    if (!m_index.isEmpty()) {
+        if (!m_index.contains(key))
+            m_index.insert(key, m_fields.size() - 1);
+    } else if (m_fields.size() == indexThreshold) {
+        buildIndex();
+    }
+}
+
+void Document::insert(const QString &key, const QVariant &value)
+{
+    const int i = indexOf(key);
+    if (i >= 0)
+        m_fields[i].value = value;
+    else
+        append(key, value);
+}
+
+int Document::remove(const QString &key)
+{
+    const int before = m_fields.size();
+    m_fields.erase(std::remove_if(m_fields.begin(), m_fields.end(),
+                                  [&key](const Field &field) {
+                                      return field.key == key;
+                                  }),
+                   m_fields.end());
+
+    const int removed = before - m_fields.size();
+    if (removed) {
+        m_index.clear();
+        if (m_fields.size() >= indexThreshold)
+            buildIndex();
+    }
+    return removed;
+}
+
+QVariant &Document::operator[](const QString &key)
+{
+    int i = indexOf(key);
+    if (i < 0) {
+        append(key, QVariant());
+        i = m_fields.size() - 1;
+    }
+    return m_fields[i].value;
+}
+
+QVariantMap Document::toMap() const
+{
+    QVariantMap res;
+    // the first occurrence wins, as in indexOf()
+    for (auto it = m_fields.crbegin(); it != m_fields.crend(); ++it)
+        res.insert(it->key, it->value);
+    return res;
+}
+
+QVariantHash Document::toHash() const
+{
+    QVariantHash res;
+    res.reserve(m_fields.size());
+    for (auto it = m_fields.crbegin(); it != m_fields.crend(); ++it)
+        res.insert(it->key, it->value);
+    return res;
+}
+
+Document Document::fromMap(const QVariantMap &map)
+{
+    Document res;
+    res.reserve(map.size());
+    for (auto it = map.cbegin(); it != map.cend(); ++it)
+        res.append(it.key(), it.value());
+    return res;
+}
+
+bool Document::operator==(const Document &other) const
+{
+    if (m_fields.size() != other.m_fields.size())
+        return false;
+    for (int i = 0; i < m_fields.size(); ++i) {
+        if (m_fields.at(i).key != other.m_fields.at(i).key
+                || m_fields.at(i).value != other.m_fields.at(i).value)
+            return false;
+    }
+    return true;
+}
+
+void Document::buildIndex()
+{
+    m_index.reserve(m_fields.size() * 2);
+    for (int i = m_fields.size() - 1; i >= 0; --i)
+        m_index.insert(m_fields.at(i).key, i);
+}
+
+QDebug operator<<(QDebug debug, const Document &document)
+{
+    QDebugStateSaver saver(debug);
+    Q_UNUSED(saver)
+    debug.nospace() << "BSON::Document(";
+    for (int i = 0; i < document.size(); ++i) {
+        if (i)
+            debug << ", ";
+        debug << document.keyAt(i) << ": " << document.valueAt(i);
+    }
+    debug << ")";
+    return debug;
+}
+
+}
@@ -0,0 +1,112 @@
+#ifndef QBSON_DOCUMENT_H
+#define QBSON_DOCUMENT_H
+
+#include <QDebug>
+#include <QHash>
+#include <QMetaType>
+#include <QString>
+#include <QStringList>
+#include <QVariant>
+#include <QVector>
+
+namespace BSON {
+
+struct DocumentField {
+    QString key;
+    QVariant value;
+};
+
+}
+
+Q_DECLARE_TYPEINFO(BSON::DocumentField, Q_MOVABLE_TYPE);
+
+namespace BSON {
+
+///
+/// \brief The Document class is an ordered BSON document
+///
+/// Fields are kept in one contiguous vector in wire order, so a decoded
+/// document re-encodes to the same bytes, "_id" first. Small documents
+/// are searched linearly. From indexThreshold fields on a key to position
+/// hash is kept up to date by every change; const lookups are safe from
+/// several threads. Keys may repeat as on the wire, lookups find the
+/// first occurrence.
+///
+/// Copies share the fields until one is changed, like QVariantMap.
+///
+class Document
+{
+public:
+    typedef DocumentField Field;
+
+    typedef QVector<Field>::const_iterator const_iterator;
+
+    static const int indexThreshold = 16;
+
+    Document() {}
+
+    int size() const { return m_fields.size(); }
+    bool isEmpty() const { return m_fields.isEmpty(); }
+    void reserve(int size) { m_fields.reserve(size); }
+    void clear();
+
+    const Field &at(int i) const { return m_fields.at(i); }
+    const QString &keyAt(int i) const { return m_fields.at(i).key; }
+    const QVariant &valueAt(int i) const { return m_fields.at(i).value; }
+    void setValueAt(int i, const QVariant &value) { m_fields[i].value = value; }
+
+    ///
+    /// \brief indexOf
+    /// \return position of the first field named \a key, -1 if missing
+    ///
+    int indexOf(const QString &key) const;
+    bool contains(const QString &key) const { return indexOf(key) >= 0; }
+    QVariant value(const QString &key, const QVariant &defaultValue = QVariant()) const;
+    QStringList keys() const;
+
+    ///
+    /// \brief append adds a field at the end without looking for \a key
+    ///
+    void append(const QString &key, const QVariant &value);
+
+    ///
+    /// \brief insert replaces the value of \a key or appends a new field
+    ///
+    void insert(const QString &key, const QVariant &value);
+
+    ///
+    /// \brief remove drops every field named \a key
+    /// \return number of removed fields
+    ///
+    int remove(const QString &key);
+
+    QVariant &operator[](const QString &key);
+
+    const_iterator begin() const { return m_fields.cbegin(); }
+    const_iterator end() const { return m_fields.cend(); }
+
+    QVariantMap toMap() const;
+    QVariantHash toHash() const;
+    static Document fromMap(const QVariantMap &map);
+
+    ///
+    /// \brief operator== compares keys, values and their order
+    ///
+    bool operator==(const Document &other) const;
+    bool operator!=(const Document &other) const { return !(*this == other); }
+
+private:
+    void buildIndex();
+
+    QVector<Field> m_fields;
+    /// filled from indexThreshold fields on
+    QHash<QString, int> m_index;
+};
+
+QDebug operator<<(QDebug debug, const Document &document);
+
+}
+
+Q_DECLARE_METATYPE(BSON::Document)
+
+#endif // QBSON_DOCUMENT_H
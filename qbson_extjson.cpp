@@ -0,0 +1,1258 @@
+#include "qbson_json.h"
+#include "qbson_p.h"
+
+#include <QLocale>
+
+#include <bsoncxx/decimal128.hpp>
+#include <bsoncxx/exception/exception.hpp>
+#include <bsoncxx/stdx/string_view.hpp>
+
+#include <cmath>
+#include <limits>
+
+namespace BSON {
+namespace _private {
+
+static const char hexDigits[] = "0123456789abcdef";
+static const char base64Digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// date arithmetic on the proleptic Gregorian calendar, valid for all int64 days
+
+int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = unsigned(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + int64_t(doe) - 719468;
+}
+
+void civilFromDays(int64_t days, int64_t &y, unsigned &m, unsigned &d) {
+    days += 719468;
+    const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    const unsigned doe = unsigned(days - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = int64_t(yoe) + era * 400 + (m <= 2);
+}
+
+// BSON -> Extended JSON
+
+template <size_t N>
+inline void appendLiteral(Writer &out, const char (&text)[N]) {
+    out.appendBytes(text, N - 1);
+}
+
+void appendJsonString(Writer &out, const char *data, size_t size) {
+    if (!validateUtf8(data, size))
+        throw BSONexception("Error in string with invalid UTF-8");
+    out.appendByte('"');
+
+    size_t run = 0;
+    for (size_t i = 0; i < size; ++i) {
+        const uint8_t c = uint8_t(data[i]);
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        out.appendBytes(data + run, i - run);
+        run = i + 1;
+
+        switch (c) {
+        case '"': appendLiteral(out, "\\\""); break;
+        case '\\': appendLiteral(out, "\\\\"); break;
+        case '\b': appendLiteral(out, "\\b"); break;
+        case '\f': appendLiteral(out, "\\f"); break;
+        case '\n': appendLiteral(out, "\\n"); break;
+        case '\r': appendLiteral(out, "\\r"); break;
+        case '\t': appendLiteral(out, "\\t"); break;
+        default: {
+            uint8_t *dst = out.grow(6);
+            memcpy(dst, "\\u00", 4);
+            dst[4] = uint8_t(hexDigits[c >> 4]);
+            dst[5] = uint8_t(hexDigits[c & 0xF]);
+        }
+        }
+    }
+
+    out.appendBytes(data + run, size - run);
+    out.appendByte('"');
+}
+
+void appendInteger(Writer &out, int64_t value) {
+    char buf[20];
+    size_t n = 0;
+    uint64_t v = value < 0 ? 0 - uint64_t(value) : uint64_t(value);
+    do {
+        buf[sizeof(buf) - ++n] = char('0' + v % 10);
+        v /= 10;
+    } while (v);
+    if (value < 0)
+        buf[sizeof(buf) - ++n] = '-';
+    out.appendBytes(buf + sizeof(buf) - n, n);
+}
+
+void appendQuotedInteger(Writer &out, int64_t value) {
+    out.appendByte('"');
+    appendInteger(out, value);
+    out.appendByte('"');
+}
+
+void appendDouble(Writer &out, double value, bool relaxed) {
+    if (std::isnan(value)) {
+        appendLiteral(out, "{\"$numberDouble\":\"NaN\"}");
+        return;
+    }
+    if (std::isinf(value)) {
+        if (value > 0)
+            appendLiteral(out, "{\"$numberDouble\":\"Infinity\"}");
+        else
+            appendLiteral(out, "{\"$numberDouble\":\"-Infinity\"}");
+        return;
+    }
+
+    // shortest representation that reads back exactly, locale independent
+    const QByteArray text = QByteArray::number(value, 'g',
+                                               QLocale::FloatingPointShortest);
+    const bool integral = text.indexOf('.') < 0 && text.indexOf('e') < 0;
+
+    if (!relaxed)
+        appendLiteral(out, "{\"$numberDouble\":\"");
+    out.appendBytes(text.constData(), size_t(text.size()));
+    if (integral)
+        appendLiteral(out, ".0");
+    if (!relaxed)
+        appendLiteral(out, "\"}");
+}
+
+void appendHex(Writer &out, const uint8_t *data, size_t size) {
+    uint8_t *dst = out.grow(size * 2);
+    for (size_t i = 0; i < size; ++i) {
+        dst[2 * i] = uint8_t(hexDigits[data[i] >> 4]);
+        dst[2 * i + 1] = uint8_t(hexDigits[data[i] & 0xF]);
+    }
+}
+
+void appendOid(Writer &out, const uint8_t *data) {
+    appendLiteral(out, "{\"$oid\":\"");
+    appendHex(out, data, 12);
+    appendLiteral(out, "\"}");
+}
+
+void appendBase64(Writer &out, const uint8_t *data, size_t size) {
+    uint8_t *dst = out.grow((size + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < size; i += 3) {
+        const uint32_t v = uint32_t(data[i]) << 16 | uint32_t(data[i + 1]) << 8 |
+                data[i + 2];
+        *dst++ = uint8_t(base64Digits[v >> 18]);
+        *dst++ = uint8_t(base64Digits[(v >> 12) & 0x3F]);
+        *dst++ = uint8_t(base64Digits[(v >> 6) & 0x3F]);
+        *dst++ = uint8_t(base64Digits[v & 0x3F]);
+    }
+    if (i < size) {
+        uint32_t v = uint32_t(data[i]) << 16;
+        if (i + 1 < size)
+            v |= uint32_t(data[i + 1]) << 8;
+        *dst++ = uint8_t(base64Digits[v >> 18]);
+        *dst++ = uint8_t(base64Digits[(v >> 12) & 0x3F]);
+        *dst++ = i + 1 < size ? uint8_t(base64Digits[(v >> 6) & 0x3F]) : '=';
+        *dst++ = '=';
+    }
+}
+
+void appendIsoDate(Writer &out, int64_t msecs) {
+    int64_t days = msecs / 86400000;
+    int64_t ms = msecs % 86400000;
+    if (ms < 0) {
+        ms += 86400000;
+        --days;
+    }
+
+    int64_t year;
+    unsigned month, day;
+    civilFromDays(days, year, month, day);
+
+    char buf[] = "0000-00-00T00:00:00.000Z";
+    const auto put = [&buf](int pos, int digits, int64_t value) {
+        for (int i = digits - 1; i >= 0; --i, value /= 10)
+            buf[pos + i] = char('0' + value % 10);
+    };
+    put(0, 4, year);
+    put(5, 2, month);
+    put(8, 2, day);
+    put(11, 2, ms / 3600000);
+    put(14, 2, ms / 60000 % 60);
+    put(17, 2, ms / 1000 % 60);
+    put(20, 3, ms % 1000);
+
+    out.appendByte('"');
+    out.appendBytes(buf, sizeof(buf) - 1);
+    out.appendByte('"');
+}
+
+void writeExtendedDocument(Writer &out, const uint8_t *data, size_t size,
+                           bool isArray, bool relaxed);
+
+void writeExtendedValue(Writer &out, const Element &e, bool relaxed) {
+    using bsoncxx::type;
+
+    switch (e.type) {
+    case type::k_double:
+        appendDouble(out, e.dbl(), relaxed);
+        return;
+    case type::k_utf8:
+        appendJsonString(out, e.string(), e.stringSize());
+        return;
+    case type::k_document:
+        writeExtendedDocument(out, e.value, e.valueSize, false, relaxed);
+        return;
+    case type::k_array:
+        writeExtendedDocument(out, e.value, e.valueSize, true, relaxed);
+        return;
+    case type::k_binary:
+        appendLiteral(out, "{\"$binary\":{\"base64\":\"");
+        appendBase64(out, e.binaryData(), e.binarySize());
+        appendLiteral(out, "\",\"subType\":\"");
+        appendHex(out, e.value + 4, 1);
+        appendLiteral(out, "\"}}");
+        return;
+    case type::k_undefined:
+        appendLiteral(out, "{\"$undefined\":true}");
+        return;
+    case type::k_oid:
+        appendOid(out, e.value);
+        return;
+    case type::k_bool:
+        if (e.boolean())
+            appendLiteral(out, "true");
+        else
+            appendLiteral(out, "false");
+        return;
+    case type::k_date: {
+        // relaxed dates are ISO strings for years 1970 to 9999 only
+        const int64_t msecs = e.int64();
+        appendLiteral(out, "{\"$date\":");
+        if (relaxed && msecs >= 0 && msecs <= Q_INT64_C(253402300799999)) {
+            appendIsoDate(out, msecs);
+        } else {
+            appendLiteral(out, "{\"$numberLong\":");
+            appendQuotedInteger(out, msecs);
+            out.appendByte('}');
+        }
+        out.appendByte('}');
+        return;
+    }
+    case type::k_null:
+        appendLiteral(out, "null");
+        return;
+    case type::k_regex: {
+        const char *pattern = e.regexPattern();
+        const char *options = e.regexOptions();
+        appendLiteral(out, "{\"$regularExpression\":{\"pattern\":");
+        appendJsonString(out, pattern, strlen(pattern));
+        appendLiteral(out, ",\"options\":");
+        appendJsonString(out, options, strlen(options));
+        appendLiteral(out, "}}");
+        return;
+    }
+    case type::k_dbpointer: {
+        const size_t size = size_t(loadInt32(e.value)) - 1;
+        appendLiteral(out, "{\"$dbPointer\":{\"$ref\":");
+        appendJsonString(out, (const char*) e.value + 4, size);
+        appendLiteral(out, ",\"$id\":");
+        appendOid(out, e.value + 4 + size + 1);
+        appendLiteral(out, "}}");
+        return;
+    }
+    case type::k_code:
+        appendLiteral(out, "{\"$code\":");
+        appendJsonString(out, e.string(), e.stringSize());
+        out.appendByte('}');
+        return;
+    case type::k_symbol:
+        appendLiteral(out, "{\"$symbol\":");
+        appendJsonString(out, e.string(), e.stringSize());
+        out.appendByte('}');
+        return;
+    case type::k_codewscope: {
+        const size_t codeSize = size_t(loadInt32(e.value + 4));
+        appendLiteral(out, "{\"$code\":");
+        appendJsonString(out, (const char*) e.value + 8, codeSize - 1);
+        appendLiteral(out, ",\"$scope\":");
+        writeExtendedDocument(out, e.value + 8 + codeSize,
+                              e.valueSize - 8 - codeSize, false, relaxed);
+        out.appendByte('}');
+        return;
+    }
+    case type::k_int32:
+        if (relaxed) {
+            appendInteger(out, e.int32());
+        } else {
+            appendLiteral(out, "{\"$numberInt\":");
+            appendQuotedInteger(out, e.int32());
+            out.appendByte('}');
+        }
+        return;
+    case type::k_timestamp:
+        appendLiteral(out, "{\"$timestamp\":{\"t\":");
+        appendInteger(out, uint32_t(loadInt32(e.value + 4)));
+        appendLiteral(out, ",\"i\":");
+        appendInteger(out, uint32_t(loadInt32(e.value)));
+        appendLiteral(out, "}}");
+        return;
+    case type::k_int64:
+        if (relaxed) {
+            appendInteger(out, e.int64());
+        } else {
+            appendLiteral(out, "{\"$numberLong\":");
+            appendQuotedInteger(out, e.int64());
+            out.appendByte('}');
+        }
+        return;
+    case type::k_decimal128: {
+        const std::string text =
+                bsoncxx::decimal128(uint64_t(loadInt64(e.value + 8)),
+                                    uint64_t(loadInt64(e.value))).to_string();
+        appendLiteral(out, "{\"$numberDecimal\":\"");
+        out.appendBytes(text.data(), text.size());
+        appendLiteral(out, "\"}");
+        return;
+    }
+    case type::k_maxkey:
+        appendLiteral(out, "{\"$maxKey\":1}");
+        return;
+    case type::k_minkey:
+        appendLiteral(out, "{\"$minKey\":1}");
+        return;
+    default:
+        break;
+    }
+
+    throw BSONexception(QString("Error in unknown type %1").arg((int) e.type));
+}
+
+void writeExtendedDocument(Writer &out, const uint8_t *data, size_t size,
+                           bool isArray, bool relaxed) {
+    out.appendByte(isArray ? '[' : '{');
+
+    ElementReader reader(data, size);
+    Element e;
+    bool first = true;
+    while (reader.next(e)) {
+        if (!first)
+            out.appendByte(',');
+        first = false;
+
+        if (!isArray) {
+            appendJsonString(out, e.key, e.keySize);
+            out.appendByte(':');
+        }
+        writeExtendedValue(out, e, relaxed);
+    }
+
+    if (reader.hasError())
+        throw BSONexception("BSON::toExtendedJson malformed document");
+
+    out.appendByte(isArray ? ']' : '}');
+}
+
+// Extended JSON -> BSON
+
+///
+/// \brief The ExtendedJsonParser class is a recursive descent JSON parser
+/// writing BSON
+///
+/// Element types are written as placeholders and set once the value is
+/// known, so objects that turn out to be type wrappers are rolled back
+/// and rewritten as the wrapped type without any intermediate tree.
+///
+class ExtendedJsonParser
+{
+public:
+    ExtendedJsonParser(const char *data, size_t size, Writer &w)
+        : m_begin(data), m_p(data), m_end(data + size), m_w(w), m_depth(0) {}
+
+    void parse() {
+        if (!validateUtf8(m_begin, size_t(m_end - m_begin)))
+            fail("invalid UTF-8");
+        if (!consume('{'))
+            fail("object expected");
+        parseMembers();
+        skipSpace();
+        if (m_p != m_end)
+            fail("unexpected trailing characters");
+    }
+
+private:
+    enum Wrapper {
+        NoWrapper,
+        Oid,
+        Symbol,
+        NumberInt,
+        NumberLong,
+        NumberDouble,
+        NumberDecimal,
+        Binary,
+        Code,
+        Timestamp,
+        RegularExpression,
+        DbPointer,
+        Date,
+        MinKey,
+        MaxKey,
+        Undefined
+    };
+
+    static const int maxDepth = 200;
+
+    [[noreturn]] void fail(const QString &message) const {
+        throw BSONexception(QString("Error in Extended JSON at offset %1: %2")
+                            .arg(m_p - m_begin).arg(message));
+    }
+
+    void skipSpace() {
+        while (m_p < m_end && (*m_p == ' ' || *m_p == '\n' ||
+                               *m_p == '\r' || *m_p == '\t'))
+            ++m_p;
+    }
+
+    bool consume(char c) {
+        skipSpace();
+        if (m_p < m_end && *m_p == c) {
+            ++m_p;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if (!consume(c))
+            fail(QString("'%1' expected").arg(QLatin1Char(c)));
+    }
+
+    bool consumeLiteral(const char *literal, size_t size) {
+        if (size_t(m_end - m_p) < size || memcmp(m_p, literal, size) != 0)
+            return false;
+        m_p += size;
+        return true;
+    }
+
+    void enter() {
+        if (++m_depth > maxDepth)
+            fail("nesting too deep");
+    }
+
+    void leave() { --m_depth; }
+
+    static int hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static void appendCodePoint(Writer &out, uint32_t c) {
+        if (c < 0x80) {
+            out.appendByte(uint8_t(c));
+        } else if (c < 0x800) {
+            out.appendByte(uint8_t(0xC0 | c >> 6));
+            out.appendByte(uint8_t(0x80 | (c & 0x3F)));
+        } else if (c < 0x10000) {
+            out.appendByte(uint8_t(0xE0 | c >> 12));
+            out.appendByte(uint8_t(0x80 | ((c >> 6) & 0x3F)));
+            out.appendByte(uint8_t(0x80 | (c & 0x3F)));
+        } else {
+            out.appendByte(uint8_t(0xF0 | c >> 18));
+            out.appendByte(uint8_t(0x80 | ((c >> 12) & 0x3F)));
+            out.appendByte(uint8_t(0x80 | ((c >> 6) & 0x3F)));
+            out.appendByte(uint8_t(0x80 | (c & 0x3F)));
+        }
+    }
+
+    uint32_t parseHex4() {
+        if (m_end - m_p < 4)
+            fail("invalid unicode escape");
+        uint32_t res = 0;
+        for (int i = 0; i < 4; ++i) {
+            const int v = hexValue(*m_p++);
+            if (v < 0)
+                fail("invalid unicode escape");
+            res = res << 4 | uint32_t(v);
+        }
+        return res;
+    }
+
+    ///
+    /// \brief parseString decodes a JSON string into \a out
+    /// \return number of bytes appended, nothing is terminated
+    ///
+    size_t parseString(Writer &out) {
+        skipSpace();
+        if (m_p >= m_end || *m_p != '"')
+            fail("string expected");
+        ++m_p;
+
+        const size_t start = out.size();
+        const char *run = m_p;
+        for (;;) {
+            if (m_p >= m_end)
+                fail("unterminated string");
+
+            const uint8_t c = uint8_t(*m_p);
+            if (c == '"') {
+                out.appendBytes(run, size_t(m_p - run));
+                ++m_p;
+                break;
+            }
+            if (c < 0x20)
+                fail("control character in string");
+            if (c != '\\') {
+                ++m_p;
+                continue;
+            }
+
+            out.appendBytes(run, size_t(m_p - run));
+            if (++m_p >= m_end)
+                fail("unterminated string");
+
+            switch (*m_p++) {
+            case '"': out.appendByte('"'); break;
+            case '\\': out.appendByte('\\'); break;
+            case '/': out.appendByte('/'); break;
+            case 'b': out.appendByte('\b'); break;
+            case 'f': out.appendByte('\f'); break;
+            case 'n': out.appendByte('\n'); break;
+            case 'r': out.appendByte('\r'); break;
+            case 't': out.appendByte('\t'); break;
+            case 'u': {
+                uint32_t code = parseHex4();
+                if (code >= 0xD800 && code < 0xDC00 && m_end - m_p >= 6 &&
+                        m_p[0] == '\\' && m_p[1] == 'u') {
+                    const char *save = m_p;
+                    m_p += 2;
+                    const uint32_t low = parseHex4();
+                    if (low >= 0xDC00 && low < 0xE000)
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    else
+                        m_p = save;
+                }
+                if (code >= 0xD800 && code < 0xE000)
+                    code = 0xFFFD;
+                appendCodePoint(out, code);
+            } break;
+            default:
+                --m_p;
+                fail("invalid escape");
+            }
+            run = m_p;
+        }
+
+        return out.size() - start;
+    }
+
+    ///
+    /// \brief parseScratch decodes a JSON string into the scratch buffer
+    ///
+    const char *parseScratch(Writer &scratch, size_t &size) {
+        scratch.clear();
+        size = parseString(scratch);
+        scratch.appendByte(0);
+        return (const char*) scratch.data();
+    }
+
+    bool parseFieldName(const char *name) {
+        size_t size;
+        const char *key = parseScratch(m_key, size);
+        expect(':');
+        return size == strlen(name) && memcmp(key, name, size) == 0;
+    }
+
+    void parseKey() {
+        const size_t start = m_w.size();
+        const size_t size = parseString(m_w);
+        if (memchr(m_w.data() + start, 0, size))
+            fail("zero character in key");
+        m_w.appendByte(0);
+    }
+
+    static bool toInt64(const char *p, size_t size, int64_t &value) {
+        if (!size)
+            return false;
+        const bool negative = *p == '-';
+        if (negative && --size == 0)
+            return false;
+        if (negative)
+            ++p;
+
+        uint64_t v = 0;
+        const uint64_t limit = negative
+                ? uint64_t(std::numeric_limits<int64_t>::max()) + 1
+                : uint64_t(std::numeric_limits<int64_t>::max());
+        for (size_t i = 0; i < size; ++i) {
+            if (p[i] < '0' || p[i] > '9')
+                return false;
+            const uint64_t digit = uint64_t(p[i] - '0');
+            if (v > (limit - digit) / 10)
+                return false;
+            v = v * 10 + digit;
+        }
+
+        value = negative ? int64_t(0 - v) : int64_t(v);
+        return true;
+    }
+
+    static bool toDouble(const char *p, size_t size, double &value) {
+        bool ok = false;
+        value = QByteArray::fromRawData(p, int(size)).toDouble(&ok);
+        return ok;
+    }
+
+    int64_t parseQuotedInt64() {
+        size_t size;
+        const char *text = parseScratch(m_scratch, size);
+        int64_t value;
+        if (!toInt64(text, size, value))
+            fail("integer expected");
+        return value;
+    }
+
+    void skipNumber() {
+        skipSpace();
+        if (m_p < m_end && *m_p == '-')
+            ++m_p;
+        while (m_p < m_end && ((*m_p >= '0' && *m_p <= '9') || *m_p == '.' ||
+                               *m_p == 'e' || *m_p == 'E' ||
+                               *m_p == '+' || *m_p == '-'))
+            ++m_p;
+    }
+
+    int64_t parseInt64() {
+        skipSpace();
+        const char *start = m_p;
+        skipNumber();
+        int64_t value;
+        if (!toInt64(start, size_t(m_p - start), value))
+            fail("integer expected");
+        return value;
+    }
+
+    uint32_t parseUInt32() {
+        const int64_t value = parseInt64();
+        if (value < 0 || value > int64_t(std::numeric_limits<uint32_t>::max()))
+            fail("unsigned 32 bit integer expected");
+        return uint32_t(value);
+    }
+
+    void parseNumber(size_t typePos) {
+        using bsoncxx::type;
+
+        const char *start = m_p;
+        skipNumber();
+        const size_t size = size_t(m_p - start);
+
+        int64_t integer;
+        if (toInt64(start, size, integer)) {
+            if (integer >= std::numeric_limits<int32_t>::min() &&
+                    integer <= std::numeric_limits<int32_t>::max()) {
+                m_w.setElementType(typePos, type::k_int32);
+                m_w.appendInt32(int32_t(integer));
+            } else {
+                m_w.setElementType(typePos, type::k_int64);
+                m_w.appendInt64(integer);
+            }
+            return;
+        }
+
+        double value;
+        if (!toDouble(start, size, value))
+            fail("number expected");
+        m_w.setElementType(typePos, type::k_double);
+        m_w.appendDouble(value);
+    }
+
+    bool parseIsoDate(const char *p, size_t size, int64_t &msecs) {
+        // YYYY-MM-DDTHH:MM:SS[.fff](Z|+HH:MM|-HH:MM|+HHMM|-HHMM)
+        const auto digits = [&p](size_t pos, int count, int &value) {
+            value = 0;
+            for (int i = 0; i < count; ++i) {
+                const char c = p[pos + size_t(i)];
+                if (c < '0' || c > '9')
+                    return false;
+                value = value * 10 + (c - '0');
+            }
+            return true;
+        };
+
+        int year, month, day, hour, minute, second, ms = 0;
+        if (size < 20 || p[4] != '-' || p[7] != '-' || p[10] != 'T' ||
+                p[13] != ':' || p[16] != ':' ||
+                !digits(0, 4, year) || !digits(5, 2, month) ||
+                !digits(8, 2, day) || !digits(11, 2, hour) ||
+                !digits(14, 2, minute) || !digits(17, 2, second))
+            return false;
+
+        size_t pos = 19;
+        if (p[pos] == '.') {
+            int scale = 100;
+            for (++pos; pos < size && p[pos] >= '0' && p[pos] <= '9'; ++pos) {
+                ms += (p[pos] - '0') * scale;
+                scale /= 10;
+            }
+        }
+
+        int offset = 0;
+        if (pos < size && p[pos] == 'Z') {
+            ++pos;
+        } else if (pos < size && (p[pos] == '+' || p[pos] == '-')) {
+            const int sign = p[pos] == '-' ? -1 : 1;
+            int hours, minutes;
+            if (size - pos == 6 && p[pos + 3] == ':' &&
+                    digits(pos + 1, 2, hours) && digits(pos + 4, 2, minutes))
+                pos += 6;
+            else if (size - pos == 5 &&
+                     digits(pos + 1, 2, hours) && digits(pos + 3, 2, minutes))
+                pos += 5;
+            else
+                return false;
+            offset = sign * (hours * 60 + minutes);
+        } else {
+            return false;
+        }
+
+        if (pos != size || month < 1 || month > 12 || day < 1 || day > 31 ||
+                hour > 23 || minute > 59 || second > 60)
+            return false;
+
+        const int64_t days = daysFromCivil(year, unsigned(month), unsigned(day));
+        msecs = ((days * 24 + hour) * 60 + minute - offset) * 60000 +
+                int64_t(second) * 1000 + ms;
+        return true;
+    }
+
+    static Wrapper wrapperKind(const char *key, size_t size) {
+        static const struct {
+            const char *name;
+            Wrapper wrapper;
+        } wrappers[] = {
+            {"$oid", Oid},
+            {"$symbol", Symbol},
+            {"$numberInt", NumberInt},
+            {"$numberLong", NumberLong},
+            {"$numberDouble", NumberDouble},
+            {"$numberDecimal", NumberDecimal},
+            {"$binary", Binary},
+            {"$code", Code},
+            {"$timestamp", Timestamp},
+            {"$regularExpression", RegularExpression},
+            {"$dbPointer", DbPointer},
+            {"$date", Date},
+            {"$minKey", MinKey},
+            {"$maxKey", MaxKey},
+            {"$undefined", Undefined}
+        };
+
+        for (const auto &w : wrappers) {
+            if (strlen(w.name) == size && memcmp(w.name, key, size) == 0)
+                return w.wrapper;
+        }
+        return NoWrapper;
+    }
+
+    void parseOid(uint8_t *bytes) {
+        size_t size;
+        const char *hex = parseScratch(m_scratch, size);
+        if (size != 24)
+            fail("ObjectId of 24 hex digits expected");
+        for (size_t i = 0; i < 12; ++i) {
+            const int high = hexValue(hex[2 * i]);
+            const int low = hexValue(hex[2 * i + 1]);
+            if (high < 0 || low < 0)
+                fail("ObjectId of 24 hex digits expected");
+            bytes[i] = uint8_t(high << 4 | low);
+        }
+    }
+
+    void parseStringValue() {
+        const size_t start = m_w.size();
+        m_w.appendInt32(0);
+        const size_t size = parseString(m_w);
+        m_w.appendByte(0);
+        m_w.patchInt32(start, int32_t(size + 1));
+    }
+
+    void parseBase64(Writer &out) {
+        size_t size;
+        const char *text = parseScratch(m_scratch, size);
+
+        uint32_t bits = 0;
+        int count = 0;
+        for (size_t i = 0; i < size && text[i] != '='; ++i) {
+            const char *digit = (const char*) memchr(base64Digits, text[i], 64);
+            if (!digit || !text[i])
+                fail("invalid base64");
+            bits = bits << 6 | uint32_t(digit - base64Digits);
+            if (++count == 4) {
+                out.appendByte(uint8_t(bits >> 16));
+                out.appendByte(uint8_t(bits >> 8));
+                out.appendByte(uint8_t(bits));
+                bits = 0;
+                count = 0;
+            }
+        }
+        if (count == 1)
+            fail("invalid base64");
+        if (count == 2) {
+            out.appendByte(uint8_t(bits >> 4));
+        } else if (count == 3) {
+            out.appendByte(uint8_t(bits >> 10));
+            out.appendByte(uint8_t(bits >> 2));
+        }
+    }
+
+    void parseWrapper(Wrapper wrapper, size_t typePos) {
+        using bsoncxx::type;
+
+        expect(':');
+
+        switch (wrapper) {
+        case Oid: {
+            uint8_t bytes[12];
+            parseOid(bytes);
+            m_w.setElementType(typePos, type::k_oid);
+            m_w.appendBytes(bytes, sizeof(bytes));
+        } break;
+        case Symbol:
+            m_w.setElementType(typePos, type::k_symbol);
+            parseStringValue();
+            break;
+        case NumberInt: {
+            const int64_t value = parseQuotedInt64();
+            if (value < std::numeric_limits<int32_t>::min() ||
+                    value > std::numeric_limits<int32_t>::max())
+                fail("32 bit integer expected");
+            m_w.setElementType(typePos, type::k_int32);
+            m_w.appendInt32(int32_t(value));
+        } break;
+        case NumberLong:
+            m_w.setElementType(typePos, type::k_int64);
+            m_w.appendInt64(parseQuotedInt64());
+            break;
+        case NumberDouble: {
+            size_t size;
+            const char *text = parseScratch(m_scratch, size);
+            double value;
+            if (strcmp(text, "Infinity") == 0)
+                value = std::numeric_limits<double>::infinity();
+            else if (strcmp(text, "-Infinity") == 0)
+                value = -std::numeric_limits<double>::infinity();
+            else if (strcmp(text, "NaN") == 0)
+                value = std::numeric_limits<double>::quiet_NaN();
+            else if (!toDouble(text, size, value))
+                fail("double expected");
+            m_w.setElementType(typePos, type::k_double);
+            m_w.appendDouble(value);
+        } break;
+        case NumberDecimal: {
+            size_t size;
+            const char *text = parseScratch(m_scratch, size);
+            try {
+                const bsoncxx::decimal128 value(bsoncxx::stdx::string_view(text, size));
+                m_w.setElementType(typePos, type::k_decimal128);
+                m_w.appendInt64(int64_t(value.low()));
+                m_w.appendInt64(int64_t(value.high()));
+            } catch (bsoncxx::exception &) {
+                fail("decimal128 expected");
+            }
+        } break;
+        case Binary: {
+            expect('{');
+            m_binary.clear();
+            int subType = -1;
+            bool data = false;
+            do {
+                size_t size;
+                const char *key = parseScratch(m_key, size);
+                expect(':');
+                if (strcmp(key, "base64") == 0) {
+                    parseBase64(m_binary);
+                    data = true;
+                } else if (strcmp(key, "subType") == 0) {
+                    const char *hex = parseScratch(m_scratch, size);
+                    if (size < 1 || size > 2)
+                        fail("binary subtype of two hex digits expected");
+                    subType = 0;
+                    for (size_t i = 0; i < size; ++i) {
+                        const int v = hexValue(hex[i]);
+                        if (v < 0)
+                            fail("binary subtype of two hex digits expected");
+                        subType = subType << 4 | v;
+                    }
+                } else {
+                    fail("base64 or subType expected");
+                }
+            } while (consume(','));
+            expect('}');
+            if (!data || subType < 0)
+                fail("base64 and subType expected");
+
+            m_w.setElementType(typePos, type::k_binary);
+            m_w.appendBinary(bsoncxx::binary_sub_type(subType),
+                             m_binary.data(), m_binary.size());
+        } break;
+        case Code: {
+            size_t size;
+            parseScratch(m_binary, size);
+            if (!consume(',')) {
+                m_w.setElementType(typePos, type::k_code);
+                m_w.appendString((const char*) m_binary.data(), size);
+                break;
+            }
+
+            if (!parseFieldName("$scope"))
+                fail("$scope expected");
+            m_w.setElementType(typePos, type::k_codewscope);
+            const size_t start = m_w.size();
+            m_w.appendInt32(0);
+            m_w.appendString((const char*) m_binary.data(), size);
+            expect('{');
+            enter();
+            parseMembers();
+            leave();
+            m_w.patchInt32(start, int32_t(m_w.size() - start));
+        } break;
+        case Timestamp: {
+            expect('{');
+            int64_t t = -1, i = -1;
+            do {
+                size_t size;
+                const char *key = parseScratch(m_key, size);
+                expect(':');
+                if (strcmp(key, "t") == 0)
+                    t = parseUInt32();
+                else if (strcmp(key, "i") == 0)
+                    i = parseUInt32();
+                else
+                    fail("t or i expected");
+            } while (consume(','));
+            expect('}');
+            if (t < 0 || i < 0)
+                fail("t and i expected");
+
+            m_w.setElementType(typePos, type::k_timestamp);
+            m_w.appendInt32(int32_t(uint32_t(i)));
+            m_w.appendInt32(int32_t(uint32_t(t)));
+        } break;
+        case RegularExpression: {
+            expect('{');
+            m_binary.clear();
+            m_scratch.clear();
+            bool pattern = false, options = false;
+            do {
+                size_t size;
+                const char *key = parseScratch(m_key, size);
+                expect(':');
+                Writer *target;
+                if (strcmp(key, "pattern") == 0) {
+                    target = &m_binary;
+                    pattern = true;
+                } else if (strcmp(key, "options") == 0) {
+                    target = &m_scratch;
+                    options = true;
+                } else {
+                    fail("pattern or options expected");
+                }
+                target->clear();
+                size = parseString(*target);
+                if (memchr(target->data(), 0, size))
+                    fail("zero character in regular expression");
+            } while (consume(','));
+            expect('}');
+            if (!pattern || !options)
+                fail("pattern and options expected");
+
+            m_w.setElementType(typePos, type::k_regex);
+            m_w.appendCString((const char*) m_binary.data(), m_binary.size());
+            m_w.appendCString((const char*) m_scratch.data(), m_scratch.size());
+        } break;
+        case DbPointer: {
+            expect('{');
+            m_binary.clear();
+            uint8_t id[12];
+            bool ref = false, hasId = false;
+            do {
+                size_t size;
+                const char *key = parseScratch(m_key, size);
+                expect(':');
+                if (strcmp(key, "$ref") == 0) {
+                    m_binary.clear();
+                    parseString(m_binary);
+                    ref = true;
+                } else if (strcmp(key, "$id") == 0) {
+                    expect('{');
+                    if (!parseFieldName("$oid"))
+                        fail("$oid expected");
+                    parseOid(id);
+                    expect('}');
+                    hasId = true;
+                } else {
+                    fail("$ref or $id expected");
+                }
+            } while (consume(','));
+            expect('}');
+            if (!ref || !hasId)
+                fail("$ref and $id expected");
+
+            m_w.setElementType(typePos, type::k_dbpointer);
+            m_w.appendString((const char*) m_binary.data(), m_binary.size());
+            m_w.appendBytes(id, sizeof(id));
+        } break;
+        case Date: {
+            int64_t msecs;
+            skipSpace();
+            if (m_p < m_end && *m_p == '{') {
+                ++m_p;
+                if (!parseFieldName("$numberLong"))
+                    fail("$numberLong expected");
+                msecs = parseQuotedInt64();
+                expect('}');
+            } else if (m_p < m_end && *m_p == '"') {
+                size_t size;
+                const char *text = parseScratch(m_scratch, size);
+                if (!parseIsoDate(text, size, msecs))
+                    fail("ISO 8601 date expected");
+            } else {
+                msecs = parseInt64();
+            }
+            m_w.setElementType(typePos, type::k_date);
+            m_w.appendInt64(msecs);
+        } break;
+        case MinKey:
+            parseInt64();
+            m_w.setElementType(typePos, type::k_minkey);
+            break;
+        case MaxKey:
+            parseInt64();
+            m_w.setElementType(typePos, type::k_maxkey);
+            break;
+        case Undefined:
+            skipSpace();
+            if (!consumeLiteral("true", 4))
+                fail("true expected");
+            m_w.setElementType(typePos, type::k_undefined);
+            break;
+        case NoWrapper:
+            break;
+        }
+
+        expect('}');
+    }
+
+    ///
+    /// \brief parseMembers parses the members of an object whose '{' is consumed
+    ///
+    void parseMembers() {
+        const size_t start = m_w.beginDocument();
+        if (!consume('}')) {
+            do {
+                const size_t typePos = m_w.size();
+                m_w.appendByte(0);
+                parseKey();
+                expect(':');
+                parseValue(typePos);
+            } while (consume(','));
+            expect('}');
+        }
+        m_w.endDocument(start);
+    }
+
+    void parseObject(size_t typePos) {
+        using bsoncxx::type;
+
+        enter();
+
+        const size_t start = m_w.beginDocument();
+        if (consume('}')) {
+            m_w.setElementType(typePos, type::k_document);
+            m_w.endDocument(start);
+            leave();
+            return;
+        }
+
+        // the first key decides whether this is a type wrapper
+        const size_t keyTypePos = m_w.size();
+        m_w.appendByte(0);
+        const size_t keyStart = m_w.size();
+        parseKey();
+        const size_t keySize = m_w.size() - keyStart - 1;
+
+        if (keySize > 1 && m_w.data()[keyStart] == '$') {
+            const Wrapper wrapper =
+                    wrapperKind((const char*) m_w.data() + keyStart, keySize);
+            if (wrapper != NoWrapper) {
+                m_w.truncate(start);
+                parseWrapper(wrapper, typePos);
+                leave();
+                return;
+            }
+        }
+
+        m_w.setElementType(typePos, type::k_document);
+        expect(':');
+        parseValue(keyTypePos);
+        while (consume(',')) {
+            const size_t elementPos = m_w.size();
+            m_w.appendByte(0);
+            parseKey();
+            expect(':');
+            parseValue(elementPos);
+        }
+        expect('}');
+        m_w.endDocument(start);
+
+        leave();
+    }
+
+    void parseArray() {
+        enter();
+
+        const size_t start = m_w.beginDocument();
+        if (!consume(']')) {
+            uint32_t index = 0;
+            do {
+                parseValue(m_w.beginIndexElement(index++));
+            } while (consume(','));
+            expect(']');
+        }
+        m_w.endDocument(start);
+
+        leave();
+    }
+
+    void parseValue(size_t typePos) {
+        using bsoncxx::type;
+
+        skipSpace();
+        if (m_p >= m_end)
+            fail("value expected");
+
+        switch (*m_p) {
+        case '{':
+            ++m_p;
+            parseObject(typePos);
+            return;
+        case '[':
+            ++m_p;
+            m_w.setElementType(typePos, type::k_array);
+            parseArray();
+            return;
+        case '"':
+            m_w.setElementType(typePos, type::k_utf8);
+            parseStringValue();
+            return;
+        case 't':
+            if (!consumeLiteral("true", 4))
+                fail("value expected");
+            m_w.setElementType(typePos, type::k_bool);
+            m_w.appendByte(1);
+            return;
+        case 'f':
+            if (!consumeLiteral("false", 5))
+                fail("value expected");
+            m_w.setElementType(typePos, type::k_bool);
+            m_w.appendByte(0);
+            return;
+        case 'n':
+            if (!consumeLiteral("null", 4))
+                fail("value expected");
+            m_w.setElementType(typePos, type::k_null);
+            return;
+        default:
+            if (*m_p != '-' && (*m_p < '0' || *m_p > '9'))
+                fail("value expected");
+            parseNumber(typePos);
+            return;
+        }
+    }
+
+    const char *m_begin;
+    const char *m_p;
+    const char *m_end;
+    Writer &m_w;
+    Writer m_key;
+    Writer m_scratch;
+    Writer m_binary;
+    int m_depth;
+};
+
+}
+
+void toExtendedJson(const bsoncxx::document::view &bson, Writer &out,
+                    ExtendedJsonMode mode)
+{
+    const size_t start = out.size();
+    try {
+        _private::writeExtendedDocument(out, bson.data(), bson.length(), false,
+                                        mode == ExtendedJsonMode::Relaxed);
+    } catch (...) {
+        out.truncate(start);
+        throw;
+    }
+}
+
+QByteArray toExtendedJson(const bsoncxx::document::view &bson,
+                          ExtendedJsonMode mode, bool &ok)
+noexcept
+{
+    try {
+        return toExtendedJson(bson, mode);
+    } catch (...) {
+        ok = false;
+        return QByteArray();
+    }
+}
+
+QByteArray toExtendedJson(const bsoncxx::document::view &bson,
+                          ExtendedJsonMode mode)
+{
+    Writer out;
+    toExtendedJson(bson, out, mode);
+    return QByteArray((const char*) out.data(), int(out.size()));
+}
+
+void fromExtendedJson(const char *data, size_t size, Writer &writer)
+{
+    const size_t start = writer.size();
+    try {
+        _private::ExtendedJsonParser(data, size, writer).parse();
+    } catch (...) {
+        writer.truncate(start);
+        throw;
+    }
+}
+
+bsoncxx::document::value fromExtendedJson(const QByteArray &json, bool &ok)
+noexcept
+{
+    try {
+        return fromExtendedJson(json);
+    } catch (...) {
+        ok = false;
+        return _private::emptyDocumentValue();
+    }
+}
+
+bsoncxx::document::value fromExtendedJson(const QByteArray &json)
+{
+    Writer writer;
+    fromExtendedJson(json.constData(), size_t(json.size()), writer);
+
+    const size_t length = writer.size();
+    return bsoncxx::document::value(writer.release(), length,
+                                    &Writer::freeBuffer);
+}
+
+}
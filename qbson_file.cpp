@@ -0,0 +1,595 @@
+#include "qbson_file.h"
+#include "qbson.h"
+
+#include <QSaveFile>
+#include <QtEndian>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+/// bytes kept mapped behind the read position with the sequential hint
+const qint64 releaseWindow = 64 * 1024 * 1024;
+
+//
+// Sidecar layout, all integers little endian unless noted:
+//   magic "QBSONIDX", uint32 version, uint32 flags (1: has ids),
+//   uint64 count, uint64 id count, uint64 size of the BSON file,
+//   uint64 reserved, then count uint64 document offsets by ordinal,
+//   then the id records sorted by kind, key and length.
+//
+const char indexMagic[8] = {'Q', 'B', 'S', 'O', 'N', 'I', 'D', 'X'};
+const quint32 indexVersion = 1;
+const quint32 indexHasIds = 1;
+const qint64 indexHeaderSize = 48;
+
+enum IdKind : uchar { IntId = 1, StringId = 2, OidId = 3 };
+
+///
+/// \brief The IdRecord struct is one sorted _id entry of the sidecar
+///
+/// Records are ordered by a memcmp over kind, key and length. Integers
+/// are stored big endian with the sign bit flipped, so that byte order
+/// is numeric order.
+///
+struct IdRecord {
+    uchar kind;
+    /// integer, ObjectId or the first 16 bytes of a UTF-8 string, zero padded
+    uchar key[16];
+    /// big endian byte length of a string id
+    uchar length[4];
+    uchar reserved[3];
+    /// little endian document offset
+    uchar offset[8];
+};
+
+static_assert(sizeof(IdRecord) == 32, "IdRecord must be 32 bytes");
+
+const size_t idKeySize = 21;
+
+bool idLess(const IdRecord &a, const IdRecord &b) {
+    return memcmp(&a, &b, idKeySize) < 0;
+}
+
+void setIntId(IdRecord &rec, qint64 id) {
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = IntId;
+    qToBigEndian(quint64(id) ^ (quint64(1) << 63), rec.key);
+}
+
+void setStringId(IdRecord &rec, const char *data, size_t size) {
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = StringId;
+    memcpy(rec.key, data, qMin(size, sizeof(rec.key)));
+    qToBigEndian(quint32(size), rec.length);
+}
+
+void setOidId(IdRecord &rec, const uchar *oid) {
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = OidId;
+    memcpy(rec.key, oid, 12);
+}
+
+bool makeIdRecord(const BSON::Element &e, IdRecord &rec) {
+    using bsoncxx::type;
+
+    switch (e.type) {
+    case type::k_int32:
+        setIntId(rec, e.int32());
+        return true;
+    case type::k_int64:
+        setIntId(rec, e.int64());
+        return true;
+    case type::k_utf8:
+        setStringId(rec, e.string(), e.stringSize());
+        return true;
+    case type::k_oid:
+        setOidId(rec, e.value);
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool makeIdRecord(const QVariant &id, IdRecord &rec, QByteArray &utf8) {
+    switch (id.userType()) {
+    case QMetaType::Int:
+    case QMetaType::UInt:
+    case QMetaType::LongLong:
+        setIntId(rec, id.toLongLong());
+        return true;
+    case QMetaType::ULongLong:
+        if (id.toULongLong() > quint64(std::numeric_limits<qint64>::max()))
+            return false;
+        setIntId(rec, id.toLongLong());
+        return true;
+    case QMetaType::QString:
+        utf8 = id.toString().toUtf8();
+        setStringId(rec, utf8.constData(), size_t(utf8.size()));
+        return true;
+    default:
+        break;
+    }
+
+    if (id.userType() == qMetaTypeId<BSONoid>()) {
+        setOidId(rec, id.value<BSONoid>().data());
+        return true;
+    }
+    return false;
+}
+
+///
+/// \brief findId looks up the _id element of a document
+///
+bool findId(const bsoncxx::document::view &view, BSON::Element &e) {
+    BSON::ElementReader reader(view.data(), view.length());
+    while (reader.next(e)) {
+        if (e.keyEquals("_id", 3))
+            return true;
+    }
+    return false;
+}
+
+}
+
+BSONFileReader::BSONFileReader(const QString &fileName)
+    : m_file(fileName),
+      m_data(nullptr),
+      m_size(0),
+      m_pos(0),
+      m_released(0),
+      m_open(false),
+      m_error(false),
+      m_sequential(false)
+{
+}
+
+BSONFileReader::~BSONFileReader()
+{
+    close();
+}
+
+bool BSONFileReader::open()
+{
+    close();
+
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        m_errorString = m_file.errorString();
+        return false;
+    }
+
+    m_size = m_file.size();
+    if (m_size > 0) {
+        m_data = m_file.map(0, m_size);
+        if (!m_data) {
+            m_errorString = m_file.errorString();
+            m_file.close();
+            m_size = 0;
+            return false;
+        }
+    }
+
+    m_open = true;
+    m_errorString.clear();
+
+    if (m_sequential)
+        adviseSequential();
+
+    return true;
+}
+
+void BSONFileReader::close()
+{
+    if (m_data)
+        m_file.unmap(m_data);
+    if (m_file.isOpen())
+        m_file.close();
+
+    m_data = nullptr;
+    m_size = 0;
+    m_pos = 0;
+    m_released = 0;
+    m_open = false;
+    m_error = false;
+}
+
+void BSONFileReader::setSequentialHint(bool enabled)
+{
+    m_sequential = enabled;
+    if (m_sequential && m_open)
+        adviseSequential();
+}
+
+bool BSONFileReader::seek(qint64 offset)
+{
+    if (!m_open || offset < 0 || offset > m_size)
+        return false;
+
+    m_pos = offset;
+    m_error = false;
+
+#ifdef Q_OS_UNIX
+    const qint64 page = sysconf(_SC_PAGESIZE);
+    m_released = offset / page * page;
+#endif
+
+    return true;
+}
+
+bool BSONFileReader::next(bsoncxx::document::view &view)
+{
+    if (!m_open || m_error || m_pos >= m_size)
+        return false;
+
+    const size_t length = BSON::documentSize(m_data + m_pos,
+                                             size_t(m_size - m_pos));
+    if (!length) {
+        m_error = true;
+        return false;
+    }
+
+    view = bsoncxx::document::view(m_data + m_pos, length);
+    m_pos += qint64(length);
+
+    if (m_sequential)
+        releaseConsumed();
+
+    return true;
+}
+
+bool BSONFileReader::next(QVariantMap &doc)
+{
+    bsoncxx::document::view view;
+    if (!next(view))
+        return false;
+
+    doc = BSON::fromBson(view.data(), view.length());
+    return true;
+}
+
+bool BSONFileReader::documentAt(qint64 offset,
+                                bsoncxx::document::view &view) const
+{
+    if (!m_open || offset < 0 || offset >= m_size)
+        return false;
+
+    const size_t length = BSON::documentSize(m_data + offset,
+                                             size_t(m_size - offset));
+    if (!length)
+        return false;
+
+    view = bsoncxx::document::view(m_data + offset, length);
+    return true;
+}
+
+void BSONFileReader::adviseSequential()
+{
+#ifdef Q_OS_UNIX
+    if (m_data)
+        madvise(m_data, size_t(m_size), MADV_SEQUENTIAL);
+#endif
+}
+
+void BSONFileReader::releaseConsumed()
+{
+#ifdef Q_OS_UNIX
+    // pages of a shared read-only file mapping fault back in from the
+    // page cache if a view behind the window is still touched
+    const qint64 page = sysconf(_SC_PAGESIZE);
+    const qint64 target = (m_pos - releaseWindow) / page * page;
+    if (target - m_released >= releaseWindow) {
+        madvise(m_data + m_released, size_t(target - m_released),
+                MADV_DONTNEED);
+        m_released = target;
+    }
+#endif
+}
+
+BSONStreamWriter::BSONStreamWriter(QIODevice *device, int bufferSize)
+    : m_device(device),
+      m_bytesWritten(0),
+      m_documentsWritten(0),
+      m_bufferSize(qMax(bufferSize, 1024)),
+      m_syncPolicy(NoSync)
+{
+    m_buffer.reserve(size_t(m_bufferSize));
+}
+
+BSONStreamWriter::~BSONStreamWriter()
+{
+    close();
+}
+
+bool BSONStreamWriter::write(const QVariantMap &doc)
+{
+    BSON::toBson(doc, m_buffer);
+    ++m_documentsWritten;
+
+    if (m_buffer.size() >= size_t(m_bufferSize))
+        return flush();
+    return true;
+}
+
+bool BSONStreamWriter::write(const bsoncxx::document::view &doc)
+{
+    m_buffer.appendBytes(doc.data(), doc.length());
+    ++m_documentsWritten;
+
+    if (m_buffer.size() >= size_t(m_bufferSize))
+        return flush();
+    return true;
+}
+
+bool BSONStreamWriter::flush()
+{
+    if (!m_device) {
+        m_errorString = QStringLiteral("BSONStreamWriter without device");
+        return false;
+    }
+
+    const char *data = (const char*) m_buffer.data();
+    qint64 remaining = qint64(m_buffer.size());
+
+    while (remaining > 0) {
+        const qint64 written = m_device->write(data, remaining);
+        if (written <= 0) {
+            m_errorString = m_device->errorString();
+            // keep what was not written for a retry
+            m_buffer.discardFront(m_buffer.size() - size_t(remaining));
+            return false;
+        }
+        data += written;
+        remaining -= written;
+        m_bytesWritten += written;
+    }
+
+    m_buffer.clear();
+
+    if (m_syncPolicy == SyncOnFlush)
+        return sync();
+    return true;
+}
+
+bool BSONStreamWriter::close()
+{
+    if (!m_device)
+        return true;
+
+    if (!flush())
+        return false;
+
+    if (m_syncPolicy == SyncOnClose)
+        return sync();
+    return true;
+}
+
+bool BSONStreamWriter::sync()
+{
+    QFileDevice *file = qobject_cast<QFileDevice*>(m_device);
+    if (!file)
+        return true;
+
+    if (!file->flush()) {
+        m_errorString = file->errorString();
+        return false;
+    }
+
+#ifdef Q_OS_UNIX
+    if (file->handle() >= 0 && fsync(file->handle()) != 0) {
+        m_errorString = QStringLiteral("BSONStreamWriter fsync failed");
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+BSONFileIndex::BSONFileIndex(const QString &fileName, const QString &indexFileName)
+    : m_reader(fileName),
+      m_indexFile(indexFileName),
+      m_index(nullptr),
+      m_count(0),
+      m_offsets(nullptr),
+      m_ids(nullptr),
+      m_idCount(0)
+{
+}
+
+BSONFileIndex::~BSONFileIndex()
+{
+    close();
+}
+
+bool BSONFileIndex::build(const QString &fileName, const QString &indexFileName,
+                          bool withIds, QString *errorString)
+{
+    auto fail = [errorString](const QString &message) {
+        if (errorString)
+            *errorString = message;
+        return false;
+    };
+
+    BSONFileReader reader(fileName);
+    if (!reader.open())
+        return fail(reader.errorString());
+    reader.setSequentialHint(true);
+
+    std::vector<quint64> offsets;
+    std::vector<IdRecord> ids;
+
+    bsoncxx::document::view view;
+    qint64 offset = reader.pos();
+    while (reader.next(view)) {
+        offsets.push_back(qToLittleEndian(quint64(offset)));
+
+        BSON::Element e;
+        IdRecord rec;
+        if (withIds && findId(view, e) && makeIdRecord(e, rec)) {
+            qToLittleEndian(quint64(offset), rec.offset);
+            ids.push_back(rec);
+        }
+        offset = reader.pos();
+    }
+    if (reader.hasError())
+        return fail(QStringLiteral("BSONFileIndex corrupt document at offset %1").arg(offset));
+
+    // equal ids keep the file order
+    std::stable_sort(ids.begin(), ids.end(), &idLess);
+
+    uchar header[indexHeaderSize] = {};
+    memcpy(header, indexMagic, sizeof(indexMagic));
+    qToLittleEndian(indexVersion, header + 8);
+    qToLittleEndian(withIds ? indexHasIds : quint32(0), header + 12);
+    qToLittleEndian(quint64(offsets.size()), header + 16);
+    qToLittleEndian(quint64(ids.size()), header + 24);
+    qToLittleEndian(quint64(reader.size()), header + 32);
+
+    QSaveFile out(indexFileName);
+    if (!out.open(QIODevice::WriteOnly))
+        return fail(out.errorString());
+
+    const qint64 offsetBytes = qint64(offsets.size() * sizeof(quint64));
+    const qint64 idBytes = qint64(ids.size() * sizeof(IdRecord));
+    if (out.write((const char*) header, indexHeaderSize) != indexHeaderSize
+            || out.write((const char*) offsets.data(), offsetBytes) != offsetBytes
+            || out.write((const char*) ids.data(), idBytes) != idBytes
+            || !out.commit())
+        return fail(out.errorString());
+
+    return true;
+}
+
+bool BSONFileIndex::open()
+{
+    close();
+
+    if (!m_reader.open()) {
+        m_errorString = m_reader.errorString();
+        return false;
+    }
+
+    auto fail = [this](const QString &message) {
+        m_errorString = message;
+        close();
+        return false;
+    };
+
+    if (!m_indexFile.open(QIODevice::ReadOnly))
+        return fail(m_indexFile.errorString());
+
+    const qint64 size = m_indexFile.size();
+    if (size < indexHeaderSize)
+        return fail(QStringLiteral("BSONFileIndex truncated index file"));
+
+    m_index = m_indexFile.map(0, size);
+    if (!m_index)
+        return fail(m_indexFile.errorString());
+
+    if (memcmp(m_index, indexMagic, sizeof(indexMagic)) != 0
+            || qFromLittleEndian<quint32>(m_index + 8) != indexVersion)
+        return fail(QStringLiteral("BSONFileIndex unknown index format"));
+
+    const quint32 flags = qFromLittleEndian<quint32>(m_index + 12);
+    const quint64 count = qFromLittleEndian<quint64>(m_index + 16);
+    const quint64 idCount = qFromLittleEndian<quint64>(m_index + 24);
+    const quint64 dataSize = qFromLittleEndian<quint64>(m_index + 32);
+
+    if (dataSize != quint64(m_reader.size()))
+        return fail(QStringLiteral("BSONFileIndex index does not match the BSON file"));
+
+    // each document takes at least 5 bytes, which bounds both counts
+    if (count > dataSize / 5 || idCount > count
+            || quint64(size) != quint64(indexHeaderSize) + count * sizeof(quint64)
+                                + idCount * sizeof(IdRecord))
+        return fail(QStringLiteral("BSONFileIndex truncated index file"));
+
+    m_count = qint64(count);
+    m_offsets = m_index + indexHeaderSize;
+    if (flags & indexHasIds) {
+        m_ids = m_offsets + count * sizeof(quint64);
+        m_idCount = qint64(idCount);
+    }
+
+    m_errorString.clear();
+    return true;
+}
+
+void BSONFileIndex::close()
+{
+    if (m_index)
+        m_indexFile.unmap(m_index);
+    if (m_indexFile.isOpen())
+        m_indexFile.close();
+    m_reader.close();
+
+    m_index = nullptr;
+    m_count = 0;
+    m_offsets = nullptr;
+    m_ids = nullptr;
+    m_idCount = 0;
+}
+
+bool BSONFileIndex::documentAt(qint64 ordinal, bsoncxx::document::view &view) const
+{
+    if (!m_index || ordinal < 0 || ordinal >= m_count)
+        return false;
+
+    const quint64 offset = qFromLittleEndian<quint64>(m_offsets + ordinal * 8);
+    return m_reader.documentAt(qint64(offset), view);
+}
+
+bool BSONFileIndex::documentAt(qint64 ordinal, QVariantMap &doc) const
+{
+    bsoncxx::document::view view;
+    if (!documentAt(ordinal, view))
+        return false;
+
+    doc = BSON::fromBson(view.data(), view.length());
+    return true;
+}
+
+bool BSONFileIndex::find(const QVariant &id, bsoncxx::document::view &view) const
+{
+    if (!m_ids)
+        return false;
+
+    IdRecord probe;
+    QByteArray utf8;
+    if (!makeIdRecord(id, probe, utf8))
+        return false;
+
+    const IdRecord *begin = (const IdRecord*) m_ids;
+    const IdRecord *end = begin + m_idCount;
+    for (const IdRecord *it = std::lower_bound(begin, end, probe, &idLess);
+         it != end && memcmp(it, &probe, idKeySize) == 0; ++it) {
+        const quint64 offset = qFromLittleEndian<quint64>(it->offset);
+        if (!m_reader.documentAt(qint64(offset), view))
+            continue;
+        if (probe.kind != StringId || size_t(utf8.size()) <= sizeof(probe.key))
+            return true;
+
+        // same prefix and length, compare the whole string
+        BSON::Element e;
+        if (findId(view, e) && e.type == bsoncxx::type::k_utf8
+                && memcmp(e.string(), utf8.constData(), size_t(utf8.size())) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool BSONFileIndex::find(const QVariant &id, QVariantMap &doc) const
+{
+    bsoncxx::document::view view;
+    if (!find(id, view))
+        return false;
+
+    doc = BSON::fromBson(view.data(), view.length());
+    return true;
+}
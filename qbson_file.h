@@ -0,0 +1,302 @@
+#ifndef QBSON_FILE_H
+#define QBSON_FILE_H
+
+#include <QFile>
+#include <QString>
+#include <QVariantMap>
+
+#include <bsoncxx/document/view.hpp>
+
+#include "qbson_writer.h"
+
+class QIODevice;
+
+///
+/// \brief The BSONFileReader class reads concatenated BSON documents, e.g.
+/// mongodump .bson files, from a memory mapped file
+///
+/// Document boundaries are found from the length prefixes and documents
+/// are returned as views into the mapping, nothing is copied. With the
+/// sequential hint the kernel reads ahead and pages behind the read
+/// position are released, so resident memory stays constant however
+/// large the file is. Views are valid until the reader is closed.
+///
+class BSONFileReader
+{
+public:
+    ///
+    /// \brief The const_iterator class walks the remaining documents
+    ///
+    class const_iterator
+    {
+    public:
+        const_iterator() : m_reader(nullptr) {}
+
+        const bsoncxx::document::view &operator*() const { return m_view; }
+        const bsoncxx::document::view *operator->() const { return &m_view; }
+
+        const_iterator &operator++() {
+            if (m_reader && !m_reader->next(m_view))
+                m_reader = nullptr;
+            return *this;
+        }
+
+        bool operator==(const const_iterator &other) const {
+            return m_reader == other.m_reader &&
+                    (!m_reader || m_view.data() == other.m_view.data());
+        }
+        bool operator!=(const const_iterator &other) const {
+            return !(*this == other);
+        }
+
+    private:
+        friend class BSONFileReader;
+        explicit const_iterator(BSONFileReader *reader) : m_reader(reader) {
+            ++(*this);
+        }
+
+        BSONFileReader *m_reader;
+        bsoncxx::document::view m_view;
+    };
+
+    explicit BSONFileReader(const QString &fileName);
+    ~BSONFileReader();
+
+    ///
+    /// \brief open maps the file read-only
+    /// \return false on error, see errorString()
+    ///
+    bool open();
+    void close();
+    bool isOpen() const { return m_open; }
+    QString errorString() const { return m_errorString; }
+
+    ///
+    /// \brief setSequentialHint advises the kernel of sequential access
+    ///
+    /// Enables read-ahead and releases pages behind the read position.
+    /// No-op on platforms without madvise.
+    ///
+    void setSequentialHint(bool enabled);
+    bool sequentialHint() const { return m_sequential; }
+
+    qint64 size() const { return m_size; }
+    const uchar *data() const { return m_data; }
+
+    ///
+    /// \brief pos
+    /// \return byte offset of the next document
+    ///
+    qint64 pos() const { return m_pos; }
+
+    ///
+    /// \brief seek resumes reading at \a offset, which must be a document boundary
+    /// \return false if \a offset is outside of the file
+    ///
+    bool seek(qint64 offset);
+
+    bool atEnd() const { return m_pos >= m_size; }
+
+    ///
+    /// \brief hasError
+    /// \return true if reading stopped at a truncated or corrupt length prefix
+    ///
+    bool hasError() const { return m_error; }
+
+    ///
+    /// \brief next returns a view of the next document
+    /// \return false at the end of the file or on error
+    ///
+    bool next(bsoncxx::document::view &view);
+
+    ///
+    /// \brief next decodes the next document
+    /// \throw BSONexception if the document can not be decoded
+    /// \return false at the end of the file or on error
+    ///
+    bool next(QVariantMap &doc);
+
+    ///
+    /// \brief documentAt returns the document at \a offset without moving pos()
+    /// \return false if no complete document starts at \a offset
+    ///
+    bool documentAt(qint64 offset, bsoncxx::document::view &view) const;
+
+    const_iterator begin() { return const_iterator(this); }
+    const_iterator end() { return const_iterator(); }
+
+private:
+    void adviseSequential();
+    void releaseConsumed();
+
+    QFile m_file;
+    QString m_errorString;
+    uchar *m_data;
+    qint64 m_size;
+    qint64 m_pos;
+    qint64 m_released;
+    bool m_open;
+    bool m_error;
+    bool m_sequential;
+};
+
+///
+/// \brief The BSONStreamWriter class buffers encoded documents and writes
+/// them to a QIODevice in large chunks
+///
+/// Documents are encoded straight into one reusable buffer, which is
+/// written to the device whenever it reaches bufferSize(). The writer
+/// does not own the device, it must stay open while the writer is used.
+/// The destructor calls close().
+///
+class BSONStreamWriter
+{
+public:
+    enum SyncPolicy {
+        /// leave durability to the device and the operating system
+        NoSync,
+        /// fsync a file device after every flush()
+        SyncOnFlush,
+        /// fsync a file device once in close()
+        SyncOnClose
+    };
+
+    explicit BSONStreamWriter(QIODevice *device,
+                              int bufferSize = 4 * 1024 * 1024);
+    ~BSONStreamWriter();
+
+    BSONStreamWriter(const BSONStreamWriter &) = delete;
+    BSONStreamWriter &operator=(const BSONStreamWriter &) = delete;
+
+    QIODevice *device() const { return m_device; }
+    int bufferSize() const { return m_bufferSize; }
+
+    void setSyncPolicy(SyncPolicy policy) { m_syncPolicy = policy; }
+    SyncPolicy syncPolicy() const { return m_syncPolicy; }
+
+    ///
+    /// \brief write encodes \a doc into the buffer, flushing it when full
+    /// \throw BSONexception on unsupported value, nothing is buffered then
+    /// \return false on device error, see errorString()
+    ///
+    bool write(const QVariantMap &doc) noexcept(false);
+    bool write(const bsoncxx::document::view &doc);
+
+    ///
+    /// \brief flush writes the buffer to the device
+    /// \return false on device error, see errorString()
+    ///
+    bool flush();
+
+    ///
+    /// \brief close flushes and applies SyncOnClose, the device stays open
+    ///
+    bool close();
+
+    /// bytes handed to the device so far
+    qint64 bytesWritten() const { return m_bytesWritten; }
+    /// documents accepted so far, buffered or written
+    qint64 documentsWritten() const { return m_documentsWritten; }
+    /// bytes waiting in the buffer
+    qint64 pendingBytes() const { return qint64(m_buffer.size()); }
+
+    QString errorString() const { return m_errorString; }
+
+private:
+    bool sync();
+
+    QIODevice *m_device;
+    BSON::Writer m_buffer;
+    QString m_errorString;
+    qint64 m_bytesWritten;
+    qint64 m_documentsWritten;
+    int m_bufferSize;
+    SyncPolicy m_syncPolicy;
+};
+
+///
+/// \brief The BSONFileIndex class gives random access to the documents of
+/// a concatenated BSON file through a sorted sidecar file
+///
+/// build() scans the BSON file once and writes the sidecar: a header, the
+/// offset of every document by ordinal and, optionally, one fixed size
+/// record per document with an ObjectId, string or integer _id, sorted by
+/// _id. int32 and int64 ids of the same value are equal. Documents with
+/// other _id types are only reachable by ordinal.
+///
+/// open() maps both files read-only. Lookup by ordinal is one read of
+/// the offset table, lookup by _id a binary search over the records. Ids
+/// are compared on a 16 byte prefix, longer string ids sharing a prefix
+/// are told apart by reading their documents. The sidecar records the
+/// size of the BSON file and is refused if it does not match.
+///
+/// All const lookups are safe from several threads.
+///
+class BSONFileIndex
+{
+public:
+    BSONFileIndex(const QString &fileName, const QString &indexFileName);
+    ~BSONFileIndex();
+
+    BSONFileIndex(const BSONFileIndex &) = delete;
+    BSONFileIndex &operator=(const BSONFileIndex &) = delete;
+
+    ///
+    /// \brief build scans \a fileName and writes the sidecar \a indexFileName
+    /// \param withIds also index the _id of every document
+    /// \param errorString receives the reason on not success
+    /// \return false on I/O error or a corrupt BSON file
+    ///
+    static bool build(const QString &fileName, const QString &indexFileName,
+                      bool withIds = true, QString *errorString = nullptr);
+
+    ///
+    /// \brief open maps the BSON file and the sidecar
+    /// \return false on error, see errorString()
+    ///
+    bool open();
+    void close();
+    bool isOpen() const { return m_index != nullptr; }
+    QString errorString() const { return m_errorString; }
+
+    qint64 count() const { return m_count; }
+    bool hasIds() const { return m_ids != nullptr; }
+
+    ///
+    /// \brief documentAt returns the document number \a ordinal, counted from 0
+    /// \return false if \a ordinal is out of range
+    ///
+    bool documentAt(qint64 ordinal, bsoncxx::document::view &view) const;
+
+    ///
+    /// \brief documentAt decodes the document number \a ordinal
+    /// \throw BSONexception if the document can not be decoded
+    ///
+    bool documentAt(qint64 ordinal, QVariantMap &doc) const;
+
+    ///
+    /// \brief find returns the first document whose _id equals \a id
+    /// \param id BSONoid, QString or integer
+    /// \return false if not found, for other \a id types or without ids
+    ///
+    bool find(const QVariant &id, bsoncxx::document::view &view) const;
+
+    ///
+    /// \brief find decodes the first document whose _id equals \a id
+    /// \throw BSONexception if the document can not be decoded
+    ///
+    bool find(const QVariant &id, QVariantMap &doc) const;
+
+private:
+    BSONFileReader m_reader;
+    QFile m_indexFile;
+    QString m_errorString;
+    uchar *m_index;
+    qint64 m_count;
+    const uchar *m_offsets;
+    /// sorted id records, nullptr if the sidecar has no ids
+    const uchar *m_ids;
+    qint64 m_idCount;
+};
+
+#endif // QBSON_FILE_H
@@ -0,0 +1,793 @@
+#include "qbson_json.h"
+#include "qbson_p.h"
+
+#include <QCborArray>
+#include <QCborStreamReader>
+#include <QCborStreamWriter>
+#include <QCborValue>
+#include <QJsonArray>
+#include <QUuid>
+
+#include <limits>
+
+namespace BSON {
+namespace _private {
+
+inline size_t beginElement(Writer &w, const QString &key) {
+    const size_t pos = w.beginElementUtf16((const uint16_t*) key.constData(),
+                                           size_t(key.size()));
+    if (pos == Writer::npos)
+        throw BSONexception("Error in key with zero character");
+    return pos;
+}
+
+inline void appendUtf8(Writer &w, const QString &str) {
+    w.appendStringUtf16((const uint16_t*) str.constData(), size_t(str.size()));
+}
+
+inline void appendInteger(Writer &w, size_t typePos, qint64 value) {
+    if (value >= std::numeric_limits<int32_t>::min() &&
+            value <= std::numeric_limits<int32_t>::max()) {
+        w.setElementType(typePos, bsoncxx::type::k_int32);
+        w.appendInt32(int32_t(value));
+    } else {
+        w.setElementType(typePos, bsoncxx::type::k_int64);
+        w.appendInt64(value);
+    }
+}
+
+QString isoDate(const Element &e) {
+    return QDateTime::fromMSecsSinceEpoch(e.int64(), Qt::UTC)
+            .toString(Qt::ISODateWithMs);
+}
+
+BSONexception unsupported(const Element &e) {
+    return BSONexception(QString("Error in unsupported type %1")
+                         .arg((int) e.type));
+}
+
+// QJsonObject -> BSON
+
+void appendJsonValue(Writer &w, size_t typePos, const QJsonValue &v);
+
+void appendJsonObject(Writer &w, const QJsonObject &obj) {
+    const size_t start = w.beginDocument();
+    for (auto it = obj.constBegin(); it != obj.constEnd(); ++it)
+        appendJsonValue(w, beginElement(w, it.key()), it.value());
+    w.endDocument(start);
+}
+
+void appendJsonArray(Writer &w, const QJsonArray &lst) {
+    const size_t start = w.beginDocument();
+    uint32_t index = 0;
+    for (auto it = lst.constBegin(); it != lst.constEnd(); ++it, ++index)
+        appendJsonValue(w, w.beginIndexElement(index), *it);
+    w.endDocument(start);
+}
+
+void appendJsonValue(Writer &w, size_t typePos, const QJsonValue &v) {
+    using bsoncxx::type;
+
+    switch (v.type()) {
+    case QJsonValue::Null:
+    case QJsonValue::Undefined:
+        w.setElementType(typePos, type::k_null);
+        return;
+    case QJsonValue::Bool:
+        w.setElementType(typePos, type::k_bool);
+        w.appendByte(v.toBool() ? 1 : 0);
+        return;
+    case QJsonValue::Double:
+        w.setElementType(typePos, type::k_double);
+        w.appendDouble(v.toDouble());
+        return;
+    case QJsonValue::String:
+        w.setElementType(typePos, type::k_utf8);
+        appendUtf8(w, v.toString());
+        return;
+    case QJsonValue::Array:
+        w.setElementType(typePos, type::k_array);
+        appendJsonArray(w, v.toArray());
+        return;
+    case QJsonValue::Object:
+        w.setElementType(typePos, type::k_document);
+        appendJsonObject(w, v.toObject());
+        return;
+    }
+
+    throw BSONexception(QString("Error in JSON type %1").arg((int) v.type()));
+}
+
+// BSON -> QJsonObject
+
+QJsonObject jsonObject(const uint8_t *data, size_t size);
+QJsonArray jsonArray(const uint8_t *data, size_t size);
+
+QJsonValue jsonValue(const Element &e) {
+    using bsoncxx::type;
+
+    switch (e.type) {
+    case type::k_double: return e.dbl();
+    case type::k_int32: return e.int32();
+    case type::k_int64: return qint64(e.int64());
+    case type::k_utf8:
+    case type::k_code:
+    case type::k_symbol:
+        return stringFromUtf8(e.string(), e.stringSize());
+    case type::k_bool: return e.boolean();
+    case type::k_null:
+    case type::k_undefined:
+        return QJsonValue();
+    case type::k_date: return isoDate(e);
+    case type::k_oid: return BSONoid::fromBytes(e.value).toHex();
+    case type::k_binary:
+        return QString::fromLatin1(
+                    QByteArray::fromRawData((const char*) e.binaryData(),
+                                            int(e.binarySize())).toBase64());
+    case type::k_document: return jsonObject(e.value, e.valueSize);
+    case type::k_array: return jsonArray(e.value, e.valueSize);
+    default:
+        break;
+    }
+
+    throw unsupported(e);
+}
+
+QJsonObject jsonObject(const uint8_t *data, size_t size) {
+    QJsonObject res;
+
+    ElementReader reader(data, size);
+    Element e;
+    while (reader.next(e))
+        res.insert(stringFromUtf8(e.key, e.keySize), jsonValue(e));
+
+    if (reader.hasError())
+        throw BSONexception("BSON::toJson malformed document");
+
+    return res;
+}
+
+QJsonArray jsonArray(const uint8_t *data, size_t size) {
+    QJsonArray res;
+
+    ElementReader reader(data, size);
+    Element e;
+    while (reader.next(e))
+        res.append(jsonValue(e));
+
+    if (reader.hasError())
+        throw BSONexception("BSON::toJson malformed array");
+
+    return res;
+}
+
+// QCborMap -> BSON
+
+void appendCborValue(Writer &w, size_t typePos, const QCborValue &v);
+
+size_t beginCborElement(Writer &w, const QCborValue &key) {
+    if (key.isString())
+        return beginElement(w, key.toString());
+    if (key.isInteger()) {
+        const QByteArray name = QByteArray::number(key.toInteger());
+        return w.beginElement(name.constData(), size_t(name.size()));
+    }
+
+    throw BSONexception(QString("Error in CBOR key type %1")
+                        .arg((int) key.type()));
+}
+
+void appendCborMap(Writer &w, const QCborMap &map) {
+    const size_t start = w.beginDocument();
+    for (auto it = map.constBegin(); it != map.constEnd(); ++it)
+        appendCborValue(w, beginCborElement(w, it.key()), it.value());
+    w.endDocument(start);
+}
+
+void appendCborArray(Writer &w, const QCborArray &lst) {
+    const size_t start = w.beginDocument();
+    uint32_t index = 0;
+    for (auto it = lst.constBegin(); it != lst.constEnd(); ++it, ++index)
+        appendCborValue(w, w.beginIndexElement(index), *it);
+    w.endDocument(start);
+}
+
+void appendCborValue(Writer &w, size_t typePos, const QCborValue &v) {
+    using bsoncxx::type;
+    using bsoncxx::binary_sub_type;
+
+    switch (v.type()) {
+    case QCborValue::Integer:
+        appendInteger(w, typePos, v.toInteger());
+        return;
+    case QCborValue::Double:
+        w.setElementType(typePos, type::k_double);
+        w.appendDouble(v.toDouble());
+        return;
+    case QCborValue::String:
+    case QCborValue::Url:
+        w.setElementType(typePos, type::k_utf8);
+        appendUtf8(w, v.isUrl() ? v.toUrl().toString() : v.toString());
+        return;
+    case QCborValue::ByteArray: {
+        const QByteArray data = v.toByteArray();
+        w.setElementType(typePos, type::k_binary);
+        w.appendBinary(binary_sub_type::k_binary,
+                       data.constData(), size_t(data.size()));
+        return;
+    }
+    case QCborValue::Uuid: {
+        const QByteArray data = v.toUuid().toRfc4122();
+        w.setElementType(typePos, type::k_binary);
+        w.appendBinary(binary_sub_type::k_uuid,
+                       data.constData(), size_t(data.size()));
+        return;
+    }
+    case QCborValue::DateTime:
+        w.setElementType(typePos, type::k_date);
+        w.appendInt64(v.toDateTime().toMSecsSinceEpoch());
+        return;
+    case QCborValue::False:
+    case QCborValue::True:
+        w.setElementType(typePos, type::k_bool);
+        w.appendByte(v.isTrue() ? 1 : 0);
+        return;
+    case QCborValue::Null:
+        w.setElementType(typePos, type::k_null);
+        return;
+    case QCborValue::Undefined:
+        w.setElementType(typePos, type::k_undefined);
+        return;
+    case QCborValue::Array:
+        w.setElementType(typePos, type::k_array);
+        appendCborArray(w, v.toArray());
+        return;
+    case QCborValue::Map:
+        w.setElementType(typePos, type::k_document);
+        appendCborMap(w, v.toMap());
+        return;
+    case QCborValue::Tag:
+        appendCborValue(w, typePos, v.taggedValue());
+        return;
+    default:
+        break;
+    }
+
+    throw BSONexception(QString("Error in CBOR type %1").arg((int) v.type()));
+}
+
+// BSON -> QCborMap
+
+QCborMap cborMap(const uint8_t *data, size_t size);
+QCborArray cborArray(const uint8_t *data, size_t size);
+
+QCborValue cborValue(const Element &e) {
+    using bsoncxx::type;
+
+    switch (e.type) {
+    case type::k_double: return e.dbl();
+    case type::k_int32: return qint64(e.int32());
+    case type::k_int64: return qint64(e.int64());
+    case type::k_utf8:
+    case type::k_code:
+    case type::k_symbol:
+        return stringFromUtf8(e.string(), e.stringSize());
+    case type::k_bool: return e.boolean();
+    case type::k_null: return QCborValue(nullptr);
+    case type::k_undefined: return QCborValue();
+    case type::k_date:
+        return QDateTime::fromMSecsSinceEpoch(e.int64(), Qt::UTC);
+    case type::k_oid: return BSONoid::fromBytes(e.value).toHex();
+    case type::k_binary: {
+        const QByteArray data((const char*) e.binaryData(),
+                              int(e.binarySize()));
+        if (e.binarySubType() == bsoncxx::binary_sub_type::k_uuid &&
+                data.size() == 16)
+            return QUuid::fromRfc4122(data);
+        return data;
+    }
+    case type::k_document: return cborMap(e.value, e.valueSize);
+    case type::k_array: return cborArray(e.value, e.valueSize);
+    default:
+        break;
+    }
+
+    throw unsupported(e);
+}
+
+QCborMap cborMap(const uint8_t *data, size_t size) {
+    QCborMap res;
+
+    ElementReader reader(data, size);
+    Element e;
+    while (reader.next(e))
+        res.insert(stringFromUtf8(e.key, e.keySize), cborValue(e));
+
+    if (reader.hasError())
+        throw BSONexception("BSON::toCborMap malformed document");
+
+    return res;
+}
+
+QCborArray cborArray(const uint8_t *data, size_t size) {
+    QCborArray res;
+
+    ElementReader reader(data, size);
+    Element e;
+    while (reader.next(e))
+        res.append(cborValue(e));
+
+    if (reader.hasError())
+        throw BSONexception("BSON::toCborMap malformed array");
+
+    return res;
+}
+
+// BSON -> CBOR stream
+
+void writeCborValue(QCborStreamWriter &out, const Element &e);
+
+void writeCborContainer(QCborStreamWriter &out, const uint8_t *data,
+                        size_t size, bool isArray) {
+    ElementReader reader(data, size);
+    Element e;
+
+    // definite lengths keep the output compact and QCborValue friendly
+    quint64 count = 0;
+    while (reader.next(e))
+        ++count;
+    if (reader.hasError())
+        throw BSONexception("BSON::toCbor malformed document");
+
+    if (isArray)
+        out.startArray(count);
+    else
+        out.startMap(count);
+
+    reader.seek(4);
+    while (reader.next(e)) {
+        if (!isArray)
+            out.appendTextString(e.key, qsizetype(e.keySize));
+        writeCborValue(out, e);
+    }
+
+    if (isArray)
+        out.endArray();
+    else
+        out.endMap();
+}
+
+void writeCborValue(QCborStreamWriter &out, const Element &e) {
+    using bsoncxx::type;
+
+    switch (e.type) {
+    case type::k_double:
+        out.append(e.dbl());
+        return;
+    case type::k_int32:
+        out.append(qint64(e.int32()));
+        return;
+    case type::k_int64:
+        out.append(qint64(e.int64()));
+        return;
+    case type::k_utf8:
+    case type::k_code:
+    case type::k_symbol:
+        out.appendTextString(e.string(), qsizetype(e.stringSize()));
+        return;
+    case type::k_bool:
+        out.append(e.boolean());
+        return;
+    case type::k_null:
+        out.appendNull();
+        return;
+    case type::k_undefined:
+        out.appendUndefined();
+        return;
+    case type::k_date:
+        out.append(QCborKnownTags::DateTimeString);
+        out.append(isoDate(e));
+        return;
+    case type::k_oid: {
+        static const char digits[] = "0123456789abcdef";
+        char hex[24];
+        for (int i = 0; i < 12; ++i) {
+            hex[2 * i] = digits[e.value[i] >> 4];
+            hex[2 * i + 1] = digits[e.value[i] & 0xF];
+        }
+        out.appendTextString(hex, sizeof(hex));
+        return;
+    }
+    case type::k_binary:
+        if (e.binarySubType() == bsoncxx::binary_sub_type::k_uuid &&
+                e.binarySize() == 16)
+            out.append(QCborKnownTags::Uuid);
+        out.appendByteString((const char*) e.binaryData(),
+                             qsizetype(e.binarySize()));
+        return;
+    case type::k_document:
+        writeCborContainer(out, e.value, e.valueSize, false);
+        return;
+    case type::k_array:
+        writeCborContainer(out, e.value, e.valueSize, true);
+        return;
+    default:
+        break;
+    }
+
+    throw unsupported(e);
+}
+
+// CBOR stream -> BSON
+
+void checkCbor(const QCborStreamReader &in) {
+    if (in.lastError() != QCborError::NoError)
+        throw BSONexception(QString("Error in CBOR: %1")
+                            .arg(in.lastError().toString()));
+}
+
+///
+/// \brief readCborChunks appends a text or byte string chunk by chunk
+/// \return number of bytes appended
+///
+size_t readCborChunks(QCborStreamReader &in, Writer &w) {
+    size_t total = 0;
+    QCborStreamReader::StringResult<qsizetype> r;
+    do {
+        const qsizetype chunk = qMax(qsizetype(0), in.currentStringChunkSize());
+        char *dst = (char*) w.grow(size_t(chunk));
+        r = in.readStringChunk(dst, chunk);
+        if (r.status == QCborStreamReader::Error) {
+            checkCbor(in);
+            throw BSONexception("Error in CBOR string");
+        }
+        w.truncate(w.size() - size_t(chunk - r.data));
+        total += size_t(r.data);
+    } while (r.status == QCborStreamReader::Ok);
+
+    checkCbor(in);
+    return total;
+}
+
+QString readCborString(QCborStreamReader &in) {
+    QString res;
+    auto r = in.readString();
+    while (r.status == QCborStreamReader::Ok) {
+        res += r.data;
+        r = in.readString();
+    }
+
+    checkCbor(in);
+    return res;
+}
+
+qint64 readCborInteger(QCborStreamReader &in) {
+    qint64 res;
+    if (in.isUnsignedInteger()) {
+        const quint64 value = in.toUnsignedInteger();
+        if (value > quint64(std::numeric_limits<qint64>::max()))
+            throw BSONexception("Error in CBOR integer out of range");
+        res = qint64(value);
+    } else {
+        const quint64 value = quint64(in.toNegativeInteger());
+        if (value > quint64(std::numeric_limits<qint64>::max()) + 1)
+            throw BSONexception("Error in CBOR integer out of range");
+        res = -qint64(value - 1) - 1;
+    }
+    in.next();
+    return res;
+}
+
+void readCborValue(QCborStreamReader &in, Writer &w, size_t typePos);
+
+void readCborMap(QCborStreamReader &in, Writer &w) {
+    const size_t start = w.beginDocument();
+
+    in.enterContainer();
+    while (in.hasNext()) {
+        const size_t typePos = w.size();
+        w.appendByte(0);
+
+        if (in.isString()) {
+            const size_t keyStart = w.size();
+            const size_t keySize = readCborChunks(in, w);
+            if (memchr(w.data() + keyStart, 0, keySize))
+                throw BSONexception("Error in CBOR key with zero character");
+            if (!validateUtf8((const char*) w.data() + keyStart, keySize))
+                throw BSONexception("Error in CBOR key with invalid UTF-8");
+            w.appendByte(0);
+        } else if (in.isInteger()) {
+            const QByteArray name = QByteArray::number(readCborInteger(in));
+            w.appendCString(name.constData(), size_t(name.size()));
+        } else {
+            throw BSONexception(QString("Error in CBOR key type %1")
+                                .arg((int) in.type()));
+        }
+
+        readCborValue(in, w, typePos);
+    }
+    checkCbor(in);
+    in.leaveContainer();
+
+    w.endDocument(start);
+}
+
+void readCborArray(QCborStreamReader &in, Writer &w) {
+    const size_t start = w.beginDocument();
+
+    in.enterContainer();
+    uint32_t index = 0;
+    while (in.hasNext())
+        readCborValue(in, w, w.beginIndexElement(index++));
+    checkCbor(in);
+    in.leaveContainer();
+
+    w.endDocument(start);
+}
+
+void readCborValue(QCborStreamReader &in, Writer &w, size_t typePos) {
+    using bsoncxx::type;
+    using bsoncxx::binary_sub_type;
+
+    checkCbor(in);
+
+    switch (in.type()) {
+    case QCborStreamReader::UnsignedInteger:
+    case QCborStreamReader::NegativeInteger:
+        appendInteger(w, typePos, readCborInteger(in));
+        return;
+    case QCborStreamReader::ByteArray: {
+        w.setElementType(typePos, type::k_binary);
+        const size_t start = w.size();
+        w.appendInt32(0);
+        w.appendByte(uint8_t(binary_sub_type::k_binary));
+        w.patchInt32(start, int32_t(readCborChunks(in, w)));
+        return;
+    }
+    case QCborStreamReader::String: {
+        w.setElementType(typePos, type::k_utf8);
+        const size_t start = w.size();
+        w.appendInt32(0);
+        const size_t size = readCborChunks(in, w);
+        if (!validateUtf8((const char*) w.data() + start + 4, size))
+            throw BSONexception("Error in CBOR string with invalid UTF-8");
+        w.appendByte(0);
+        w.patchInt32(start, int32_t(size + 1));
+        return;
+    }
+    case QCborStreamReader::Array:
+        w.setElementType(typePos, type::k_array);
+        readCborArray(in, w);
+        return;
+    case QCborStreamReader::Map:
+        w.setElementType(typePos, type::k_document);
+        readCborMap(in, w);
+        return;
+    case QCborStreamReader::Tag: {
+        const QCborTag tag = in.toTag();
+        in.next();
+        checkCbor(in);
+
+        if (tag == QCborTag(QCborKnownTags::DateTimeString) && in.isString()) {
+            const QDateTime date = QDateTime::fromString(readCborString(in),
+                                                         Qt::ISODateWithMs);
+            if (!date.isValid())
+                throw BSONexception("Error in CBOR date");
+            w.setElementType(typePos, type::k_date);
+            w.appendInt64(date.toMSecsSinceEpoch());
+            return;
+        }
+        if (tag == QCborTag(QCborKnownTags::UnixTime_t) &&
+                (in.isInteger() || in.isDouble())) {
+            double seconds;
+            if (in.isDouble()) {
+                seconds = in.toDouble();
+                in.next();
+            } else {
+                seconds = double(readCborInteger(in));
+            }
+            w.setElementType(typePos, type::k_date);
+            w.appendInt64(qint64(seconds * 1000));
+            return;
+        }
+        if (tag == QCborTag(QCborKnownTags::Uuid) && in.isByteArray()) {
+            w.setElementType(typePos, type::k_binary);
+            const size_t start = w.size();
+            w.appendInt32(0);
+            w.appendByte(uint8_t(binary_sub_type::k_uuid));
+            w.patchInt32(start, int32_t(readCborChunks(in, w)));
+            return;
+        }
+
+        // other tags only annotate their content
+        readCborValue(in, w, typePos);
+        return;
+    }
+    case QCborStreamReader::SimpleType:
+        if (in.isBool()) {
+            w.setElementType(typePos, type::k_bool);
+            w.appendByte(in.toBool() ? 1 : 0);
+        } else if (in.isNull()) {
+            w.setElementType(typePos, type::k_null);
+        } else if (in.isUndefined()) {
+            w.setElementType(typePos, type::k_undefined);
+        } else {
+            break;
+        }
+        in.next();
+        return;
+    case QCborStreamReader::Float16:
+        w.setElementType(typePos, type::k_double);
+        w.appendDouble(double(float(in.toFloat16())));
+        in.next();
+        return;
+    case QCborStreamReader::Float:
+        w.setElementType(typePos, type::k_double);
+        w.appendDouble(double(in.toFloat()));
+        in.next();
+        return;
+    case QCborStreamReader::Double:
+        w.setElementType(typePos, type::k_double);
+        w.appendDouble(in.toDouble());
+        in.next();
+        return;
+    default:
+        break;
+    }
+
+    throw BSONexception(QString("Error in CBOR type %1").arg((int) in.type()));
+}
+
+}
+
+bsoncxx::document::value toBson(const QJsonObject &obj, bool &ok)
+noexcept
+{
+    try {
+        return toBson(obj);
+    } catch (...) {
+        ok = false;
+        return _private::emptyDocumentValue();
+    }
+}
+
+bsoncxx::document::value toBson(const QJsonObject &obj)
+{
+    Writer writer;
+    _private::appendJsonObject(writer, obj);
+
+    const size_t length = writer.size();
+    return bsoncxx::document::value(writer.release(), length,
+                                    &Writer::freeBuffer);
+}
+
+void toBson(const QJsonObject &obj, Writer &writer)
+{
+    const size_t start = writer.size();
+    try {
+        _private::appendJsonObject(writer, obj);
+    } catch (...) {
+        writer.truncate(start);
+        throw;
+    }
+}
+
+QJsonObject toJson(const bsoncxx::document::view &bson, bool &ok)
+noexcept
+{
+    try {
+        return toJson(bson);
+    } catch (...) {
+        ok = false;
+        return QJsonObject();
+    }
+}
+
+QJsonObject toJson(const bsoncxx::document::view &bson)
+{
+    return _private::jsonObject(bson.data(), bson.length());
+}
+
+bsoncxx::document::value toBson(const QCborMap &map, bool &ok)
+noexcept
+{
+    try {
+        return toBson(map);
+    } catch (...) {
+        ok = false;
+        return _private::emptyDocumentValue();
+    }
+}
+
+bsoncxx::document::value toBson(const QCborMap &map)
+{
+    Writer writer;
+    _private::appendCborMap(writer, map);
+
+    const size_t length = writer.size();
+    return bsoncxx::document::value(writer.release(), length,
+                                    &Writer::freeBuffer);
+}
+
+void toBson(const QCborMap &map, Writer &writer)
+{
+    const size_t start = writer.size();
+    try {
+        _private::appendCborMap(writer, map);
+    } catch (...) {
+        writer.truncate(start);
+        throw;
+    }
+}
+
+QCborMap toCborMap(const bsoncxx::document::view &bson)
+{
+    return _private::cborMap(bson.data(), bson.length());
+}
+
+void toCbor(const bsoncxx::document::view &bson, QCborStreamWriter &out)
+{
+    _private::writeCborContainer(out, bson.data(), bson.length(), false);
+}
+
+QByteArray toCbor(const bsoncxx::document::view &bson, bool &ok)
+noexcept
+{
+    try {
+        return toCbor(bson);
+    } catch (...) {
+        ok = false;
+        return QByteArray();
+    }
+}
+
+QByteArray toCbor(const bsoncxx::document::view &bson)
+{
+    QByteArray res;
+    res.reserve(int(bson.length()));
+
+    QCborStreamWriter out(&res);
+    toCbor(bson, out);
+    return res;
+}
+
+void fromCbor(QCborStreamReader &in, Writer &writer)
+{
+    const size_t start = writer.size();
+    try {
+        _private::checkCbor(in);
+        if (!in.isMap())
+            throw BSONexception(QString("Error in CBOR type %1, map expected")
+                                .arg((int) in.type()));
+        _private::readCborMap(in, writer);
+        _private::checkCbor(in);
+    } catch (...) {
+        writer.truncate(start);
+        throw;
+    }
+}
+
+bsoncxx::document::value fromCbor(const QByteArray &cbor, bool &ok)
+noexcept
+{
+    try {
+        return fromCbor(cbor);
+    } catch (...) {
+        ok = false;
+        return _private::emptyDocumentValue();
+    }
+}
+
+bsoncxx::document::value fromCbor(const QByteArray &cbor)
+{
+    QCborStreamReader in(cbor);
+
+    Writer writer;
+    fromCbor(in, writer);
+
+    const size_t length = writer.size();
+    return bsoncxx::document::value(writer.release(), length,
+                                    &Writer::freeBuffer);
+}
+
+}
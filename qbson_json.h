@@ -0,0 +1,170 @@
+#ifndef QBSON_JSON_H
+#define QBSON_JSON_H
+
+#include <QByteArray>
+#include <QCborMap>
+#include <QJsonObject>
+
+#include "qbson.h"
+
+class QCborStreamReader;
+class QCborStreamWriter;
+
+///
+/// Direct transcoding between BSON and QJsonObject, CBOR or Extended JSON
+///
+/// The transcoders walk one representation and emit the other without a
+/// QVariantMap in between. Fields keep the iteration order of the source
+/// container: insertion order for BSON and CBOR, the key order of the
+/// QJsonObject for JSON.
+///
+/// JSON numbers become BSON doubles, as with QJsonObject::toVariantMap().
+/// CBOR integers become int32 when they fit, int64 otherwise. In the other
+/// direction dates become ISO 8601 strings in UTC (CBOR tag 0), ObjectIds
+/// hex strings and binary base64 strings (CBOR byte strings, UUIDs with
+/// tag 37). BSON types without a counterpart, like regex, timestamp or
+/// decimal128, throw BSONexception.
+///
+
+namespace BSON {
+
+///
+/// \brief toBson transcodes a QJsonObject
+/// \param ok indicator false on not success, not success will not change
+/// \throw BSONexception on error without bool ok argument
+/// \return BSON document
+///
+bsoncxx::document::value toBson(const QJsonObject &obj, bool &ok) noexcept;
+bsoncxx::document::value toBson(const QJsonObject &obj) noexcept(false);
+
+///
+/// \brief toBson appends the transcoded document to \a writer
+/// \throw BSONexception on error, \a writer is left unchanged
+///
+void toBson(const QJsonObject &obj, Writer &writer) noexcept(false);
+
+///
+/// \brief toJson transcodes a BSON document into a QJsonObject
+/// \param ok indicator false on not success, not success will not change
+/// \throw BSONexception on malformed document or unsupported type without
+/// bool ok argument
+/// \return QJsonObject value
+///
+QJsonObject toJson(const bsoncxx::document::view &bson, bool &ok) noexcept;
+QJsonObject toJson(const bsoncxx::document::view &bson) noexcept(false);
+
+///
+/// \brief toBson transcodes a QCborMap
+/// \param ok indicator false on not success, not success will not change
+/// \throw BSONexception on error without bool ok argument
+/// \return BSON document
+///
+bsoncxx::document::value toBson(const QCborMap &map, bool &ok) noexcept;
+bsoncxx::document::value toBson(const QCborMap &map) noexcept(false);
+void toBson(const QCborMap &map, Writer &writer) noexcept(false);
+
+///
+/// \brief toCborMap transcodes a BSON document into a QCborMap
+/// \throw BSONexception on malformed document or unsupported type
+///
+QCborMap toCborMap(const bsoncxx::document::view &bson) noexcept(false);
+
+///
+/// \brief toCbor streams a BSON document as CBOR map into \a out
+/// \throw BSONexception on malformed document or unsupported type
+///
+void toCbor(const bsoncxx::document::view &bson,
+            QCborStreamWriter &out) noexcept(false);
+
+///
+/// \brief toCbor encodes a BSON document as CBOR
+/// \param ok indicator false on not success, not success will not change
+/// \throw BSONexception on error without bool ok argument
+/// \return encoded CBOR map
+///
+QByteArray toCbor(const bsoncxx::document::view &bson, bool &ok) noexcept;
+QByteArray toCbor(const bsoncxx::document::view &bson) noexcept(false);
+
+///
+/// \brief fromCbor reads one CBOR map from \a in and appends it to \a writer
+///
+/// Text and byte strings are copied chunk by chunk straight into the
+/// writer, without a QString or QByteArray in between. Text is validated
+/// as UTF-8 in place.
+///
+/// \throw BSONexception on CBOR error, invalid UTF-8 or unsupported item,
+/// \a writer is left unchanged
+///
+void fromCbor(QCborStreamReader &in, Writer &writer) noexcept(false);
+
+///
+/// \brief fromCbor decodes encoded CBOR holding one map
+/// \param ok indicator false on not success, not success will not change
+/// \throw BSONexception on error without bool ok argument
+/// \return BSON document
+///
+bsoncxx::document::value fromCbor(const QByteArray &cbor, bool &ok) noexcept;
+bsoncxx::document::value fromCbor(const QByteArray &cbor) noexcept(false);
+
+///
+/// \brief The ExtendedJsonMode enum selects the MongoDB Extended JSON v2 flavour
+///
+enum class ExtendedJsonMode {
+    /// every typed value is wrapped, e.g. {"$numberInt":"1"}, nothing is lost
+    Canonical,
+    /// plain JSON numbers and ISO 8601 dates where they are exact
+    Relaxed
+};
+
+///
+/// \brief toExtendedJson appends \a bson as compact Extended JSON to \a out
+///
+/// The document is written in one pass over the raw bytes. \a out is used
+/// as plain text buffer, clear() it between documents to reuse its
+/// capacity. All BSON types are supported.
+///
+/// \throw BSONexception on malformed document or invalid UTF-8, \a out is
+/// left unchanged
+///
+void toExtendedJson(const bsoncxx::document::view &bson, Writer &out,
+                    ExtendedJsonMode mode = ExtendedJsonMode::Relaxed) noexcept(false);
+
+///
+/// \brief toExtendedJson
+/// \param ok indicator false on not success, not success will not change
+/// \throw BSONexception on malformed document without bool ok argument
+/// \return UTF-8 Extended JSON text
+///
+QByteArray toExtendedJson(const bsoncxx::document::view &bson,
+                          ExtendedJsonMode mode, bool &ok) noexcept;
+QByteArray toExtendedJson(const bsoncxx::document::view &bson,
+                          ExtendedJsonMode mode = ExtendedJsonMode::Relaxed) noexcept(false);
+
+///
+/// \brief fromExtendedJson parses canonical or relaxed Extended JSON into \a writer
+///
+/// The text is parsed straight into BSON bytes. Type wrappers like $oid,
+/// $date, $binary or $numberLong are recognized when they are the first
+/// key of an object. Plain JSON integers become int32 when they fit,
+/// int64 otherwise, other numbers become doubles.
+///
+/// \param data UTF-8 text holding one JSON object
+/// \throw BSONexception on syntax error or invalid UTF-8 with the offset of
+/// the error, \a writer is left unchanged
+///
+void fromExtendedJson(const char *data, size_t size,
+                      Writer &writer) noexcept(false);
+
+///
+/// \brief fromExtendedJson
+/// \param ok indicator false on not success, not success will not change
+/// \throw BSONexception on syntax error without bool ok argument
+/// \return BSON document
+///
+bsoncxx::document::value fromExtendedJson(const QByteArray &json,
+                                          bool &ok) noexcept;
+bsoncxx::document::value fromExtendedJson(const QByteArray &json) noexcept(false);
+
+}
+
+#endif // QBSON_JSON_H
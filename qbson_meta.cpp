@@ -0,0 +1,462 @@
+#include "qbson_meta.h"
+#include "qbson_p.h"
+
+#include <QHash>
+#include <QMetaProperty>
+#include <QReadWriteLock>
+#include <QVector>
+
+namespace BSON {
+namespace _private {
+
+struct MetaPlan;
+
+enum class PropertyKind {
+    Bool,
+    Int,
+    LongLong,
+    Double,
+    String,
+    ByteArray,
+    Gadget,
+    Variant
+};
+
+///
+/// \brief The PropertyPlan struct is the resolved mapping of one property
+///
+struct PropertyPlan
+{
+    QByteArray key;
+    QMetaProperty property;
+    /// metaobject declaring the property, its static_metacall serves gadgets
+    const QMetaObject *owner;
+    /// absolute index for QObjects, index relative to owner for gadgets
+    int index;
+    int userType;
+    PropertyKind kind;
+    /// plan of a nested gadget property
+    const MetaPlan *nested;
+    bool writable;
+};
+
+///
+/// \brief The MetaPlan struct lists the serialized properties of a metaobject
+///
+struct MetaPlan
+{
+    QVector<PropertyPlan> properties;
+    QHash<QByteArray, int> byKey;
+    bool isObject;
+
+    ///
+    /// \brief find looks up the property of \a e, trying \a hint first
+    /// \return property index, -1 for unknown keys
+    ///
+    int find(const Element &e, int hint) const {
+        if (hint < properties.size()) {
+            const QByteArray &key = properties.at(hint).key;
+            if (e.keyEquals(key.constData(), size_t(key.size())))
+                return hint;
+        }
+        return byKey.value(QByteArray::fromRawData(e.key, int(e.keySize)), -1);
+    }
+};
+
+const MetaPlan &metaPlan(const QMetaObject &metaObject, bool isObject);
+
+PropertyKind propertyKind(const QMetaProperty &property) {
+    if (property.isEnumType())
+        return PropertyKind::Variant;
+
+    switch (property.userType()) {
+    case QMetaType::Bool: return PropertyKind::Bool;
+    case QMetaType::Int: return PropertyKind::Int;
+    case QMetaType::LongLong: return PropertyKind::LongLong;
+    case QMetaType::Double: return PropertyKind::Double;
+    case QMetaType::QString: return PropertyKind::String;
+    case QMetaType::QByteArray: return PropertyKind::ByteArray;
+    default:
+        break;
+    }
+
+    if ((QMetaType::typeFlags(property.userType()) & QMetaType::IsGadget) &&
+            QMetaType::metaObjectForType(property.userType()))
+        return PropertyKind::Gadget;
+
+    return PropertyKind::Variant;
+}
+
+MetaPlan *buildPlan(const QMetaObject &metaObject, bool isObject) {
+    MetaPlan *plan = new MetaPlan;
+    plan->isObject = isObject;
+
+    const int first = isObject ? QObject::staticMetaObject.propertyCount() : 0;
+    for (int i = first; i < metaObject.propertyCount(); ++i) {
+        const QMetaProperty property = metaObject.property(i);
+        if (!property.isReadable() || !property.isStored())
+            continue;
+
+        PropertyPlan p;
+        p.property = property;
+        p.owner = property.enclosingMetaObject();
+        p.index = isObject ? i : i - p.owner->propertyOffset();
+        p.userType = property.userType();
+        p.kind = propertyKind(property);
+        p.nested = p.kind == PropertyKind::Gadget
+                ? &metaPlan(*QMetaType::metaObjectForType(p.userType), false)
+                : nullptr;
+        p.writable = property.isWritable();
+
+        p.key = property.name();
+        const int info = metaObject.indexOfClassInfo(("bson:" + p.key).constData());
+        if (info >= 0)
+            p.key = metaObject.classInfo(info).value();
+
+        plan->byKey.insert(p.key, plan->properties.size());
+        plan->properties << p;
+    }
+
+    return plan;
+}
+
+///
+/// \brief metaPlan returns the cached plan of \a metaObject
+///
+/// Plans are built once per metaobject and live as long as the process,
+/// like the metaobjects they describe. The last plan used is kept per
+/// thread, so loops over one type do not take the lock.
+///
+const MetaPlan &metaPlan(const QMetaObject &metaObject, bool isObject) {
+    thread_local const QMetaObject *lastObject = nullptr;
+    thread_local const MetaPlan *lastPlan = nullptr;
+
+    if (lastObject == &metaObject)
+        return *lastPlan;
+
+    static QReadWriteLock lock;
+    static QHash<const QMetaObject*, const MetaPlan*> plans;
+
+    const MetaPlan *plan;
+    {
+        QReadLocker locker(&lock);
+        plan = plans.value(&metaObject);
+    }
+
+    if (!plan) {
+        MetaPlan *built = buildPlan(metaObject, isObject);
+
+        QWriteLocker locker(&lock);
+        plan = plans.value(&metaObject);
+        if (plan) {
+            delete built;
+        } else {
+            plans.insert(&metaObject, built);
+            plan = built;
+        }
+    }
+
+    lastObject = &metaObject;
+    lastPlan = plan;
+    return *plan;
+}
+
+template <typename V>
+void readProperty(const PropertyPlan &p, const void *target, bool isObject,
+                  V &value) {
+    int status = -1;
+    void *argv[] = { &value, nullptr, &status };
+    if (isObject)
+        QMetaObject::metacall((QObject*) target, QMetaObject::ReadProperty,
+                              p.index, argv);
+    else
+        p.owner->d.static_metacall((QObject*) target,
+                                   QMetaObject::ReadProperty, p.index, argv);
+}
+
+template <typename V>
+void writeProperty(const PropertyPlan &p, void *target, bool isObject,
+                   V &value) {
+    int status = -1;
+    int flags = 0;
+    void *argv[] = { &value, nullptr, &status, &flags };
+    if (isObject)
+        QMetaObject::metacall((QObject*) target, QMetaObject::WriteProperty,
+                              p.index, argv);
+    else
+        p.owner->d.static_metacall((QObject*) target,
+                                   QMetaObject::WriteProperty, p.index, argv);
+}
+
+QVariant readVariant(const PropertyPlan &p, const void *target,
+                     bool isObject) {
+    return isObject ? p.property.read((const QObject*) target)
+                    : p.property.readOnGadget(target);
+}
+
+bool writeVariant(const PropertyPlan &p, void *target, bool isObject,
+                  const QVariant &value) {
+    return isObject ? p.property.write((QObject*) target, value)
+                    : p.property.writeOnGadget(target, value);
+}
+
+void encodeProperties(Writer &w, const MetaPlan &plan, const void *target) {
+    using bsoncxx::type;
+
+    const bool isObject = plan.isObject;
+    const size_t start = w.beginDocument();
+
+    for (const PropertyPlan &p : plan.properties) {
+        const size_t typePos = w.beginElement(p.key.constData(),
+                                              size_t(p.key.size()));
+        switch (p.kind) {
+        case PropertyKind::Bool: {
+            bool value = false;
+            readProperty(p, target, isObject, value);
+            w.setElementType(typePos, type::k_bool);
+            w.appendByte(value ? 1 : 0);
+        } break;
+        case PropertyKind::Int: {
+            int value = 0;
+            readProperty(p, target, isObject, value);
+            w.setElementType(typePos, type::k_int32);
+            w.appendInt32(value);
+        } break;
+        case PropertyKind::LongLong: {
+            qlonglong value = 0;
+            readProperty(p, target, isObject, value);
+            w.setElementType(typePos, type::k_int64);
+            w.appendInt64(value);
+        } break;
+        case PropertyKind::Double: {
+            double value = 0;
+            readProperty(p, target, isObject, value);
+            w.setElementType(typePos, type::k_double);
+            w.appendDouble(value);
+        } break;
+        case PropertyKind::String: {
+            QString value;
+            readProperty(p, target, isObject, value);
+            w.setElementType(typePos, type::k_utf8);
+            w.appendStringUtf16((const uint16_t*) value.constData(),
+                                size_t(value.size()));
+        } break;
+        case PropertyKind::ByteArray: {
+            QByteArray value;
+            readProperty(p, target, isObject, value);
+            w.setElementType(typePos, type::k_binary);
+            w.appendBinary(bsoncxx::binary_sub_type::k_binary,
+                           value.constData(), size_t(value.size()));
+        } break;
+        case PropertyKind::Gadget: {
+            const QVariant value = readVariant(p, target, isObject);
+            w.setElementType(typePos, type::k_document);
+            encodeProperties(w, *p.nested, value.constData());
+        } break;
+        case PropertyKind::Variant:
+            appendValue(w, typePos, readVariant(p, target, isObject));
+            break;
+        }
+    }
+
+    w.endDocument(start);
+}
+
+void decodeVariant(const PropertyPlan &p, void *target, bool isObject,
+                   const Element &e) {
+    using bsoncxx::type;
+
+    // numbers reach here for an integer property only if they do not fit,
+    // QVariant::convert() would wrap them
+    if ((p.kind == PropertyKind::Int || p.kind == PropertyKind::LongLong)
+            && (e.type == type::k_int32 || e.type == type::k_int64
+                || e.type == type::k_double))
+        throw BSONexception(QString("Error in %1").arg(p.property.typeName()));
+
+    QVariant value = decodeValue(e);
+    if (!value.isValid())
+        return;
+
+    if (p.userType != QMetaType::QVariant && !p.property.isEnumType() &&
+            value.userType() != p.userType && !value.convert(p.userType))
+        throw BSONexception(QString("Error in %1").arg(p.property.typeName()));
+
+    if (!writeVariant(p, target, isObject, value))
+        throw BSONexception(QString("Error in %1").arg(p.property.typeName()));
+}
+
+void decodeProperties(const uint8_t *data, size_t size, const MetaPlan &plan,
+                      void *target) {
+    using bsoncxx::type;
+
+    const bool isObject = plan.isObject;
+
+    ElementReader reader(data, size);
+    Element e;
+    int hint = 0;
+    while (reader.next(e)) {
+        const int index = plan.find(e, hint);
+        if (index < 0)
+            continue;
+        hint = index + 1;
+
+        const PropertyPlan &p = plan.properties.at(index);
+        if (!p.writable)
+            continue;
+
+        try {
+            switch (p.kind) {
+            case PropertyKind::Bool:
+                if (e.type == type::k_bool) {
+                    bool value = e.boolean();
+                    writeProperty(p, target, isObject, value);
+                    continue;
+                }
+                break;
+            case PropertyKind::Int: {
+                // values out of range are left to decodeVariant()
+                int value = 0;
+                if (e.type != type::k_null && loadNumber(e, value)) {
+                    writeProperty(p, target, isObject, value);
+                    continue;
+                }
+            } break;
+            case PropertyKind::LongLong: {
+                qlonglong value = 0;
+                if (e.type != type::k_null && loadNumber(e, value)) {
+                    writeProperty(p, target, isObject, value);
+                    continue;
+                }
+            } break;
+            case PropertyKind::Double: {
+                double value = 0;
+                if (e.type != type::k_null && loadNumber(e, value)) {
+                    writeProperty(p, target, isObject, value);
+                    continue;
+                }
+            } break;
+            case PropertyKind::String:
+                if (e.type == type::k_utf8) {
+                    QString value = stringFromUtf8(e.string(), e.stringSize());
+                    writeProperty(p, target, isObject, value);
+                    continue;
+                }
+                break;
+            case PropertyKind::ByteArray:
+                if (e.type == type::k_binary &&
+                        e.binarySubType() == bsoncxx::binary_sub_type::k_binary) {
+                    QByteArray value((const char*) e.binaryData(),
+                                     int(e.binarySize()));
+                    writeProperty(p, target, isObject, value);
+                    continue;
+                }
+                break;
+            case PropertyKind::Gadget:
+                if (e.type == type::k_document) {
+                    QVariant value = readVariant(p, target, isObject);
+                    decodeProperties(e.value, e.valueSize, *p.nested,
+                                     value.data());
+                    writeVariant(p, target, isObject, value);
+                    continue;
+                }
+                break;
+            case PropertyKind::Variant:
+                break;
+            }
+
+            decodeVariant(p, target, isObject, e);
+        } catch (BSONexception &ex) {
+            throw BSONexception(QString("Error in field %1: %2")
+                                .arg(QString::fromUtf8(p.key), ex.data()));
+        }
+    }
+
+    if (reader.hasError())
+        throw BSONexception("BSON::fromBson malformed document");
+}
+
+}
+
+void encodeGadget(Writer &w, const QMetaObject &metaObject, const void *gadget)
+{
+    _private::initTypes();
+
+    const size_t start = w.size();
+    try {
+        _private::encodeProperties(w, _private::metaPlan(metaObject, false),
+                                   gadget);
+    } catch (...) {
+        w.truncate(start);
+        throw;
+    }
+}
+
+void decodeGadget(const uint8_t *data, size_t size,
+                  const QMetaObject &metaObject, void *gadget)
+{
+    _private::initTypes();
+
+    _private::decodeProperties(data, size,
+                               _private::metaPlan(metaObject, false), gadget);
+}
+
+void encodeObject(Writer &w, const QObject *object)
+{
+    _private::initTypes();
+
+    const size_t start = w.size();
+    try {
+        _private::encodeProperties(w,
+                                   _private::metaPlan(*object->metaObject(), true),
+                                   object);
+    } catch (...) {
+        w.truncate(start);
+        throw;
+    }
+}
+
+void decodeObject(const uint8_t *data, size_t size, QObject *object)
+{
+    _private::initTypes();
+
+    _private::decodeProperties(data, size,
+                               _private::metaPlan(*object->metaObject(), true),
+                               object);
+}
+
+bsoncxx::document::value toBson(const QObject &object, bool &ok)
+noexcept
+{
+    try {
+        return toBson(object);
+    } catch (...) {
+        ok = false;
+        return _private::emptyDocumentValue();
+    }
+}
+
+bsoncxx::document::value toBson(const QObject &object)
+{
+    Writer w;
+    encodeObject(w, &object);
+
+    const size_t length = w.size();
+    return bsoncxx::document::value(w.release(), length, &Writer::freeBuffer);
+}
+
+void fromBson(const bsoncxx::document::view &bson, QObject *object, bool &ok)
+noexcept
+{
+    try {
+        fromBson(bson, object);
+    } catch (...) {
+        ok = false;
+    }
+}
+
+void fromBson(const bsoncxx::document::view &bson, QObject *object)
+{
+    decodeObject(bson.data(), bson.length(), object);
+}
+
+}
@@ -0,0 +1,121 @@
+#ifndef QBSON_META_H
+#define QBSON_META_H
+
+#include <type_traits>
+
+#include <QMetaObject>
+#include <QObject>
+
+#include "qbson.h"
+#include "qbson_struct.h"
+
+///
+/// Reflective mapping of Q_GADGET and QObject types to BSON
+///
+/// The stored properties of a metaobject are serialized under their names.
+/// A Q_CLASSINFO("bson:<property>", "<key>") entry renames a property. The
+/// key names and a converter for each property are resolved on first use
+/// of a metaobject and cached, so later calls loop over that plan. Bool,
+/// int, qint64, double, QString and QByteArray properties are read and
+/// written through the metacall interface without a QVariant. Nested
+/// gadgets are encoded as subdocuments. All other types go through the
+/// QVariant conversion of toBson().
+///
+///     struct Point { Q_GADGET Q_PROPERTY(int x MEMBER x) Q_PROPERTY(int y MEMBER y)
+///                    public: int x; int y; };
+///
+///     bsoncxx::document::value doc = BSON::toBson(point);
+///     Point point = BSON::fromBson<Point>(doc.view());
+///
+/// Properties declared by QObject itself, i.e. objectName, and properties
+/// with STORED false are skipped. Read-only properties are encoded but
+/// ignored on decode, as are unknown keys.
+///
+
+namespace BSON {
+
+///
+/// \brief encodeGadget appends the properties of \a gadget as document to \a w
+/// \param metaObject staticMetaObject of the gadget type
+/// \throw BSONexception on unsupported value, \a w is left unchanged
+///
+void encodeGadget(Writer &w, const QMetaObject &metaObject,
+                  const void *gadget) noexcept(false);
+
+///
+/// \brief decodeGadget writes the fields of the document at \a data to \a gadget
+/// \throw BSONexception on malformed document or inconvertible value
+///
+void decodeGadget(const uint8_t *data, size_t size,
+                  const QMetaObject &metaObject, void *gadget) noexcept(false);
+
+///
+/// \brief encodeObject appends the properties of \a object as document to \a w
+/// \throw BSONexception on unsupported value, \a w is left unchanged
+///
+void encodeObject(Writer &w, const QObject *object) noexcept(false);
+
+///
+/// \brief decodeObject writes the fields of the document at \a data to \a object
+/// \throw BSONexception on malformed document or inconvertible value
+///
+void decodeObject(const uint8_t *data, size_t size,
+                  QObject *object) noexcept(false);
+
+template <typename T>
+struct IsGadget
+{
+    static const bool value = QtPrivate::IsGadgetHelper<T>::IsGadgetOrDerivedFrom &&
+            !StructTraits<T>::defined;
+};
+
+///
+/// \brief toBson encodes the properties of a QObject
+/// \param ok indicator false on not success, not success will not change
+/// \throw BSONexception on unsupported value without bool ok argument
+/// \return BSON document
+///
+bsoncxx::document::value toBson(const QObject &object, bool &ok) noexcept;
+bsoncxx::document::value toBson(const QObject &object) noexcept(false);
+
+///
+/// \brief fromBson sets the properties of \a object from \a bson
+/// \param ok indicator false on not success, not success will not change
+/// \throw BSONexception on malformed document without bool ok argument
+///
+void fromBson(const bsoncxx::document::view &bson, QObject *object,
+              bool &ok) noexcept;
+void fromBson(const bsoncxx::document::view &bson,
+              QObject *object) noexcept(false);
+
+template <typename T>
+typename std::enable_if<IsGadget<T>::value, bsoncxx::document::value>::type
+toBson(const T &gadget) noexcept(false) {
+    Writer w;
+    encodeGadget(w, T::staticMetaObject, &gadget);
+    const size_t length = w.size();
+    return bsoncxx::document::value(w.release(), length, &Writer::freeBuffer);
+}
+
+template <typename T>
+typename std::enable_if<IsGadget<T>::value, T>::type
+fromBson(const bsoncxx::document::view &bson) noexcept(false) {
+    T res;
+    decodeGadget(bson.data(), bson.length(), T::staticMetaObject, &res);
+    return res;
+}
+
+template <typename T>
+typename std::enable_if<IsGadget<T>::value, T>::type
+fromBson(const bsoncxx::document::view &bson, bool &ok) noexcept {
+    try {
+        return fromBson<T>(bson);
+    } catch (...) {
+        ok = false;
+        return T();
+    }
+}
+
+}
+
+#endif // QBSON_META_H
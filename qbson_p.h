@@ -0,0 +1,267 @@
+#ifndef QBSON_P_H
+#define QBSON_P_H
+
+//
+// Internal helpers of qbson.cpp shared with the other translation units
+// of the library. Not part of the public API.
+//
+
+#include <QVariant>
+
+#ifdef QBSON_STATS
+#include <QAtomicInteger>
+#include <QtAlgorithms>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#endif
+
+#include "qbson.h"
+#include "qbson_reader.h"
+#include "qbson_writer.h"
+
+namespace BSON {
+namespace _private {
+
+///
+/// \brief setError fills \a err for a failure at the current level
+/// \return false, to be returned by the failing function
+///
+inline bool setError(Error &err, Error::Code code, int type) {
+    err.code = code;
+    err.type = type;
+    err.path.clear();
+    return false;
+}
+
+inline void keepBuffer(std::uint8_t *) {}
+
+///
+/// \brief emptyDocumentValue returns {} without allocating, for noexcept
+/// functions that have to return a value after a failed allocation
+///
+inline bsoncxx::document::value emptyDocumentValue() {
+    static const std::uint8_t empty[5] = {5, 0, 0, 0, 0};
+    return bsoncxx::document::value((std::uint8_t*) empty, sizeof(empty), &keepBuffer);
+}
+
+inline bsoncxx::array::value emptyArrayValue() {
+    static const std::uint8_t empty[5] = {5, 0, 0, 0, 0};
+    return bsoncxx::array::value((std::uint8_t*) empty, sizeof(empty), &keepBuffer);
+}
+
+///
+/// \brief appendValue writes \a v as value of the element opened at \a typePos
+/// \return false with \a err set on unsupported value, the element is
+/// left incomplete and the caller truncates the writer
+///
+bool appendValue(Writer &w, size_t typePos, const QVariant &v, Error &err);
+
+///
+/// \brief appendValue
+/// \throw BSONexception on unsupported value
+///
+void appendValue(Writer &w, size_t typePos, const QVariant &v);
+
+///
+/// \brief decodeValue converts one raw element into a QVariant
+/// \return false with \a err set on unknown type or malformed nested document
+///
+bool decodeValue(const Element &e, QVariant &res, Error &err);
+
+///
+/// \brief decodeValue
+/// \throw BSONexception on unknown type or malformed nested document
+///
+QVariant decodeValue(const Element &e);
+
+void initTypes();
+
+///
+/// Compact encoding of common Qt types in binary subtype 0x80: marker,
+/// format version, tag and a little endian payload. QDataStream blobs
+/// start with the high byte of a QVariant type id, always 0x00.
+///
+namespace TaggedBinary {
+enum : std::uint8_t { Marker = 0xb5, Version = 1 };
+enum Tag : std::uint8_t {
+    Date = 1,       ///< int64 julian day
+    Time,           ///< int32 msecs since start of day, -1 if invalid
+    Point,          ///< int32 x, y
+    Size,           ///< int32 width, height
+    Rect,           ///< int32 left, top, right, bottom
+    VersionNumber   ///< int32 per segment
+};
+}
+
+///
+/// \brief The Converter struct is the encoding of a type without native mapping
+///
+struct Converter {
+    enum Kind : std::uint8_t {
+        Unresolved = 0,
+        Unsupported,
+        Binary,
+        Code,
+        CodeWScope,
+        MaxKey,
+        MinKey,
+        Oid,
+        Regexp,
+        Custom,
+        ToMap,
+        ToList,
+        ToLongLong,
+        ToInt,
+        ToString,
+        DataStream,
+        Tagged,
+        OrderedDocument
+    };
+
+    Kind kind = Unresolved;
+    /// user subtype of Custom, TaggedBinary::Tag of Tagged
+    std::uint8_t subType = 0;
+    int metaType = 0;
+    AnyFunction encode = nullptr;
+    EncodeThunk encodeThunk = nullptr;
+    AnyFunction decode = nullptr;
+    DecodeThunk decodeThunk = nullptr;
+};
+
+///
+/// \brief initConverters fills the table with the BSON metatypes, called
+/// once by initTypes()
+///
+void initConverters();
+
+///
+/// \brief converterFor looks up the encoding of \a v
+///
+/// Types without registered converter are resolved through the canConvert
+/// chain on first use and the result is kept per metatype. Metatypes
+/// declared by the application without converter are Unsupported.
+///
+const Converter &converterFor(const QVariant &v);
+
+///
+/// \brief converterForSubType looks up the converter of a user binary subtype
+/// \return nullptr if none is registered
+///
+const Converter *converterForSubType(std::uint8_t subType);
+
+#ifdef QBSON_STATS
+
+///
+/// \brief The ThreadStats class holds the conversion counters of one thread
+///
+/// Counters are only written by the owning thread, with a plain load and
+/// store, and read by stats() under the registry lock. Fallback hits are
+/// rare and slow anyway, they go into a hash behind a per thread mutex.
+///
+class ThreadStats
+{
+public:
+    enum Direction { Encode, Decode };
+    enum Fallback { DataStream, CanConvert };
+
+    static const int latencyBuckets = 32;
+
+    ThreadStats();
+    ~ThreadStats();
+
+    static ThreadStats &local() {
+        static thread_local ThreadStats stats;
+        return stats;
+    }
+
+    void document(Direction d, size_t bytes) {
+        add(m_documents[d], 1);
+        add(m_bytes[d], bytes);
+    }
+
+    void type(Direction d, std::uint8_t type) { add(m_types[d][type], 1); }
+    void error(Direction d) { add(m_errors[d], 1); }
+
+    void fallback(Fallback kind, int metaType) {
+        QMutexLocker locker(&m_mutex);
+        ++m_fallbacks[kind][metaType];
+    }
+
+    void latency(Direction d, qint64 nsecs) {
+        const int bucket = nsecs > 0 ? 63 - int(qCountLeadingZeroBits(quint64(nsecs))) : 0;
+        add(m_latency[d][qMin(bucket, latencyBuckets - 1)], 1);
+    }
+
+    ///
+    /// \brief addTo sums the counters into \a res
+    ///
+    void addTo(Stats &res);
+
+private:
+    static void add(QAtomicInteger<quint64> &counter, quint64 n) {
+        counter.storeRelease(counter.loadAcquire() + n);
+    }
+
+    QAtomicInteger<quint64> m_documents[2];
+    QAtomicInteger<quint64> m_bytes[2];
+    QAtomicInteger<quint64> m_errors[2];
+    QAtomicInteger<quint64> m_types[2][256];
+    QAtomicInteger<quint64> m_latency[2][latencyBuckets];
+    QMutex m_mutex;
+    QHash<int, quint64> m_fallbacks[2];
+};
+
+extern QAtomicInt statsLatency;
+
+///
+/// \brief The LatencyTimer class times one conversion if histograms are on
+///
+class LatencyTimer
+{
+public:
+    LatencyTimer() {
+        if (statsLatency.loadAcquire())
+            m_timer.start();
+    }
+
+    void record(ThreadStats::Direction d) {
+        if (m_timer.isValid())
+            ThreadStats::local().latency(d, m_timer.nsecsElapsed());
+    }
+
+private:
+    QElapsedTimer m_timer;
+};
+
+#define QBSON_STATS_DOCUMENT(direction, bytes) \
+    BSON::_private::ThreadStats::local().document( \
+        BSON::_private::ThreadStats::direction, bytes)
+#define QBSON_STATS_TYPE(direction, type) \
+    BSON::_private::ThreadStats::local().type( \
+        BSON::_private::ThreadStats::direction, std::uint8_t(type))
+#define QBSON_STATS_ERROR(direction) \
+    BSON::_private::ThreadStats::local().error( \
+        BSON::_private::ThreadStats::direction)
+#define QBSON_STATS_FALLBACK(kind, metaType) \
+    BSON::_private::ThreadStats::local().fallback( \
+        BSON::_private::ThreadStats::kind, metaType)
+#define QBSON_STATS_TIMER(name) BSON::_private::LatencyTimer name
+#define QBSON_STATS_LATENCY(name, direction) \
+    name.record(BSON::_private::ThreadStats::direction)
+
+#else
+
+#define QBSON_STATS_DOCUMENT(direction, bytes) do {} while (false)
+#define QBSON_STATS_TYPE(direction, type) do {} while (false)
+#define QBSON_STATS_ERROR(direction) do {} while (false)
+#define QBSON_STATS_FALLBACK(kind, metaType) do {} while (false)
+#define QBSON_STATS_TIMER(name) do {} while (false)
+#define QBSON_STATS_LATENCY(name, direction) do {} while (false)
+
+#endif // QBSON_STATS
+
+}
+}
+
+#endif // QBSON_P_H
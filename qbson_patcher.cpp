@@ -0,0 +1,322 @@
+#include "qbson_patcher.h"
+#include "qbson_p.h"
+
+#include <limits>
+
+namespace BSON {
+
+namespace {
+
+QList<QByteArray> splitPath(const QString &path) {
+    return path.toUtf8().split('.');
+}
+
+bool addOverflows(qint64 a, qint64 b, qint64 &res) {
+    if ((b > 0 && a > std::numeric_limits<qint64>::max() - b)
+            || (b < 0 && a < std::numeric_limits<qint64>::min() - b))
+        return true;
+    res = a + b;
+    return false;
+}
+
+}
+
+bool Patcher::locate(const QList<QByteArray> &segments, Location &loc,
+                     Error &error) const
+{
+    using namespace _private;
+    using bsoncxx::type;
+
+    if (m_offset >= m_doc.size())
+        return setError(error, Error::MalformedDocument, 0);
+
+    const uint8_t *data = m_doc.data();
+    size_t doc = m_offset;
+    loc.parents.append(doc);
+
+    for (int i = 0; i < segments.size(); ++i) {
+        const QByteArray &key = segments.at(i);
+        ElementReader reader(data + doc, m_doc.size() - doc);
+        Element e;
+        bool found = false;
+        loc.parentCount = 0;
+        while (reader.next(e)) {
+            if (e.keyEquals(key.constData(), size_t(key.size()))) {
+                found = true;
+                break;
+            }
+            ++loc.parentCount;
+        }
+
+        if (!found) {
+            if (reader.hasError())
+                return setError(error, loc.parentIsArray ? Error::MalformedArray
+                                                         : Error::MalformedDocument, 0);
+            loc.pos = doc + reader.size() - 1;
+            loc.missing = i;
+            return true;
+        }
+
+        loc.pos = size_t((const uint8_t*) e.key - 1 - data);
+        loc.valuePos = size_t(e.value - data);
+        loc.size = loc.valuePos + e.valueSize - loc.pos;
+        loc.type = e.type;
+
+        if (i == segments.size() - 1)
+            break;
+        if (e.type != type::k_document && e.type != type::k_array)
+            return setError(error, Error::PathConflict, int(e.type));
+
+        loc.parentIsArray = e.type == type::k_array;
+        doc = loc.valuePos;
+        loc.parents.append(doc);
+    }
+
+    return true;
+}
+
+void Patcher::splice(const Location &loc, size_t pos, size_t removed)
+{
+    const size_t inserted = m_scratch.size();
+    std::memcpy(m_doc.splice(pos, removed, inserted), m_scratch.data(), inserted);
+
+    if (inserted == removed)
+        return;
+
+    const int32_t delta = int32_t(inserted) - int32_t(removed);
+    for (size_t parent : loc.parents)
+        m_doc.patchInt32(parent, loadInt32(m_doc.data() + parent) + delta);
+}
+
+bool Patcher::replace(const QList<QByteArray> &segments, const Location &loc,
+                      const QVariant &value, Error &error)
+{
+    using namespace _private;
+
+    const int first = loc.missing < 0 ? segments.size() - 1 : loc.missing;
+
+    if (loc.missing >= 0 && loc.parentIsArray) {
+        char index[10];
+        const size_t n = Writer::formatIndex(loc.parentCount, index);
+        const QByteArray &key = segments.at(first);
+        if (size_t(key.size()) != n || std::memcmp(key.constData(), index, n) != 0)
+            return setError(error, Error::PathConflict, int(bsoncxx::type::k_array));
+    }
+
+    m_scratch.clear();
+
+    // missing documents on the path are written around the value
+    QVarLengthArray<size_t, 8> starts;
+    size_t typePos = m_scratch.beginElement(segments.at(first).constData(),
+                                            size_t(segments.at(first).size()));
+    for (int i = first + 1; i < segments.size(); ++i) {
+        m_scratch.setElementType(typePos, bsoncxx::type::k_document);
+        starts.append(m_scratch.beginDocument());
+        typePos = m_scratch.beginElement(segments.at(i).constData(),
+                                         size_t(segments.at(i).size()));
+    }
+
+    if (!appendValue(m_scratch, typePos, value, error))
+        return false;
+
+    for (int i = starts.size() - 1; i >= 0; --i)
+        m_scratch.endDocument(starts.at(i));
+
+    splice(loc, loc.pos, loc.missing < 0 ? loc.size : 0);
+    return true;
+}
+
+bool Patcher::addNumber(const QString &path, qint64 intDelta, double doubleDelta,
+                        bool isDouble, Error &error)
+{
+    using namespace _private;
+    using bsoncxx::type;
+
+    const QList<QByteArray> segments = splitPath(path);
+    Location loc;
+    if (!locate(segments, loc, error))
+        return false;
+
+    if (loc.missing >= 0) {
+        QVariant value;
+        if (isDouble)
+            value = doubleDelta;
+        else if (intDelta >= std::numeric_limits<int32_t>::min()
+                 && intDelta <= std::numeric_limits<int32_t>::max())
+            value = int(intDelta);
+        else
+            value = intDelta;
+        return replace(segments, loc, value, error);
+    }
+
+    uint8_t *p = m_doc.mutableData() + loc.valuePos;
+
+    switch (loc.type) {
+    case type::k_int32: {
+        const qint64 current = loadInt32(p);
+        if (isDouble)
+            return replace(segments, loc, double(current) + doubleDelta, error);
+
+        qint64 res;
+        if (addOverflows(current, intDelta, res))
+            return setError(error, Error::InvalidValue, QMetaType::LongLong);
+        if (res < std::numeric_limits<int32_t>::min()
+                || res > std::numeric_limits<int32_t>::max())
+            return replace(segments, loc, res, error);
+
+        Writer::storeInt32(p, int32_t(res));
+        return true;
+    }
+    case type::k_int64: {
+        const qint64 current = loadInt64(p);
+        if (isDouble)
+            return replace(segments, loc, double(current) + doubleDelta, error);
+
+        qint64 res;
+        if (addOverflows(current, intDelta, res))
+            return setError(error, Error::InvalidValue, QMetaType::LongLong);
+
+        Writer::storeInt64(p, res);
+        return true;
+    }
+    case type::k_double: {
+        const double res = loadDouble(p) + (isDouble ? doubleDelta : double(intDelta));
+        int64_t bits;
+        std::memcpy(&bits, &res, sizeof(bits));
+        Writer::storeInt64(p, bits);
+        return true;
+    }
+    default:
+        break;
+    }
+
+    return setError(error, Error::PathConflict, int(loc.type));
+}
+
+void Patcher::set(const QString &path, const QVariant &value)
+{
+    Error error;
+    if (!set(path, value, error))
+        throw BSONexception(error.toString());
+}
+
+bool Patcher::set(const QString &path, const QVariant &value, Error &error)
+noexcept
+{
+    using namespace _private;
+
+    initTypes();
+    error.clear();
+
+    try {
+        const QList<QByteArray> segments = splitPath(path);
+        Location loc;
+        if (locate(segments, loc, error) && replace(segments, loc, value, error))
+            return true;
+    } catch (...) {
+        setError(error, Error::UnknownException, 0);
+    }
+    error.prependPath(path);
+    return false;
+}
+
+void Patcher::unset(const QString &path)
+{
+    Error error;
+    if (!unset(path, error))
+        throw BSONexception(error.toString());
+}
+
+bool Patcher::unset(const QString &path, Error &error)
+noexcept
+{
+    using namespace _private;
+
+    error.clear();
+
+    try {
+        Location loc;
+        if (locate(splitPath(path), loc, error)) {
+            if (loc.missing < 0) {
+                m_scratch.clear();
+                // an array keeps its indexes, the element becomes null
+                if (loc.parentIsArray) {
+                    const uint8_t *key = m_doc.data() + loc.pos + 1;
+                    m_scratch.appendKey(bsoncxx::type::k_null, (const char*) key,
+                                        loc.valuePos - loc.pos - 2);
+                }
+                splice(loc, loc.pos, loc.size);
+            }
+            return true;
+        }
+        if (error.code == Error::PathConflict) {
+            error.clear();
+            return true;
+        }
+    } catch (...) {
+        setError(error, Error::UnknownException, 0);
+    }
+    error.prependPath(path);
+    return false;
+}
+
+void Patcher::increment(const QString &path, qint64 delta)
+{
+    Error error;
+    if (!increment(path, delta, error))
+        throw BSONexception(error.toString());
+}
+
+bool Patcher::increment(const QString &path, qint64 delta, Error &error)
+noexcept
+{
+    using namespace _private;
+
+    initTypes();
+    error.clear();
+
+    try {
+        if (addNumber(path, delta, 0, false, error))
+            return true;
+    } catch (...) {
+        setError(error, Error::UnknownException, 0);
+    }
+    error.prependPath(path);
+    return false;
+}
+
+void Patcher::increment(const QString &path, double delta)
+{
+    Error error;
+    if (!increment(path, delta, error))
+        throw BSONexception(error.toString());
+}
+
+bool Patcher::increment(const QString &path, double delta, Error &error)
+noexcept
+{
+    using namespace _private;
+
+    initTypes();
+    error.clear();
+
+    try {
+        if (addNumber(path, 0, delta, true, error))
+            return true;
+    } catch (...) {
+        setError(error, Error::UnknownException, 0);
+    }
+    error.prependPath(path);
+    return false;
+}
+
+bsoncxx::document::view Patcher::view() const
+{
+    if (m_offset >= m_doc.size())
+        return bsoncxx::document::view();
+
+    const uint8_t *data = m_doc.data() + m_offset;
+    return bsoncxx::document::view(data, documentSize(data, m_doc.size() - m_offset));
+}
+
+}
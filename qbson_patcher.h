@@ -0,0 +1,126 @@
+#ifndef QBSON_PATCHER_H
+#define QBSON_PATCHER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <QVarLengthArray>
+#include <QVariant>
+
+#include <type_traits>
+
+#include <bsoncxx/document/view.hpp>
+
+#include "qbson.h"
+
+namespace BSON {
+
+///
+/// \brief The Patcher class edits a raw BSON document in place
+///
+/// Fields are addressed by dotted path ("a.b.3.c"). A new value of the
+/// same encoded size overwrites the old bytes, int32, int64, double,
+/// bool, date and oid values are never moved. Added, removed and resized
+/// fields are spliced into the buffer and the length prefixes of the
+/// enclosing documents are fixed up, so the cost follows the size of the
+/// edit and of the bytes behind it, not the size of the document.
+///
+/// set() creates missing documents on the path like MongoDB's $set. In an
+/// array only the next index can be added. On failure the document is
+/// left unchanged.
+///
+/// A Patcher is not thread safe, it keeps a scratch buffer between calls.
+///
+class Patcher
+{
+public:
+    ///
+    /// \param document writer holding the document at \a offset, it must
+    /// outlive the patcher
+    ///
+    explicit Patcher(Writer &document, size_t offset = 0)
+        : m_doc(document), m_offset(offset) {}
+
+    ///
+    /// \brief set replaces or adds the field at \a path
+    /// \throw BSONexception on unsupported value, path conflict or
+    /// malformed document without Error argument
+    ///
+    void set(const QString &path, const QVariant &value) noexcept(false);
+    bool set(const QString &path, const QVariant &value, Error &error) noexcept;
+
+    ///
+    /// \brief unset removes the field at \a path
+    ///
+    /// A missing field, or a path through a value that is no document or
+    /// array, is no error, as with MongoDB's $unset. An array element is
+    /// set to null, so the following indexes are kept.
+    ///
+    void unset(const QString &path) noexcept(false);
+    bool unset(const QString &path, Error &error) noexcept;
+
+    ///
+    /// \brief increment adds \a delta to the number at \a path
+    ///
+    /// A missing field is set to \a delta. An int32 that overflows becomes
+    /// an int64, an integer incremented by a double becomes a double. An
+    /// int64 overflow is reported as Error::InvalidValue.
+    ///
+    void increment(const QString &path, qint64 delta) noexcept(false);
+    bool increment(const QString &path, qint64 delta, Error &error) noexcept;
+    void increment(const QString &path, double delta) noexcept(false);
+    bool increment(const QString &path, double delta, Error &error) noexcept;
+
+    /// other integer types, quint64 deltas above the qint64 range wrap
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value>::type
+    increment(const QString &path, T delta) noexcept(false) {
+        increment(path, qint64(delta));
+    }
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, bool>::type
+    increment(const QString &path, T delta, Error &error) noexcept {
+        return increment(path, qint64(delta), error);
+    }
+
+    ///
+    /// \brief view of the patched document, valid until the next change
+    ///
+    bsoncxx::document::view view() const;
+
+private:
+    ///
+    /// \brief The Location struct is the outcome of resolving a path
+    ///
+    struct Location {
+        /// offsets of the enclosing documents, the root first
+        QVarLengthArray<size_t, 8> parents;
+        /// offset of the element, or of the terminating zero of the
+        /// innermost document if a segment is missing
+        size_t pos = 0;
+        /// encoded element size, 0 if missing
+        size_t size = 0;
+        size_t valuePos = 0;
+        bsoncxx::type type = bsoncxx::type::k_null;
+        /// first missing segment, -1 if the field exists
+        int missing = -1;
+        bool parentIsArray = false;
+        /// elements of the innermost document
+        uint32_t parentCount = 0;
+    };
+
+    bool locate(const QList<QByteArray> &segments, Location &loc, Error &error) const;
+    bool replace(const QList<QByteArray> &segments, const Location &loc,
+                 const QVariant &value, Error &error);
+    bool addNumber(const QString &path, qint64 intDelta, double doubleDelta,
+                   bool isDouble, Error &error);
+    void splice(const Location &loc, size_t pos, size_t removed);
+
+    Writer &m_doc;
+    size_t m_offset;
+    Writer m_scratch;
+};
+
+}
+
+#endif // QBSON_PATCHER_H
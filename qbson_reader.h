@@ -0,0 +1,270 @@
+#ifndef QBSON_READER_H
+#define QBSON_READER_H
+
+#include <cstdint>
+#include <cstring>
+
+#include <bsoncxx/types.hpp>
+
+namespace BSON {
+
+inline std::int32_t loadInt32(const std::uint8_t *p) {
+    return std::int32_t(std::uint32_t(p[0]) |
+                        std::uint32_t(p[1]) << 8 |
+                        std::uint32_t(p[2]) << 16 |
+                        std::uint32_t(p[3]) << 24);
+}
+
+inline std::int64_t loadInt64(const std::uint8_t *p) {
+    std::uint64_t v = 0;
+    for (int i = 7; i >= 0; --i)
+        v = v << 8 | p[i];
+    return std::int64_t(v);
+}
+
+inline double loadDouble(const std::uint8_t *p) {
+    const std::int64_t bits = loadInt64(p);
+    double res;
+    std::memcpy(&res, &bits, sizeof(res));
+    return res;
+}
+
+///
+/// \brief documentSize validates the framing of the document at \a data
+/// \param available bytes readable at \a data
+/// \return document length, 0 if \a data does not hold a complete document
+///
+inline std::size_t documentSize(const std::uint8_t *data, std::size_t available) {
+    if (available < 5)
+        return 0;
+    const std::int32_t len = loadInt32(data);
+    if (len < 5 || std::size_t(len) > available || data[len - 1] != 0)
+        return 0;
+    return std::size_t(len);
+}
+
+///
+/// \brief stringSize validates a length prefixed, zero terminated string
+/// \return false if the string does not fit into \a available bytes
+///
+inline bool stringSize(const std::uint8_t *p, std::size_t available,
+                       std::size_t &size) {
+    if (available < 4)
+        return false;
+    const std::int32_t len = loadInt32(p);
+    if (len < 1 || std::size_t(len) > available - 4 || p[4 + len - 1] != 0)
+        return false;
+    size = 4 + std::size_t(len);
+    return true;
+}
+
+///
+/// \brief valueSize computes the encoded size of a value of type \a t
+/// \param p first byte of the value
+/// \param available bytes readable at \a p
+/// \return false on unknown type or if the value exceeds \a available
+///
+inline bool valueSize(bsoncxx::type t, const std::uint8_t *p,
+                      std::size_t available, std::size_t &size) {
+    using bsoncxx::type;
+
+    switch (t) {
+    case type::k_double:
+    case type::k_date:
+    case type::k_int64:
+    case type::k_timestamp:
+        size = 8;
+        break;
+    case type::k_int32:
+        size = 4;
+        break;
+    case type::k_bool:
+        size = 1;
+        break;
+    case type::k_oid:
+        size = 12;
+        break;
+    case type::k_decimal128:
+        size = 16;
+        break;
+    case type::k_null:
+    case type::k_undefined:
+    case type::k_minkey:
+    case type::k_maxkey:
+        size = 0;
+        break;
+    case type::k_utf8:
+    case type::k_code:
+    case type::k_symbol:
+        return stringSize(p, available, size);
+    case type::k_document:
+    case type::k_array:
+        size = documentSize(p, available);
+        return size != 0;
+    case type::k_binary: {
+        if (available < 5)
+            return false;
+        const std::int32_t len = loadInt32(p);
+        if (len < 0 || std::size_t(len) > available - 5)
+            return false;
+        size = 5 + std::size_t(len);
+        return true;
+    }
+    case type::k_regex: {
+        const void *end = std::memchr(p, 0, available);
+        if (!end)
+            return false;
+        const std::size_t first = std::size_t((const std::uint8_t*) end - p) + 1;
+        end = std::memchr(p + first, 0, available - first);
+        if (!end)
+            return false;
+        size = std::size_t((const std::uint8_t*) end - p) + 1;
+        return true;
+    }
+    case type::k_dbpointer: {
+        std::size_t len;
+        if (!stringSize(p, available, len) || available - len < 12)
+            return false;
+        size = len + 12;
+        return true;
+    }
+    case type::k_codewscope: {
+        if (available < 4)
+            return false;
+        const std::int32_t len = loadInt32(p);
+        if (len < 14 || std::size_t(len) > available)
+            return false;
+        std::size_t code;
+        if (!stringSize(p + 4, std::size_t(len) - 4, code))
+            return false;
+        const std::size_t scope = documentSize(p + 4 + code,
+                                               std::size_t(len) - 4 - code);
+        if (!scope || 4 + code + scope != std::size_t(len))
+            return false;
+        size = std::size_t(len);
+        return true;
+    }
+    default:
+        return false;
+    }
+
+    return size <= available;
+}
+
+///
+/// \brief The Element struct describes one element of a raw BSON document
+///
+/// Key and value point into the document buffer, nothing is copied. The
+/// value has already been bounds checked by ElementReader::next().
+///
+struct Element
+{
+    bsoncxx::type type;
+    const char *key;
+    std::size_t keySize;
+    const std::uint8_t *value;
+    std::size_t valueSize;
+
+    bool keyEquals(const char *name, std::size_t size) const {
+        return keySize == size && std::memcmp(key, name, size) == 0;
+    }
+
+    std::int32_t int32() const { return loadInt32(value); }
+    std::int64_t int64() const { return loadInt64(value); }
+    double dbl() const { return loadDouble(value); }
+    bool boolean() const { return value[0] != 0; }
+
+    /// utf8, code and symbol payload without the terminating zero
+    const char *string() const { return (const char*) value + 4; }
+    std::size_t stringSize() const { return valueSize - 5; }
+
+    bsoncxx::binary_sub_type binarySubType() const {
+        return bsoncxx::binary_sub_type(value[4]);
+    }
+    const std::uint8_t *binaryData() const { return value + 5; }
+    std::size_t binarySize() const { return valueSize - 5; }
+
+    /// regex pattern and options, both zero terminated
+    const char *regexPattern() const { return (const char*) value; }
+    const char *regexOptions() const {
+        return regexPattern() + std::strlen(regexPattern()) + 1;
+    }
+};
+
+///
+/// \brief The ElementReader class walks the elements of a raw BSON document
+///
+/// The reader validates the document framing on construction and every
+/// element before returning it, so malformed input never reads outside
+/// the buffer. next() returns false at the end of the document or on the
+/// first malformed element, hasError() tells both apart.
+///
+class ElementReader
+{
+public:
+    ElementReader(const std::uint8_t *data, std::size_t size)
+        : m_data(data), m_size(documentSize(data, size)),
+          m_pos(4), m_error(m_size == 0) {}
+
+    bool hasError() const { return m_error; }
+
+    ///
+    /// \brief size of the document, 0 if the framing was invalid
+    ///
+    std::size_t size() const { return m_size; }
+
+    ///
+    /// \brief offset of the next element relative to the document start
+    ///
+    std::size_t offset() const { return m_pos; }
+
+    ///
+    /// \brief seek continues reading at \a offset
+    /// \param offset a value previously returned by offset() for this document
+    ///
+    void seek(std::size_t offset) { m_pos = offset; }
+
+    bool next(Element &e) {
+        if (m_error)
+            return false;
+
+        const std::uint8_t t = m_data[m_pos];
+        if (t == 0) {
+            m_error = m_pos != m_size - 1;
+            return false;
+        }
+
+        const std::size_t limit = m_size - 1;
+        const std::size_t keyStart = m_pos + 1;
+        const void *nul = std::memchr(m_data + keyStart, 0, limit - keyStart);
+        if (!nul) {
+            m_error = true;
+            return false;
+        }
+
+        e.type = bsoncxx::type(t);
+        e.key = (const char*) m_data + keyStart;
+        e.keySize = std::size_t((const std::uint8_t*) nul - (m_data + keyStart));
+
+        const std::size_t valueStart = keyStart + e.keySize + 1;
+        if (!valueSize(e.type, m_data + valueStart, limit - valueStart,
+                       e.valueSize)) {
+            m_error = true;
+            return false;
+        }
+        e.value = m_data + valueStart;
+
+        m_pos = valueStart + e.valueSize;
+        return true;
+    }
+
+private:
+    const std::uint8_t *m_data;
+    std::size_t m_size;
+    std::size_t m_pos;
+    bool m_error;
+};
+
+}
+
+#endif // QBSON_READER_H
@@ -0,0 +1,164 @@
+#include "qbson.h"
+#include "qbson_p.h"
+
+#ifdef QBSON_STATS
+#include <QSet>
+#endif
+
+namespace BSON {
+namespace _private {
+
+#ifdef QBSON_STATS
+
+QAtomicInt statsLatency(0);
+
+///
+/// \brief The StatsRegistry struct tracks the live ThreadStats
+///
+/// Counters of finished threads are kept in \a retired. resetStats() does
+/// not touch the counters of other threads, it records a \a baseline that
+/// stats() subtracts.
+///
+struct StatsRegistry {
+    QMutex mutex;
+    QSet<ThreadStats*> threads;
+    Stats retired;
+    Stats baseline;
+
+    static StatsRegistry &instance() {
+        static StatsRegistry registry;
+        return registry;
+    }
+
+    /// caller holds the mutex
+    Stats collect() {
+        Stats res = retired;
+        for (ThreadStats *stats : threads)
+            stats->addTo(res);
+        return res;
+    }
+};
+
+template <typename Key>
+void subtract(QMap<Key, quint64> &res, const QMap<Key, quint64> &other) {
+    for (auto it = other.cbegin(); it != other.cend(); ++it) {
+        auto found = res.find(it.key());
+        if (found == res.end())
+            continue;
+        if (found.value() > it.value())
+            found.value() -= it.value();
+        else
+            res.erase(found);
+    }
+}
+
+void subtract(QVector<quint64> &res, const QVector<quint64> &other) {
+    for (int i = 0; i < res.size() && i < other.size(); ++i)
+        res[i] -= other.at(i);
+}
+
+void subtract(Stats &res, const Stats &other) {
+    res.documentsEncoded -= other.documentsEncoded;
+    res.documentsDecoded -= other.documentsDecoded;
+    res.bytesEncoded -= other.bytesEncoded;
+    res.bytesDecoded -= other.bytesDecoded;
+    res.encodeErrors -= other.encodeErrors;
+    res.decodeErrors -= other.decodeErrors;
+    subtract(res.typesEncoded, other.typesEncoded);
+    subtract(res.typesDecoded, other.typesDecoded);
+    subtract(res.dataStreamFallbacks, other.dataStreamFallbacks);
+    subtract(res.canConvertFallbacks, other.canConvertFallbacks);
+    subtract(res.encodeLatency, other.encodeLatency);
+    subtract(res.decodeLatency, other.decodeLatency);
+}
+
+ThreadStats::ThreadStats()
+{
+    StatsRegistry &registry = StatsRegistry::instance();
+    QMutexLocker locker(&registry.mutex);
+    registry.threads.insert(this);
+}
+
+ThreadStats::~ThreadStats()
+{
+    StatsRegistry &registry = StatsRegistry::instance();
+    QMutexLocker locker(&registry.mutex);
+    registry.threads.remove(this);
+    addTo(registry.retired);
+}
+
+void ThreadStats::addTo(Stats &res)
+{
+    res.documentsEncoded += m_documents[Encode].loadAcquire();
+    res.documentsDecoded += m_documents[Decode].loadAcquire();
+    res.bytesEncoded += m_bytes[Encode].loadAcquire();
+    res.bytesDecoded += m_bytes[Decode].loadAcquire();
+    res.encodeErrors += m_errors[Encode].loadAcquire();
+    res.decodeErrors += m_errors[Decode].loadAcquire();
+
+    for (int type = 0; type < 256; ++type) {
+        if (const quint64 n = m_types[Encode][type].loadAcquire())
+            res.typesEncoded[type] += n;
+        if (const quint64 n = m_types[Decode][type].loadAcquire())
+            res.typesDecoded[type] += n;
+    }
+
+    res.encodeLatency.resize(latencyBuckets);
+    res.decodeLatency.resize(latencyBuckets);
+    for (int bucket = 0; bucket < latencyBuckets; ++bucket) {
+        res.encodeLatency[bucket] += m_latency[Encode][bucket].loadAcquire();
+        res.decodeLatency[bucket] += m_latency[Decode][bucket].loadAcquire();
+    }
+
+    QMutexLocker locker(&m_mutex);
+    for (auto it = m_fallbacks[DataStream].cbegin();
+         it != m_fallbacks[DataStream].cend(); ++it)
+        res.dataStreamFallbacks[QMetaType::typeName(it.key())] += it.value();
+    for (auto it = m_fallbacks[CanConvert].cbegin();
+         it != m_fallbacks[CanConvert].cend(); ++it)
+        res.canConvertFallbacks[QMetaType::typeName(it.key())] += it.value();
+}
+
+#endif // QBSON_STATS
+
+}
+
+Stats stats()
+{
+#ifdef QBSON_STATS
+    using namespace _private;
+    StatsRegistry &registry = StatsRegistry::instance();
+    QMutexLocker locker(&registry.mutex);
+
+    Stats res = registry.collect();
+    subtract(res, registry.baseline);
+    res.encodeLatency.resize(ThreadStats::latencyBuckets);
+    res.decodeLatency.resize(ThreadStats::latencyBuckets);
+    res.enabled = true;
+    return res;
+#else
+    return Stats();
+#endif
+}
+
+void resetStats()
+{
+#ifdef QBSON_STATS
+    using namespace _private;
+    StatsRegistry &registry = StatsRegistry::instance();
+    QMutexLocker locker(&registry.mutex);
+
+    registry.baseline = registry.collect();
+#endif
+}
+
+void setStatsLatency(bool enabled)
+{
+#ifdef QBSON_STATS
+    _private::statsLatency.storeRelease(enabled ? 1 : 0);
+#else
+    Q_UNUSED(enabled)
+#endif
+}
+
+}
@@ -0,0 +1,419 @@
+#ifndef QBSON_STRUCT_H
+#define QBSON_STRUCT_H
+
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <QList>
+#include <QVector>
+
+#include "qbson.h"
+
+///
+/// Typed mapping of plain C++ structs to BSON
+///
+/// QBSON_DECLARE_STRUCT lists the fields of a struct once and generates
+/// encode and decode functions for it at compile time. Fields are written
+/// and read straight from BSON, without QVariant, QMap or a per value type
+/// switch:
+///
+///     struct Item { BSONoid _id; QString name; qint64 count; QVector<double> prices; };
+///     QBSON_DECLARE_STRUCT(Item, _id, name, count, prices)
+///
+///     bsoncxx::document::value doc = BSON::toBson(item);
+///     Item item = BSON::fromBson<Item>(doc.view());
+///
+/// Field types need a BSON::FieldCodec: bool, int, qint64, double, QString,
+/// std::string, QByteArray, QDateTime, BSONoid, QVariantMap, declared structs
+/// and QVector, QList or std::vector of those. Unknown keys are ignored on
+/// decode, fields missing from the document keep their value. The macro has
+/// to be used in the global namespace, nested structs are declared first.
+///
+
+namespace BSON {
+
+template <typename T>
+struct StructTraits
+{
+    static const bool defined = false;
+};
+
+template <typename T, typename Enable = void>
+struct FieldCodec;
+
+///
+/// \brief encodeStruct appends \a value as document to \a w
+///
+template <typename T>
+void encodeStruct(Writer &w, const T &value) {
+    const size_t start = w.beginDocument();
+    StructTraits<T>::encodeFields(w, value);
+    w.endDocument(start);
+}
+
+///
+/// \brief decodeStruct decodes the fields of the document at \a data into \a value
+/// \throw BSONexception on malformed document or field of incompatible type
+///
+template <typename T>
+void decodeStruct(const uint8_t *data, size_t size, T &value) {
+    ElementReader reader(data, size);
+    Element e;
+    while (reader.next(e)) {
+        if (!StructTraits<T>::decodeField(e, value))
+            throw BSONexception(QString("Error in field %1")
+                                .arg(QString::fromUtf8(e.key, int(e.keySize))));
+    }
+
+    if (reader.hasError())
+        throw BSONexception("BSON::fromBson malformed document");
+}
+
+template <typename T>
+typename std::enable_if<StructTraits<T>::defined, bsoncxx::document::value>::type
+toBson(const T &value) noexcept(false) {
+    Writer w;
+    encodeStruct(w, value);
+    const size_t length = w.size();
+    return bsoncxx::document::value(w.release(), length, &Writer::freeBuffer);
+}
+
+template <typename T>
+typename std::enable_if<StructTraits<T>::defined, T>::type
+fromBson(const bsoncxx::document::view &bson) noexcept(false) {
+    T res;
+    decodeStruct(bson.data(), bson.length(), res);
+    return res;
+}
+
+template <typename T>
+typename std::enable_if<StructTraits<T>::defined, T>::type
+fromBson(const bsoncxx::document::view &bson, bool &ok) noexcept {
+    try {
+        return fromBson<T>(bson);
+    } catch (...) {
+        ok = false;
+        return T();
+    }
+}
+
+namespace _private {
+
+template <typename T, typename S>
+typename std::enable_if<std::is_floating_point<T>::value, bool>::type
+convertNumber(S from, T &to) {
+    to = T(from);
+    return true;
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value, bool>::type
+convertNumber(qint64 from, T &to) {
+    if (from < qint64(std::numeric_limits<T>::min())
+            || from > qint64(std::numeric_limits<T>::max()))
+        return false;
+    to = T(from);
+    return true;
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value, bool>::type
+convertNumber(double from, T &to) {
+    // -2^(n-1) <= from < 2^(n-1), false for NaN
+    const double limit = -double(std::numeric_limits<T>::min());
+    if (!(from >= -limit && from < limit))
+        return false;
+    to = T(from);
+    return true;
+}
+
+///
+/// \brief loadNumber reads any numeric element into \a value
+/// \return false for other types and for values out of the range of T
+///
+template <typename T>
+bool loadNumber(const Element &e, T &value) {
+    switch (e.type) {
+    case bsoncxx::type::k_int32: return convertNumber(qint64(e.int32()), value);
+    case bsoncxx::type::k_int64: return convertNumber(qint64(e.int64()), value);
+    case bsoncxx::type::k_double: return convertNumber(e.dbl(), value);
+    case bsoncxx::type::k_null: return true;
+    default: return false;
+    }
+}
+
+template <typename C>
+struct SequenceCodec
+{
+    typedef typename C::value_type Value;
+
+    static void encode(Writer &w, size_t typePos, const C &value) {
+        w.setElementType(typePos, bsoncxx::type::k_array);
+        const size_t start = w.beginDocument();
+        uint32_t index = 0;
+        for (auto it = value.begin(); it != value.end(); ++it, ++index)
+            FieldCodec<Value>::encode(w, w.beginIndexElement(index), *it);
+        w.endDocument(start);
+    }
+
+    static bool decode(const Element &e, C &value) {
+        value.clear();
+        if (e.type == bsoncxx::type::k_null)
+            return true;
+        if (e.type != bsoncxx::type::k_array)
+            return false;
+
+        ElementReader reader(e.value, e.valueSize);
+        Element item;
+        while (reader.next(item)) {
+            Value v = Value();
+            if (!FieldCodec<Value>::decode(item, v))
+                return false;
+            value.push_back(v);
+        }
+        return !reader.hasError();
+    }
+};
+
+}
+
+template <>
+struct FieldCodec<bool>
+{
+    static void encode(Writer &w, size_t typePos, bool value) {
+        w.setElementType(typePos, bsoncxx::type::k_bool);
+        w.appendByte(value ? 1 : 0);
+    }
+    static bool decode(const Element &e, bool &value) {
+        if (e.type != bsoncxx::type::k_bool)
+            return e.type == bsoncxx::type::k_null;
+        value = e.boolean();
+        return true;
+    }
+};
+
+template <>
+struct FieldCodec<int>
+{
+    static void encode(Writer &w, size_t typePos, int value) {
+        w.setElementType(typePos, bsoncxx::type::k_int32);
+        w.appendInt32(value);
+    }
+    static bool decode(const Element &e, int &value) {
+        return _private::loadNumber(e, value);
+    }
+};
+
+template <>
+struct FieldCodec<qint64>
+{
+    static void encode(Writer &w, size_t typePos, qint64 value) {
+        w.setElementType(typePos, bsoncxx::type::k_int64);
+        w.appendInt64(value);
+    }
+    static bool decode(const Element &e, qint64 &value) {
+        return _private::loadNumber(e, value);
+    }
+};
+
+template <>
+struct FieldCodec<double>
+{
+    static void encode(Writer &w, size_t typePos, double value) {
+        w.setElementType(typePos, bsoncxx::type::k_double);
+        w.appendDouble(value);
+    }
+    static bool decode(const Element &e, double &value) {
+        return _private::loadNumber(e, value);
+    }
+};
+
+template <>
+struct FieldCodec<QString>
+{
+    static void encode(Writer &w, size_t typePos, const QString &value) {
+        w.setElementType(typePos, bsoncxx::type::k_utf8);
+        w.appendStringUtf16((const uint16_t*) value.constData(),
+                            size_t(value.size()));
+    }
+    static bool decode(const Element &e, QString &value) {
+        if (e.type != bsoncxx::type::k_utf8)
+            return e.type == bsoncxx::type::k_null;
+        value = stringFromUtf8(e.string(), e.stringSize());
+        return true;
+    }
+};
+
+template <>
+struct FieldCodec<std::string>
+{
+    static void encode(Writer &w, size_t typePos, const std::string &value) {
+        w.setElementType(typePos, bsoncxx::type::k_utf8);
+        w.appendString(value.data(), value.size());
+    }
+    static bool decode(const Element &e, std::string &value) {
+        if (e.type != bsoncxx::type::k_utf8)
+            return e.type == bsoncxx::type::k_null;
+        value.assign(e.string(), e.stringSize());
+        return true;
+    }
+};
+
+template <>
+struct FieldCodec<QByteArray>
+{
+    static void encode(Writer &w, size_t typePos, const QByteArray &value) {
+        w.setElementType(typePos, bsoncxx::type::k_binary);
+        w.appendBinary(bsoncxx::binary_sub_type::k_binary,
+                       value.constData(), size_t(value.size()));
+    }
+    static bool decode(const Element &e, QByteArray &value) {
+        if (e.type != bsoncxx::type::k_binary)
+            return e.type == bsoncxx::type::k_null;
+        value = QByteArray((const char*) e.binaryData(), int(e.binarySize()));
+        return true;
+    }
+};
+
+template <>
+struct FieldCodec<QDateTime>
+{
+    static void encode(Writer &w, size_t typePos, const QDateTime &value) {
+        w.setElementType(typePos, bsoncxx::type::k_date);
+        w.appendInt64(value.toMSecsSinceEpoch());
+    }
+    static bool decode(const Element &e, QDateTime &value) {
+        if (e.type != bsoncxx::type::k_date)
+            return e.type == bsoncxx::type::k_null;
+        value = QDateTime::fromMSecsSinceEpoch(e.int64());
+        return true;
+    }
+};
+
+template <>
+struct FieldCodec<BSONoid>
+{
+    static void encode(Writer &w, size_t typePos, const BSONoid &value) {
+        w.setElementType(typePos, bsoncxx::type::k_oid);
+        w.appendBytes(value.data(), 12);
+    }
+    static bool decode(const Element &e, BSONoid &value) {
+        if (e.type != bsoncxx::type::k_oid)
+            return e.type == bsoncxx::type::k_null;
+        value = BSONoid::fromBytes(e.value);
+        return true;
+    }
+};
+
+template <>
+struct FieldCodec<QVariantMap>
+{
+    static void encode(Writer &w, size_t typePos, const QVariantMap &value) {
+        w.setElementType(typePos, bsoncxx::type::k_document);
+        toBson(value, w);
+    }
+    static bool decode(const Element &e, QVariantMap &value) {
+        if (e.type != bsoncxx::type::k_document)
+            return e.type == bsoncxx::type::k_null;
+        value = fromBson(e.value, e.valueSize);
+        return true;
+    }
+};
+
+template <typename T>
+struct FieldCodec<T, typename std::enable_if<StructTraits<T>::defined>::type>
+{
+    static void encode(Writer &w, size_t typePos, const T &value) {
+        w.setElementType(typePos, bsoncxx::type::k_document);
+        encodeStruct(w, value);
+    }
+    static bool decode(const Element &e, T &value) {
+        if (e.type != bsoncxx::type::k_document)
+            return e.type == bsoncxx::type::k_null;
+        decodeStruct(e.value, e.valueSize, value);
+        return true;
+    }
+};
+
+template <typename T>
+struct FieldCodec<QVector<T> > : _private::SequenceCodec<QVector<T> > {};
+
+template <typename T>
+struct FieldCodec<QList<T> > : _private::SequenceCodec<QList<T> > {};
+
+template <typename T>
+struct FieldCodec<std::vector<T> > : _private::SequenceCodec<std::vector<T> > {};
+
+}
+
+#define QBSON_EXPAND(x) x
+#define QBSON_FE_1(M, x) M(x)
+#define QBSON_FE_2(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_1(M, __VA_ARGS__))
+#define QBSON_FE_3(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_2(M, __VA_ARGS__))
+#define QBSON_FE_4(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_3(M, __VA_ARGS__))
+#define QBSON_FE_5(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_4(M, __VA_ARGS__))
+#define QBSON_FE_6(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_5(M, __VA_ARGS__))
+#define QBSON_FE_7(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_6(M, __VA_ARGS__))
+#define QBSON_FE_8(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_7(M, __VA_ARGS__))
+#define QBSON_FE_9(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_8(M, __VA_ARGS__))
+#define QBSON_FE_10(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_9(M, __VA_ARGS__))
+#define QBSON_FE_11(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_10(M, __VA_ARGS__))
+#define QBSON_FE_12(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_11(M, __VA_ARGS__))
+#define QBSON_FE_13(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_12(M, __VA_ARGS__))
+#define QBSON_FE_14(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_13(M, __VA_ARGS__))
+#define QBSON_FE_15(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_14(M, __VA_ARGS__))
+#define QBSON_FE_16(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_15(M, __VA_ARGS__))
+#define QBSON_FE_17(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_16(M, __VA_ARGS__))
+#define QBSON_FE_18(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_17(M, __VA_ARGS__))
+#define QBSON_FE_19(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_18(M, __VA_ARGS__))
+#define QBSON_FE_20(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_19(M, __VA_ARGS__))
+#define QBSON_FE_21(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_20(M, __VA_ARGS__))
+#define QBSON_FE_22(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_21(M, __VA_ARGS__))
+#define QBSON_FE_23(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_22(M, __VA_ARGS__))
+#define QBSON_FE_24(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_23(M, __VA_ARGS__))
+#define QBSON_FE_25(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_24(M, __VA_ARGS__))
+#define QBSON_FE_26(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_25(M, __VA_ARGS__))
+#define QBSON_FE_27(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_26(M, __VA_ARGS__))
+#define QBSON_FE_28(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_27(M, __VA_ARGS__))
+#define QBSON_FE_29(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_28(M, __VA_ARGS__))
+#define QBSON_FE_30(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_29(M, __VA_ARGS__))
+#define QBSON_FE_31(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_30(M, __VA_ARGS__))
+#define QBSON_FE_32(M, x, ...) M(x) QBSON_EXPAND(QBSON_FE_31(M, __VA_ARGS__))
+#define QBSON_FE_SELECT(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, NAME, ...) NAME
+#define QBSON_FOR_EACH(M, ...) \
+    QBSON_EXPAND(QBSON_FE_SELECT(__VA_ARGS__, \
+    QBSON_FE_32, QBSON_FE_31, QBSON_FE_30, QBSON_FE_29, QBSON_FE_28, QBSON_FE_27, QBSON_FE_26, QBSON_FE_25, \
+    QBSON_FE_24, QBSON_FE_23, QBSON_FE_22, QBSON_FE_21, QBSON_FE_20, QBSON_FE_19, QBSON_FE_18, QBSON_FE_17, \
+    QBSON_FE_16, QBSON_FE_15, QBSON_FE_14, QBSON_FE_13, QBSON_FE_12, QBSON_FE_11, QBSON_FE_10, QBSON_FE_9, \
+    QBSON_FE_8, QBSON_FE_7, QBSON_FE_6, QBSON_FE_5, QBSON_FE_4, QBSON_FE_3, QBSON_FE_2, QBSON_FE_1)(M, __VA_ARGS__))
+
+#define QBSON_ENCODE_FIELD(field) \
+    ::BSON::FieldCodec<decltype(value.field)>::encode( \
+        w, w.beginElement(#field, sizeof(#field) - 1), value.field);
+
+#define QBSON_DECODE_FIELD(field) \
+    if (e.keyEquals(#field, sizeof(#field) - 1)) \
+        return ::BSON::FieldCodec<decltype(value.field)>::decode(e, value.field);
+
+///
+/// \brief QBSON_DECLARE_STRUCT declares the BSON fields of \a Type, up to 32
+///
+#define QBSON_DECLARE_STRUCT(Type, ...) \
+    namespace BSON { \
+    template <> \
+    struct StructTraits<Type> \
+    { \
+        static const bool defined = true; \
+        static void encodeFields(Writer &w, const Type &value) { \
+            QBSON_FOR_EACH(QBSON_ENCODE_FIELD, __VA_ARGS__) \
+        } \
+        static bool decodeField(const Element &e, Type &value) { \
+            QBSON_FOR_EACH(QBSON_DECODE_FIELD, __VA_ARGS__) \
+            return true; \
+        } \
+    }; \
+    }
+
+#endif // QBSON_STRUCT_H
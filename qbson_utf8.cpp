@@ -0,0 +1,552 @@
+#include "qbson_utf8.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QBSON_UTF8_X86
+#include <immintrin.h>
+#define QBSON_TARGET_SSE2 __attribute__((target("sse2")))
+#define QBSON_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace {
+
+using std::size_t;
+using std::uint8_t;
+using std::uint16_t;
+using std::uint32_t;
+using std::uint64_t;
+
+///
+/// \brief decodeSequence decodes the non-ASCII sequence starting at \a p
+/// \param n bytes consumed, the maximal ill-formed subpart on error
+/// \return false on ill-formed sequence
+///
+inline bool decodeSequence(const uint8_t *p, size_t avail,
+                           uint32_t &cp, size_t &n) {
+    const uint8_t lead = p[0];
+    uint8_t lo = 0x80;
+    uint8_t hi = 0xBF;
+    size_t length;
+    uint32_t c;
+
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+        c = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        c = lead & 0x0F;
+        if (lead == 0xE0)
+            lo = 0xA0;
+        else if (lead == 0xED)
+            hi = 0x9F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        c = lead & 0x07;
+        if (lead == 0xF0)
+            lo = 0x90;
+        else if (lead == 0xF4)
+            hi = 0x8F;
+    } else {
+        n = 1;
+        return false;
+    }
+
+    size_t i = 1;
+    for (; i < length && i < avail; ++i) {
+        const uint8_t b = p[i];
+        if (b < lo || b > hi)
+            break;
+        c = c << 6 | (b & 0x3F);
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    n = i;
+    if (i < length)
+        return false;
+    cp = c;
+    return true;
+}
+
+///
+/// \brief decodeTo decodes one non-ASCII sequence into \a dst
+/// \return bytes consumed
+///
+inline size_t decodeTo(const uint8_t *p, size_t avail, uint16_t *&dst) {
+    uint32_t cp;
+    size_t n;
+    if (!decodeSequence(p, avail, cp, n)) {
+        *dst++ = 0xFFFD;
+    } else if (cp < 0x10000) {
+        *dst++ = uint16_t(cp);
+    } else {
+        cp -= 0x10000;
+        *dst++ = uint16_t(0xD800 + (cp >> 10));
+        *dst++ = uint16_t(0xDC00 + (cp & 0x3FF));
+    }
+    return n;
+}
+
+///
+/// \brief encodeTo encodes the non-ASCII code unit at \a i into \a dst
+/// \return code units consumed
+///
+inline size_t encodeTo(const uint16_t *data, size_t i, size_t size,
+                       uint8_t *&dst) {
+    uint32_t c = data[i];
+    if (c < 0x800) {
+        *dst++ = uint8_t(0xC0 | c >> 6);
+        *dst++ = uint8_t(0x80 | (c & 0x3F));
+        return 1;
+    }
+    if (c >= 0xD800 && c < 0xDC00 && i + 1 < size &&
+            data[i + 1] >= 0xDC00 && data[i + 1] < 0xE000) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (data[i + 1] - 0xDC00);
+        *dst++ = uint8_t(0xF0 | c >> 18);
+        *dst++ = uint8_t(0x80 | ((c >> 12) & 0x3F));
+        *dst++ = uint8_t(0x80 | ((c >> 6) & 0x3F));
+        *dst++ = uint8_t(0x80 | (c & 0x3F));
+        return 2;
+    }
+    if (c >= 0xD800 && c < 0xE000)
+        c = 0xFFFD;
+    *dst++ = uint8_t(0xE0 | c >> 12);
+    *dst++ = uint8_t(0x80 | ((c >> 6) & 0x3F));
+    *dst++ = uint8_t(0x80 | (c & 0x3F));
+    return 1;
+}
+
+/// true if none of the 8 bytes at \a p has the high bit set
+inline bool isAscii8(const uint8_t *p) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    return !(word & 0x8080808080808080ULL);
+}
+
+bool validateScalar(const uint8_t *p, size_t size) {
+    size_t i = 0;
+    while (i < size) {
+        if (i + 8 <= size && isAscii8(p + i)) {
+            i += 8;
+        } else if (p[i] < 0x80) {
+            ++i;
+        } else {
+            uint32_t cp;
+            size_t n;
+            if (!decodeSequence(p + i, size - i, cp, n))
+                return false;
+            i += n;
+        }
+    }
+    return true;
+}
+
+size_t utf8ToUtf16Scalar(const uint8_t *p, size_t size, uint16_t *out) {
+    uint16_t *dst = out;
+    size_t i = 0;
+    while (i < size) {
+        if (i + 8 <= size && isAscii8(p + i)) {
+            for (size_t k = 0; k < 8; ++k)
+                dst[k] = p[i + k];
+            dst += 8;
+            i += 8;
+        } else if (p[i] < 0x80) {
+            *dst++ = p[i++];
+        } else {
+            i += decodeTo(p + i, size - i, dst);
+        }
+    }
+    return size_t(dst - out);
+}
+
+size_t utf16ToUtf8Scalar(const uint16_t *data, size_t size, uint8_t *out) {
+    uint8_t *dst = out;
+    size_t i = 0;
+    while (i < size) {
+        if (data[i] < 0x80)
+            *dst++ = uint8_t(data[i++]);
+        else
+            i += encodeTo(data, i, size, dst);
+    }
+    return size_t(dst - out);
+}
+
+#ifdef QBSON_UTF8_X86
+
+//
+// SSE2: ASCII runs 16 bytes at a time. The 16 widened or narrowed units are
+// always stored, only the ASCII prefix is kept. The non-ASCII code points
+// that follow are handled by the scalar code up to the next ASCII one. The
+// output bounds of the public functions leave room for these stores.
+//
+
+QBSON_TARGET_SSE2
+bool validateSse2(const uint8_t *p, size_t size) {
+    size_t i = 0;
+    while (i + 16 <= size) {
+        const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+        const unsigned mask = unsigned(_mm_movemask_epi8(v));
+        if (!mask) {
+            i += 16;
+            continue;
+        }
+        i += unsigned(__builtin_ctz(mask));
+        do {
+            uint32_t cp;
+            size_t n;
+            if (!decodeSequence(p + i, size - i, cp, n))
+                return false;
+            i += n;
+        } while (i < size && p[i] >= 0x80);
+    }
+    return validateScalar(p + i, size - i);
+}
+
+QBSON_TARGET_SSE2
+size_t utf8ToUtf16Sse2(const uint8_t *p, size_t size, uint16_t *out) {
+    const __m128i zero = _mm_setzero_si128();
+    uint16_t *dst = out;
+    size_t i = 0;
+    while (i + 16 <= size) {
+        const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+        _mm_storeu_si128((__m128i*) dst, _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128((__m128i*) (dst + 8), _mm_unpackhi_epi8(v, zero));
+        const unsigned mask = unsigned(_mm_movemask_epi8(v));
+        if (!mask) {
+            i += 16;
+            dst += 16;
+            continue;
+        }
+        const unsigned ascii = unsigned(__builtin_ctz(mask));
+        i += ascii;
+        dst += ascii;
+        do {
+            i += decodeTo(p + i, size - i, dst);
+        } while (i < size && p[i] >= 0x80);
+    }
+    return size_t(dst - out) + utf8ToUtf16Scalar(p + i, size - i, dst);
+}
+
+QBSON_TARGET_SSE2
+size_t utf16ToUtf8Sse2(const uint16_t *data, size_t size, uint8_t *out) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i high = _mm_set1_epi16(short(0xFF80));
+    uint8_t *dst = out;
+    size_t i = 0;
+    while (i + 16 <= size) {
+        const __m128i a = _mm_loadu_si128((const __m128i*) (data + i));
+        const __m128i b = _mm_loadu_si128((const __m128i*) (data + i + 8));
+        _mm_storeu_si128((__m128i*) dst, _mm_packus_epi16(a, b));
+        const unsigned ascii =
+                unsigned(_mm_movemask_epi8(
+                             _mm_cmpeq_epi16(_mm_and_si128(a, high), zero))) |
+                unsigned(_mm_movemask_epi8(
+                             _mm_cmpeq_epi16(_mm_and_si128(b, high), zero))) << 16;
+        if (ascii == 0xFFFFFFFFu) {
+            i += 16;
+            dst += 16;
+            continue;
+        }
+        const unsigned n = unsigned(__builtin_ctz(~ascii)) / 2;
+        i += n;
+        dst += n;
+        do {
+            i += encodeTo(data, i, size, dst);
+        } while (i < size && data[i] >= 0x80);
+    }
+    return size_t(dst - out) + utf16ToUtf8Scalar(data + i, size - i, dst);
+}
+
+//
+// AVX2: the transcoders are the SSE2 ones with 32 byte blocks. Validation
+// checks whole blocks with the lookup algorithm of Keiser and Lemire,
+// "Validating UTF-8 In Less Than One Instruction Per Byte": three nibble
+// tables classify each byte pair, the lengths of 3 and 4 byte sequences
+// are checked against the continuation bytes that follow.
+//
+
+QBSON_TARGET_AVX2
+inline __m256i prevBytes1(__m256i input, __m256i prev) {
+    return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 15);
+}
+
+QBSON_TARGET_AVX2
+inline __m256i prevBytes2(__m256i input, __m256i prev) {
+    return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 14);
+}
+
+QBSON_TARGET_AVX2
+inline __m256i prevBytes3(__m256i input, __m256i prev) {
+    return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 13);
+}
+
+QBSON_TARGET_AVX2
+inline __m256i lookup16(__m256i table, __m256i index) {
+    return _mm256_shuffle_epi8(table, index);
+}
+
+QBSON_TARGET_AVX2
+inline __m256i highNibbles(__m256i v) {
+    return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+}
+
+QBSON_TARGET_AVX2
+inline __m256i table16(uint8_t t0, uint8_t t1, uint8_t t2, uint8_t t3,
+                       uint8_t t4, uint8_t t5, uint8_t t6, uint8_t t7,
+                       uint8_t t8, uint8_t t9, uint8_t t10, uint8_t t11,
+                       uint8_t t12, uint8_t t13, uint8_t t14, uint8_t t15) {
+    return _mm256_setr_epi8(
+                char(t0), char(t1), char(t2), char(t3), char(t4), char(t5),
+                char(t6), char(t7), char(t8), char(t9), char(t10), char(t11),
+                char(t12), char(t13), char(t14), char(t15),
+                char(t0), char(t1), char(t2), char(t3), char(t4), char(t5),
+                char(t6), char(t7), char(t8), char(t9), char(t10), char(t11),
+                char(t12), char(t13), char(t14), char(t15));
+}
+
+///
+/// \brief The Avx2Validator class accumulates errors over 32 byte blocks
+///
+class Avx2Validator
+{
+public:
+    QBSON_TARGET_AVX2
+    Avx2Validator() {
+        const uint8_t tooShort = 1 << 0;    // lead byte not followed by continuation
+        const uint8_t tooLong = 1 << 1;     // continuation after ASCII
+        const uint8_t overlong3 = 1 << 2;
+        const uint8_t tooLarge = 1 << 3;
+        const uint8_t surrogate = 1 << 4;
+        const uint8_t overlong2 = 1 << 5;
+        const uint8_t tooLarge1000 = 1 << 6;
+        const uint8_t overlong4 = 1 << 6;
+        const uint8_t twoConts = 1 << 7;    // continuation after continuation
+        const uint8_t carry = tooShort | tooLong | twoConts;
+
+        m_byte1High = table16(
+                    tooLong, tooLong, tooLong, tooLong,
+                    tooLong, tooLong, tooLong, tooLong,
+                    twoConts, twoConts, twoConts, twoConts,
+                    tooShort | overlong2,
+                    tooShort,
+                    tooShort | overlong3 | surrogate,
+                    tooShort | tooLarge | tooLarge1000 | overlong4);
+        m_byte1Low = table16(
+                    carry | overlong3 | overlong2 | overlong4,
+                    carry | overlong2,
+                    carry,
+                    carry,
+                    carry | tooLarge,
+                    carry | tooLarge | tooLarge1000,
+                    carry | tooLarge | tooLarge1000,
+                    carry | tooLarge | tooLarge1000,
+                    carry | tooLarge | tooLarge1000,
+                    carry | tooLarge | tooLarge1000,
+                    carry | tooLarge | tooLarge1000,
+                    carry | tooLarge | tooLarge1000,
+                    carry | tooLarge | tooLarge1000,
+                    carry | tooLarge | tooLarge1000 | surrogate,
+                    carry | tooLarge | tooLarge1000,
+                    carry | tooLarge | tooLarge1000);
+        m_byte2High = table16(
+                    tooShort, tooShort, tooShort, tooShort,
+                    tooShort, tooShort, tooShort, tooShort,
+                    tooLong | overlong2 | twoConts | overlong3 | tooLarge1000 | overlong4,
+                    tooLong | overlong2 | twoConts | overlong3 | tooLarge,
+                    tooLong | overlong2 | twoConts | surrogate | tooLarge,
+                    tooLong | overlong2 | twoConts | surrogate | tooLarge,
+                    tooShort, tooShort, tooShort, tooShort);
+        // a block ending in a lead byte continues in the next one
+        m_incomplete = _mm256_setr_epi8(
+                    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                    char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1));
+        m_error = _mm256_setzero_si256();
+        m_prev = _mm256_setzero_si256();
+        m_prevIncomplete = _mm256_setzero_si256();
+    }
+
+    QBSON_TARGET_AVX2
+    void check(__m256i input) {
+        if (!_mm256_movemask_epi8(input)) {
+            m_error = _mm256_or_si256(m_error, m_prevIncomplete);
+            m_prevIncomplete = _mm256_setzero_si256();
+        } else {
+            const __m256i prev1 = prevBytes1(input, m_prev);
+            const __m256i special = _mm256_and_si256(
+                        _mm256_and_si256(lookup16(m_byte1High, highNibbles(prev1)),
+                                         lookup16(m_byte1Low, _mm256_and_si256(
+                                                      prev1, _mm256_set1_epi8(0x0F)))),
+                        lookup16(m_byte2High, highNibbles(input)));
+
+            // bytes 3 and 4 of a sequence must be continuations, which
+            // the nibble tables expect to see as twoConts
+            const __m256i third = _mm256_subs_epu8(prevBytes2(input, m_prev),
+                                                   _mm256_set1_epi8(char(0xE0 - 0x80)));
+            const __m256i fourth = _mm256_subs_epu8(prevBytes3(input, m_prev),
+                                                    _mm256_set1_epi8(char(0xF0 - 0x80)));
+            const __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                                                    _mm256_set1_epi8(char(0x80)));
+            m_error = _mm256_or_si256(m_error, _mm256_xor_si256(must23, special));
+            m_prevIncomplete = _mm256_subs_epu8(input, m_incomplete);
+        }
+        m_prev = input;
+    }
+
+    QBSON_TARGET_AVX2
+    bool finish() {
+        const __m256i error = _mm256_or_si256(m_error, m_prevIncomplete);
+        return _mm256_testz_si256(error, error);
+    }
+
+private:
+    __m256i m_byte1High;
+    __m256i m_byte1Low;
+    __m256i m_byte2High;
+    __m256i m_incomplete;
+    __m256i m_error;
+    __m256i m_prev;
+    __m256i m_prevIncomplete;
+};
+
+QBSON_TARGET_AVX2
+bool validateAvx2(const uint8_t *p, size_t size) {
+    Avx2Validator validator;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+        validator.check(_mm256_loadu_si256((const __m256i*) (p + i)));
+    if (i < size) {
+        // zero padding is ASCII, so a truncated tail sequence is too short
+        uint8_t tail[32] = {};
+        std::memcpy(tail, p + i, size - i);
+        validator.check(_mm256_loadu_si256((const __m256i*) tail));
+    }
+    return validator.finish();
+}
+
+QBSON_TARGET_AVX2
+size_t utf8ToUtf16Avx2(const uint8_t *p, size_t size, uint16_t *out) {
+    uint16_t *dst = out;
+    size_t i = 0;
+    while (i + 32 <= size) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*) (p + i));
+        _mm256_storeu_si256((__m256i*) dst,
+                            _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+        _mm256_storeu_si256((__m256i*) (dst + 16),
+                            _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+        const unsigned mask = unsigned(_mm256_movemask_epi8(v));
+        if (!mask) {
+            i += 32;
+            dst += 32;
+            continue;
+        }
+        const unsigned ascii = unsigned(__builtin_ctz(mask));
+        i += ascii;
+        dst += ascii;
+        do {
+            i += decodeTo(p + i, size - i, dst);
+        } while (i < size && p[i] >= 0x80);
+    }
+    return size_t(dst - out) + utf8ToUtf16Sse2(p + i, size - i, dst);
+}
+
+QBSON_TARGET_AVX2
+size_t utf16ToUtf8Avx2(const uint16_t *data, size_t size, uint8_t *out) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i high = _mm256_set1_epi16(short(0xFF80));
+    uint8_t *dst = out;
+    size_t i = 0;
+    while (i + 32 <= size) {
+        const __m256i a = _mm256_loadu_si256((const __m256i*) (data + i));
+        const __m256i b = _mm256_loadu_si256((const __m256i*) (data + i + 16));
+        // packus works per 128 bit lane, restore the order of the units
+        _mm256_storeu_si256((__m256i*) dst, _mm256_permute4x64_epi64(
+                                _mm256_packus_epi16(a, b), 0xD8));
+        const uint64_t ascii =
+                uint64_t(unsigned(_mm256_movemask_epi8(
+                             _mm256_cmpeq_epi16(_mm256_and_si256(a, high), zero)))) |
+                uint64_t(unsigned(_mm256_movemask_epi8(
+                             _mm256_cmpeq_epi16(_mm256_and_si256(b, high), zero)))) << 32;
+        if (ascii == ~uint64_t(0)) {
+            i += 32;
+            dst += 32;
+            continue;
+        }
+        const size_t n = size_t(__builtin_ctzll(~ascii)) / 2;
+        i += n;
+        dst += n;
+        do {
+            i += encodeTo(data, i, size, dst);
+        } while (i < size && data[i] >= 0x80);
+    }
+    return size_t(dst - out) + utf16ToUtf8Sse2(data + i, size - i, dst);
+}
+
+#endif // QBSON_UTF8_X86
+
+struct Kernels
+{
+    BSON::SimdLevel level;
+    bool (*validate)(const uint8_t *, size_t);
+    size_t (*toUtf16)(const uint8_t *, size_t, uint16_t *);
+    size_t (*toUtf8)(const uint16_t *, size_t, uint8_t *);
+};
+
+Kernels selectKernels() {
+    using BSON::SimdLevel;
+    SimdLevel level = SimdLevel::Scalar;
+#ifdef QBSON_UTF8_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        level = SimdLevel::AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        level = SimdLevel::SSE2;
+#endif
+
+    if (const char *env = std::getenv("QBSON_SIMD")) {
+        if (!std::strcmp(env, "scalar"))
+            level = SimdLevel::Scalar;
+        else if (!std::strcmp(env, "sse2") && level > SimdLevel::SSE2)
+            level = SimdLevel::SSE2;
+    }
+
+    switch (level) {
+#ifdef QBSON_UTF8_X86
+    case SimdLevel::AVX2:
+        return {level, validateAvx2, utf8ToUtf16Avx2, utf16ToUtf8Avx2};
+    case SimdLevel::SSE2:
+        return {level, validateSse2, utf8ToUtf16Sse2, utf16ToUtf8Sse2};
+#endif
+    default:
+        return {SimdLevel::Scalar, validateScalar,
+                    utf8ToUtf16Scalar, utf16ToUtf8Scalar};
+    }
+}
+
+const Kernels &kernels() {
+    static const Kernels k = selectKernels();
+    return k;
+}
+
+}
+
+namespace BSON {
+
+SimdLevel utf8SimdLevel() {
+    return kernels().level;
+}
+
+bool validateUtf8(const char *data, size_t size) {
+    return kernels().validate((const uint8_t*) data, size);
+}
+
+size_t utf8ToUtf16(const char *data, size_t size, uint16_t *out) {
+    return kernels().toUtf16((const uint8_t*) data, size, out);
+}
+
+size_t utf16ToUtf8(const uint16_t *data, size_t size, uint8_t *out) {
+    return kernels().toUtf8(data, size, out);
+}
+
+}
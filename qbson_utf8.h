@@ -0,0 +1,66 @@
+#ifndef QBSON_UTF8_H
+#define QBSON_UTF8_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace BSON {
+
+///
+/// UTF-8 kernels used for BSON strings and keys
+///
+/// Each function exists as scalar, SSE2 and AVX2 implementation. The widest
+/// one the CPU supports is chosen once, at first use. Setting the
+/// environment variable QBSON_SIMD to "scalar" or "sse2" caps the choice,
+/// e.g. to compare the implementations.
+///
+/// Runs of ASCII are handled 16 or 32 bytes at a time, other code points
+/// fall back to the scalar decoder at the position where they occur.
+///
+
+///
+/// \brief The SimdLevel enum names the UTF-8 kernel in use
+///
+enum class SimdLevel {
+    Scalar,
+    SSE2,
+    AVX2
+};
+
+///
+/// \brief utf8SimdLevel
+/// \return kernel selected for this CPU
+///
+SimdLevel utf8SimdLevel();
+
+///
+/// \brief validateUtf8 checks \a data for well-formed UTF-8
+///
+/// Overlong forms, surrogates and code points above U+10FFFF are rejected.
+///
+bool validateUtf8(const char *data, std::size_t size);
+
+///
+/// \brief utf8ToUtf16 transcodes UTF-8 into UTF-16
+///
+/// Each maximal ill-formed subsequence is written as one U+FFFD.
+///
+/// \param out buffer of at least \a size code units
+/// \return number of code units written
+///
+std::size_t utf8ToUtf16(const char *data, std::size_t size, std::uint16_t *out);
+
+///
+/// \brief utf16ToUtf8 transcodes UTF-16 into UTF-8
+///
+/// Unpaired surrogates are written as U+FFFD.
+///
+/// \param out buffer of at least 3 * \a size bytes
+/// \return number of bytes written
+///
+std::size_t utf16ToUtf8(const std::uint16_t *data, std::size_t size,
+                        std::uint8_t *out);
+
+}
+
+#endif // QBSON_UTF8_H
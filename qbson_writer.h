@@ -0,0 +1,305 @@
+#ifndef QBSON_WRITER_H
+#define QBSON_WRITER_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <bsoncxx/types.hpp>
+
+#include "qbson_utf8.h"
+
+namespace BSON {
+
+///
+/// \brief The Writer class encodes BSON wire format into one growable buffer
+///
+/// Documents and arrays are opened with a placeholder length prefix that is
+/// back-patched when they are closed, so nested values are written once, in
+/// place, and never copied between intermediate builders.
+///
+/// The buffer is allocated with malloc so that release() can hand it over to
+/// a bsoncxx::document::value together with freeBuffer() as deleter.
+///
+class Writer
+{
+public:
+    Writer() : m_data(nullptr), m_size(0), m_capacity(0) {}
+    ~Writer() { std::free(m_data); }
+
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+
+    /// returned instead of an element offset for a rejected name
+    static const std::size_t npos = std::size_t(-1);
+
+    const std::uint8_t *data() const { return m_data; }
+
+    ///
+    /// \brief mutableData gives write access to the bytes already appended
+    ///
+    std::uint8_t *mutableData() { return m_data; }
+    std::size_t size() const { return m_size; }
+    std::size_t capacity() const { return m_capacity; }
+
+    ///
+    /// \brief clear drops the content but keeps the allocated capacity
+    ///
+    void clear() { m_size = 0; }
+
+    ///
+    /// \brief truncate rolls the buffer back to \a size bytes
+    ///
+    void truncate(std::size_t size) { if (size < m_size) m_size = size; }
+
+    ///
+    /// \brief discardFront drops the first \a n bytes and keeps the rest
+    ///
+    void discardFront(std::size_t n) {
+        if (n >= m_size) {
+            m_size = 0;
+            return;
+        }
+        if (n)
+            std::memmove(m_data, m_data + n, m_size - n);
+        m_size -= n;
+    }
+
+    void reserve(std::size_t capacity) {
+        if (capacity <= m_capacity)
+            return;
+        std::uint8_t *data = (std::uint8_t*) std::realloc(m_data, capacity);
+        if (!data)
+            throw std::bad_alloc();
+        m_data = data;
+        m_capacity = capacity;
+    }
+
+    ///
+    /// \brief release hands the malloc'ed buffer over to the caller
+    /// \return buffer to be freed with freeBuffer(), the writer is empty after
+    ///
+    std::uint8_t *release() {
+        std::uint8_t *data = m_data;
+        m_data = nullptr;
+        m_size = 0;
+        m_capacity = 0;
+        return data;
+    }
+
+    static void freeBuffer(std::uint8_t *data) { std::free(data); }
+
+    ///
+    /// \brief grow appends \a n uninitialized bytes
+    /// \return pointer to the first appended byte
+    ///
+    std::uint8_t *grow(std::size_t n) {
+        if (m_size + n > m_capacity) {
+            std::size_t capacity = m_capacity ? m_capacity * 2 : 256;
+            while (capacity < m_size + n)
+                capacity *= 2;
+            reserve(capacity);
+        }
+        std::uint8_t *res = m_data + m_size;
+        m_size += n;
+        return res;
+    }
+
+    ///
+    /// \brief splice replaces \a removed bytes at \a pos by \a inserted
+    /// uninitialized bytes, the bytes behind move once
+    /// \return pointer to the inserted bytes
+    ///
+    std::uint8_t *splice(std::size_t pos, std::size_t removed, std::size_t inserted) {
+        const std::size_t tail = m_size - pos - removed;
+        if (inserted > removed)
+            grow(inserted - removed);
+        if (inserted != removed)
+            std::memmove(m_data + pos + inserted, m_data + pos + removed, tail);
+        m_size = pos + inserted + tail;
+        return m_data + pos;
+    }
+
+    void appendByte(std::uint8_t byte) { *grow(1) = byte; }
+
+    void appendBytes(const void *data, std::size_t size) {
+        if (size)
+            std::memcpy(grow(size), data, size);
+    }
+
+    void appendInt32(std::int32_t value) { storeInt32(grow(4), value); }
+    void appendInt64(std::int64_t value) { storeInt64(grow(8), value); }
+
+    void appendDouble(double value) {
+        std::int64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        appendInt64(bits);
+    }
+
+    void patchInt32(std::size_t offset, std::int32_t value) {
+        storeInt32(m_data + offset, value);
+    }
+
+    ///
+    /// \brief appendCString writes \a data followed by a terminating zero
+    ///
+    void appendCString(const char *data, std::size_t size) {
+        std::uint8_t *dst = grow(size + 1);
+        if (size)
+            std::memcpy(dst, data, size);
+        dst[size] = 0;
+    }
+
+    ///
+    /// \brief appendString writes a length prefixed, zero terminated string
+    ///
+    void appendString(const char *data, std::size_t size) {
+        appendInt32((std::int32_t) size + 1);
+        appendCString(data, size);
+    }
+
+    void appendBinary(bsoncxx::binary_sub_type subType,
+                      const void *data, std::size_t size) {
+        appendInt32((std::int32_t) size);
+        appendByte((std::uint8_t) subType);
+        appendBytes(data, size);
+    }
+
+    ///
+    /// \brief appendKey writes element type and name of the next element
+    ///
+    void appendKey(bsoncxx::type type, const char *key, std::size_t size) {
+        appendByte((std::uint8_t) type);
+        appendCString(key, size);
+    }
+
+    ///
+    /// \brief beginElement writes a placeholder element type and the name
+    /// \return offset of the element type, to be set with setElementType()
+    ///
+    std::size_t beginElement(const char *key, std::size_t size) {
+        const std::size_t pos = m_size;
+        appendByte(0);
+        appendCString(key, size);
+        return pos;
+    }
+
+    ///
+    /// \brief beginElementUtf16 is beginElement() with a UTF-16 name
+    /// \return npos and nothing written if the name contains U+0000
+    ///
+    std::size_t beginElementUtf16(const std::uint16_t *key, std::size_t size) {
+        const std::size_t pos = m_size;
+        appendByte(0);
+        const std::size_t length = appendUtf16(key, size);
+        if (std::memchr(m_data + pos + 1, 0, length)) {
+            m_size = pos;
+            return npos;
+        }
+        appendByte(0);
+        return pos;
+    }
+
+    ///
+    /// \brief beginIndexElement is beginElement() named by an array \a index
+    ///
+    std::size_t beginIndexElement(std::uint32_t index) {
+        char buf[10];
+        return beginElement(buf, formatIndex(index, buf));
+    }
+
+    void setElementType(std::size_t pos, bsoncxx::type type) {
+        m_data[pos] = std::uint8_t(type);
+    }
+
+    ///
+    /// \brief appendUtf16 transcodes UTF-16 into UTF-8
+    ///
+    /// Unpaired surrogates are written as U+FFFD. Nothing is terminated.
+    ///
+    /// \return number of bytes appended
+    ///
+    std::size_t appendUtf16(const std::uint16_t *data, std::size_t size) {
+        std::uint8_t *const start = grow(size * 3);
+        const std::size_t res = utf16ToUtf8(data, size, start);
+        m_size -= size * 3 - res;
+        return res;
+    }
+
+    ///
+    /// \brief appendStringUtf16 writes a UTF-16 string as BSON string
+    ///
+    void appendStringUtf16(const std::uint16_t *data, std::size_t size) {
+        const std::size_t start = m_size;
+        appendInt32(0);
+        const std::size_t length = appendUtf16(data, size);
+        appendByte(0);
+        patchInt32(start, std::int32_t(length + 1));
+    }
+
+    ///
+    /// \brief appendIndexKey writes an array element header named by \a index
+    ///
+    void appendIndexKey(bsoncxx::type type, std::uint32_t index) {
+        char buf[10];
+        appendKey(type, buf, formatIndex(index, buf));
+    }
+
+    ///
+    /// \brief formatIndex writes the decimal array key of \a index into \a buf
+    /// \return key length, \a buf must hold at least 10 characters
+    ///
+    static std::size_t formatIndex(std::uint32_t index, char *buf) {
+        char tmp[10];
+        std::size_t n = 0;
+        do {
+            tmp[n++] = char('0' + index % 10);
+            index /= 10;
+        } while (index);
+        for (std::size_t i = 0; i < n; ++i)
+            buf[i] = tmp[n - 1 - i];
+        return n;
+    }
+
+    ///
+    /// \brief beginDocument opens a document or array body
+    /// \return offset to pass to endDocument()
+    ///
+    std::size_t beginDocument() {
+        std::size_t start = m_size;
+        appendInt32(0);
+        return start;
+    }
+
+    ///
+    /// \brief endDocument terminates the body and back-patches its length
+    ///
+    void endDocument(std::size_t start) {
+        appendByte(0);
+        patchInt32(start, std::int32_t(m_size - start));
+    }
+
+    static void storeInt32(std::uint8_t *dst, std::int32_t value) {
+        std::uint32_t v = (std::uint32_t) value;
+        dst[0] = std::uint8_t(v);
+        dst[1] = std::uint8_t(v >> 8);
+        dst[2] = std::uint8_t(v >> 16);
+        dst[3] = std::uint8_t(v >> 24);
+    }
+
+    static void storeInt64(std::uint8_t *dst, std::int64_t value) {
+        std::uint64_t v = (std::uint64_t) value;
+        for (int i = 0; i < 8; ++i)
+            dst[i] = std::uint8_t(v >> (8 * i));
+    }
+
+private:
+    std::uint8_t *m_data;
+    std::size_t m_size;
+    std::size_t m_capacity;
+};
+
+}
+
+#endif // QBSON_WRITER_H